@@ -1,69 +1,77 @@
 #!/bin/sh
 
-#outputdir=result-ixgbe-pps-wo-mc
+# pps sweep on a single host. netdevgen counts generated, accepted
+# and dropped packets itself. accepted means queued to the ixgbe
+# driver, not received by a peer.
 
-
-
-
-interface=eth1
 ndgproc=/proc/driver/netdevgen
 
 netdevgen=~/work/madcap/netdevgen/netdevgen.ko
 
-pktgen_host=130.69.250.223
-pktgen_path=/home/upa/work/netmap/examples/pkt-gen
-pktgen_intf=p2p1
-pktgen_cont=70
-
+duration=60
 
 protocol="$1"
 if [ "$protocol" = "" ]; then
-	echo "\"$0 {noencap|ipip|gre|gretap|vxlan|nsh} [OUTPUTDIR]\""
-	exit
+        echo "\"$0 {noencap|ipip|gre|gretap|vxlan|nsh} [OUTPUTDIR] [SECONDS]\""
+        exit
 fi
 
 outputdir=$2
 if [ "$outputdir" = "" ]; then
-	echo output to stdout
+        echo output to stdout
+fi
+
+if [ ! "$3" = "" ]; then
+	duration=$3
 fi
 
+pktlens="50,114,242,498,1010,1486"
 
 sudo rmmod netdevgen
+sudo insmod $netdevgen measure_pps=1
+sleep 1
 
+# one run sweeps all sizes, $duration seconds for each
+echo "sizes sweep step=$duration $pktlens" > $ndgproc
 
-for pktlen in 50 114 242 498 1010 1486; do
-#for pktlen in 50; do
+echo xmit $protocol packet, pktlen $pktlens, $duration seconds each
+echo $protocol > $ndgproc
 
+while ! grep -q "state=done" $ndgproc; do
 	sleep 1
-	sudo insmod $netdevgen measure_pps=1 pktlen="$pktlen"
-	sleep 1
-
-
-
-
+done
 
-	sh -c "echo wait; sleep 10; echo xmit $protocol packet, pktlen is $pktlen; echo $protocol > $ndgproc" &
+for pktlen in `echo $pktlens | tr , ' '`; do
 
 	fpktlen=`expr $pktlen + 14`
-
-
-	echo start ssh
+	file=$outputdir/result-$fpktlen-$protocol.txt
+
+	# sum up threads for the size
+	summary=`grep "^size .* pktlen=$pktlen " $ndgproc | \
+		awk -v p=$fpktlen -v proto=$protocol '
+		{
+			for (i = 2; i <= NF; i++) {
+				split($i, kv, "=");
+				if (kv[1] !~ /^(thread|cpu|pktlen)$/)
+					sum[kv[1]] += kv[2];
+			}
+		}
+		END {
+			printf "pktlen=%d protocol=%s", p, proto;
+			n = split("packets accepted dropped bytes pps accepted_pps bps", k, " ");
+			for (i = 1; i <= n; i++)
+				printf " %s=%.0f", k[i], sum[k[i]];
+			printf "\n";
+		}'`
 
 	if [ "$outputdir" = "" ]; then
-		echo output to stdout
-		ssh -t $pktgen_host \
-		"sudo $pktgen_path -i $pktgen_intf -f rx -N $pktgen_cont" 
+		echo $summary
 	else
-		ssh -t $pktgen_host \
-		"sudo $pktgen_path -i $pktgen_intf -f rx -N $pktgen_cont" \
-		> $outputdir/result-$fpktlen-$protocol.txt
+		echo outputfile is $file
+		echo $summary >> $file
 	fi
-
-
-
-	echo stop > $ndgproc
-	sleep 1
-	sudo rmmod netdevgen
-
 done
 
+echo stop > $ndgproc
+sleep 1
+sudo rmmod netdevgen
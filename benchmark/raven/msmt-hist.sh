@@ -0,0 +1,47 @@
+#!/bin/sh
+
+# per-stage latency percentiles under sustained load.
+# raven and kernel must be built with OVBENCH.
+
+protocol="$1"
+if [ "$protocol" = "" ]; then
+        echo "\"$0 {noencap|ipip|gre|gretap|vxlan|nsh} [OUTPUTDIR] [SECONDS]\""
+        exit
+fi
+
+outputdir=$2
+if [ "$outputdir" = "" ]; then
+        echo output to stdout
+fi
+
+duration=$3
+if [ "$duration" = "" ]; then
+	duration=10
+fi
+
+ndgproc=/proc/driver/netdevgen
+netdevgen=~/work/madcap/netdevgen/netdevgen.ko
+
+histproc=/proc/driver/raven-hist
+
+sudo rmmod netdevgen
+sudo insmod $netdevgen measure_pps=1
+
+echo xmit $protocol packet for $duration seconds
+echo $protocol > $ndgproc
+sleep 1
+
+# drop samples taken while the generator was ramping up
+echo reset > $histproc
+sleep $duration
+echo stop > $ndgproc
+
+if [ ! "$outputdir" = "" ]; then
+	file=$outputdir/hist-$protocol.txt
+	echo outputfile is $file
+	cat $histproc > $file
+else
+	cat $histproc
+fi
+
+sudo rmmod netdevgen
@@ -0,0 +1,55 @@
+#!/bin/sh
+
+# decapsulation pps on a single host. netdevgen injects frames
+# encapsulated for the protocol into the rx path of raven, and counts
+# decapsulated packets at the tunnel device.
+
+ndgproc=/proc/driver/netdevgen
+
+netdevgen=~/work/madcap/netdevgen/netdevgen.ko
+
+dev=r0
+duration=10
+
+protocol="$1"
+if [ "$protocol" = "" ]; then
+        echo "\"$0 {noencap|ipip|gre|gretap|vxlan|nsh} [OUTPUTDIR] [SECONDS]\""
+        exit
+fi
+
+outputdir=$2
+if [ "$outputdir" = "" ]; then
+        echo output to stdout
+fi
+
+if [ ! "$3" = "" ]; then
+	duration=$3
+fi
+
+sudo rmmod netdevgen
+sudo insmod $netdevgen measure_pps=1
+sleep 1
+
+echo "rx $dev" > $ndgproc
+
+echo recv $protocol packet on $dev, $duration seconds
+echo "$protocol duration=$duration" > $ndgproc
+
+while ! grep -q "state=done" $ndgproc; do
+	sleep 1
+done
+
+summary=`grep "^sink " $ndgproc | sed "s/^sink /protocol=$protocol /"`
+
+if [ "$outputdir" = "" ]; then
+	echo $summary
+else
+	file=$outputdir/result-rx-$protocol.txt
+	echo outputfile is $file
+	echo $summary >> $file
+fi
+
+echo stop > $ndgproc
+echo "rx off" > $ndgproc
+sleep 1
+sudo rmmod netdevgen
@@ -0,0 +1,153 @@
+/*
+ * raven-record: dump per-packet stage timestamp records from
+ * /proc/driver/raven-record (raven built with OVBENCH).
+ *
+ * gcc -O2 -Wall -I../../include raven-record.c -o raven-record
+ *
+ * ./raven-record [-t] [-c COUNT] > records
+ *   binary struct raven_record are written to stdout.
+ *   -t writes them in text, one record per line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <linux/types.h>
+
+#include <raven.h>
+
+#define RECORD_PROC	"/proc/driver/raven-record"
+
+static volatile int stop = 0;
+
+static void
+sig_handler (int sig)
+{
+	stop = 1;
+}
+
+static void
+print_record (FILE *fp, struct raven_record *rec, int text)
+{
+	int n;
+
+	if (!text) {
+		fwrite (rec, sizeof (*rec), 1, fp);
+		return;
+	}
+
+	fprintf (fp, "%u %u %u %u", rec->cpu, rec->queue,
+		 rec->type, rec->encaped);
+	for (n = 0; n < rec->nstamps && n < RAVEN_RECORD_STAMPS; n++)
+		fprintf (fp, " %llu", (unsigned long long) rec->stamp[n]);
+	fprintf (fp, "\n");
+}
+
+static unsigned long
+drain (struct raven_ring_hdr *hdr, int text)
+{
+	/* read records between tail and head, then advance tail. */
+	unsigned long cnt = 0;
+	__u64 head, tail;
+	char *data = (char *) hdr + hdr->data_offset;
+
+	head = *(volatile __u64 *) &hdr->head;
+	__sync_synchronize ();	/* read slots after head */
+
+	for (tail = hdr->tail; tail != head; tail++, cnt++)
+		print_record (stdout, (struct raven_record *)
+			      (data + (tail % hdr->nslots) * hdr->slot_size),
+			      text);
+
+	__sync_synchronize ();	/* finish reading before releasing */
+	*(volatile __u64 *) &hdr->tail = tail;
+
+	return cnt;
+}
+
+static void
+usage (void)
+{
+	printf ("usage: raven-record [-t] [-c COUNT]\n"
+		"    -t: text output\n"
+		"    -c: stop after COUNT records\n");
+}
+
+int
+main (int argc, char **argv)
+{
+	int fd, ch, cpu, ncpus, text = 0;
+	unsigned long count = 0, total = 0, cnt;
+	struct raven_ring_hdr *hdr;
+	char *area;
+	size_t size;
+
+	while ((ch = getopt (argc, argv, "tc:h")) != -1) {
+		switch (ch) {
+		case 't' :
+			text = 1;
+			break;
+		case 'c' :
+			count = strtoul (optarg, NULL, 10);
+			break;
+		default :
+			usage ();
+			return -1;
+		}
+	}
+
+	fd = open (RECORD_PROC, O_RDWR);
+	if (fd < 0) {
+		perror ("open");
+		return -1;
+	}
+
+	/* map the first ring to know the size of a ring */
+	hdr = mmap (NULL, sizeof (*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror ("mmap");
+		return -1;
+	}
+	size = hdr->size;
+	munmap (hdr, sizeof (*hdr));
+
+	/* proc files have no size, so try the number of possible cpus */
+	ncpus = sysconf (_SC_NPROCESSORS_CONF);
+	area = mmap (NULL, size * ncpus, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	if (area == MAP_FAILED) {
+		perror ("mmap");
+		return -1;
+	}
+
+	signal (SIGINT, sig_handler);
+	signal (SIGTERM, sig_handler);
+
+	while (!stop && (!count || total < count)) {
+		cnt = 0;
+		for (cpu = 0; cpu < ncpus; cpu++)
+			cnt += drain ((struct raven_ring_hdr *)
+				      (area + size * cpu), text);
+		total += cnt;
+		if (!cnt)
+			usleep (100);
+	}
+
+	fflush (stdout);
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		hdr = (struct raven_ring_hdr *) (area + size * cpu);
+		fprintf (stderr, "cpu %d: records %llu, drops %llu\n", cpu,
+			 (unsigned long long) hdr->head,
+			 (unsigned long long) hdr->drops);
+	}
+
+	munmap (area, size * ncpus);
+	close (fd);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/awk -f
+#
+# rebuild per-stage breakdown from madcap:madcap_stage events.
+#
+# input is /sys/kernel/debug/tracing/trace with trace_clock x86-tsc.
+# events of a packet are tied by skbaddr, from gen-xmit to
+# raven-xmit or sfmc-encap, or from gen-recv to sink-recv with
+# netdevgen rx. Stage names are same as /proc/driver/raven and
+# /proc/driver/raven-hist. Output is count and mean clocks of each
+# stage.
+
+function stage(name, start, end) {
+	if (!(start in ts) || !(end in ts) || ts[start] > ts[end])
+		return
+	count[name]++
+	sum[name] += ts[end] - ts[start]
+	if (!(name in order)) {
+		order[name] = ++norder
+		names[norder] = name
+	}
+}
+
+function flush(skb,	first, n, nst, sts) {
+	split("", ts)
+	nst = split(seen[skb], sts)
+	for (n = 1; n <= nst; n++) {
+		ts[sts[n]] = pkt[skb, sts[n]]
+		delete pkt[skb, sts[n]]
+	}
+	delete seen[skb]
+
+	stage("inner-tx", "gen-xmit", "proto-xmit")
+	if ("madcap-xmit" in ts)
+		stage("protocol-path", "proto-xmit", "madcap-xmit")
+	else
+		stage("protocol-path", "proto-xmit", "tunnel-xmit")
+	stage("build-nsh", "proto-lookup", "build-start")
+	stage("routing-lookup", "route-start", "route-end")
+	if ("build-end" in ts)
+		stage("build", "build-start", "build-end")
+	else if ("madcap-xmit" in ts)
+		stage("build", "build-start", "madcap-xmit")
+	else
+		stage("build", "build-start", "tunnel-xmit")
+
+	first = ("madcap-xmit" in ts) ? "madcap-xmit" : "tunnel-xmit"
+	if ("raven-xmit" in ts) {
+		stage("outer-tx", first, "raven-xmit")
+		stage("total-tx", "gen-xmit", "raven-xmit")
+	} else {
+		stage("outer-tx", first, "sfmc-encap")
+		stage("total-tx", "gen-xmit", "sfmc-encap")
+	}
+
+	# rx, no proto-recv with noencap
+	stage("outer-rx", "gen-recv", "proto-recv")
+	stage("decap", "proto-recv", "sink-recv")
+	stage("total-rx", "gen-recv", "sink-recv")
+}
+
+/ madcap_stage: / {
+	for (n = 1; n <= NF; n++) {
+		if ($n ~ /^madcap_stage:$/)
+			clock = $(n - 1)
+		else if ($n ~ /^skbaddr=/)
+			skb = substr($n, 9)
+		else if ($n ~ /^stage=/)
+			st = substr($n, 7)
+	}
+	sub(/:$/, "", clock)
+
+	if ((st == "gen-xmit" || st == "gen-recv") && (skb, st) in pkt)
+		flush(skb)	# skb is recycled
+
+	pkt[skb, st] = clock
+	seen[skb] = seen[skb] " " st
+	if (st == "raven-xmit" || st == "sfmc-encap" || st == "sink-recv")
+		flush(skb)
+}
+
+/ madcap_drop: / {
+	drops++
+}
+
+END {
+	printf "%-16s %12s %10s\n", "stage", "count", "mean"
+	for (n = 1; n <= norder; n++)
+		printf "%-16s %12d %10.1f\n", names[n], count[names[n]],
+			sum[names[n]] / count[names[n]]
+	printf "%-16s %12d\n", "drops", drops
+}
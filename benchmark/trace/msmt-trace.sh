@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# per-stage breakdown of tx path on a stock kernel, using madcap
+# tracepoints instead of OVBENCH timestamps in sk_buff.
+
+protocol="$1"
+if [ "$protocol" = "" ]; then
+        echo "\"$0 {noencap|ipip|gre|gretap|vxlan|nsh} [OUTPUTDIR] [SECONDS]\""
+        exit
+fi
+
+outputdir=$2
+if [ "$outputdir" = "" ]; then
+        echo output to stdout
+fi
+
+duration=$3
+if [ "$duration" = "" ]; then
+	duration=1
+fi
+
+ndgproc=/proc/driver/netdevgen
+netdevgen=~/work/madcap/netdevgen/netdevgen.ko
+
+tracing=/sys/kernel/debug/tracing
+events=$tracing/events/madcap
+stages=`dirname $0`/madcap-stages.awk
+
+sudo rmmod netdevgen
+sudo insmod $netdevgen measure_pps=1
+
+# raw clocks, same as OVBENCH
+echo x86-tsc | sudo tee $tracing/trace_clock > /dev/null
+echo 16384 | sudo tee $tracing/buffer_size_kb > /dev/null
+echo | sudo tee $tracing/trace > /dev/null
+
+echo 1 | sudo tee $events/enable > /dev/null
+echo xmit $protocol packet for $duration seconds
+echo $protocol > $ndgproc
+sleep $duration
+echo stop > $ndgproc
+echo 0 | sudo tee $events/enable > /dev/null
+
+if [ ! "$outputdir" = "" ]; then
+	file=$outputdir/trace-$protocol.txt
+	echo outputfile is $file
+	sudo cat $tracing/trace | awk -f $stages > $file
+else
+	sudo cat $tracing/trace | awk -f $stages
+fi
+
+sudo rmmod netdevgen
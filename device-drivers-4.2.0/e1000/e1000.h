@@ -188,6 +188,8 @@ struct e1000_tx_ring {
 	u16 tdh;
 	u16 tdt;
 	bool last_tx_tso;
+	/* skbs deferred for madcap burst */
+	struct sfmc_burst sfmc_burst;
 };
 
 struct e1000_rx_ring {
@@ -131,6 +131,8 @@ static void e1000_watchdog(struct work_struct *work);
 static void e1000_82547_tx_fifo_stall_task(struct work_struct *work);
 static netdev_tx_t e1000_xmit_frame(struct sk_buff *skb,
 				    struct net_device *netdev);
+static netdev_tx_t e1000_sfmc_flush(struct e1000_adapter *adapter,
+				    struct sk_buff *cur);
 static struct net_device_stats * e1000_get_stats(struct net_device *netdev);
 static int e1000_change_mtu(struct net_device *netdev, int new_mtu);
 static int e1000_set_mac(struct net_device *netdev, void *p);
@@ -2003,6 +2005,9 @@ static void e1000_clean_tx_ring(struct e1000_adapter *adapter,
 		e1000_unmap_and_free_tx_resource(adapter, buffer_info);
 	}
 
+	/* Free sk_buffs deferred for madcap burst */
+	sfmc_burst_purge (&tx_ring->sfmc_burst);
+
 	netdev_reset_queue(adapter->netdev);
 	size = sizeof(struct e1000_tx_buffer) * tx_ring->count;
 	memset(tx_ring->buffer_info, 0, size);
@@ -3108,8 +3113,8 @@ static int e1000_maybe_stop_tx(struct net_device *netdev,
 }
 
 #define TXD_USE_COUNT(S, X) (((S) >> (X)) + 1 )
-static netdev_tx_t e1000_xmit_frame(struct sk_buff *skb,
-				    struct net_device *netdev)
+static netdev_tx_t __e1000_xmit_frame(struct sk_buff *skb,
+				      struct net_device *netdev)
 {
 	struct e1000_adapter *adapter = netdev_priv(netdev);
 	struct e1000_hw *hw = &adapter->hw;
@@ -3125,9 +3130,6 @@ static netdev_tx_t e1000_xmit_frame(struct sk_buff *skb,
 	unsigned int f;
 	__be16 protocol = vlan_get_protocol(skb);
 
-	/* madcap software emulation */
-	sfmc_encap_packet (skb, netdev);
-
 	/* This goes back to the question of how to logically map a Tx queue
 	 * to a flow.  Right now, performance is impacted slightly negatively
 	 * if using multiple Tx queues.  If the stack breaks away from a
@@ -3285,6 +3287,67 @@ static netdev_tx_t e1000_xmit_frame(struct sk_buff *skb,
 	return NETDEV_TX_OK;
 }
 
+/**
+ * e1000_sfmc_flush - encapsulate and send skbs deferred for madcap
+ * @adapter: board private structure, with the tx queue locked
+ * @cur: skb given to ndo_start_xmit, or NULL from the clean path
+ *
+ * Only @cur can be returned with NETDEV_TX_BUSY. Other skbs were
+ * already accepted, so they are dropped and counted instead.
+ **/
+static netdev_tx_t e1000_sfmc_flush(struct e1000_adapter *adapter,
+				    struct sk_buff *cur)
+{
+	struct net_device *netdev = adapter->netdev;
+	struct sfmc_burst *burst = &adapter->tx_ring->sfmc_burst;
+	int errs[SFMC_BURST_MAX];
+	int n, last;
+	struct sk_buff *skb;
+	netdev_tx_t ret = NETDEV_TX_OK;
+
+	sfmc_encap_burst (burst->skbs, errs, burst->num, netdev, NULL);
+
+	/* the last skb sent must write the tail */
+	for (last = burst->num - 1; last > 0 && errs[last] < 0; last--);
+	burst->skbs[last]->xmit_more = 0;
+
+	for (n = 0; n < burst->num; n++) {
+		skb = burst->skbs[n];
+		if (errs[n] < 0) {
+			kfree_skb (skb);
+			netdev->stats.tx_dropped++;
+			continue;
+		}
+
+		ret = __e1000_xmit_frame(skb, netdev);
+		if (ret == NETDEV_TX_BUSY && skb != cur) {
+			/* deferred skb cannot be requeued. */
+			dev_kfree_skb_any (skb);
+			netdev->stats.tx_dropped++;
+			ret = NETDEV_TX_OK;
+		}
+	}
+
+	burst->num = 0;
+
+	return ret;
+}
+
+static netdev_tx_t e1000_xmit_frame(struct sk_buff *skb,
+				    struct net_device *netdev)
+{
+	struct e1000_adapter *adapter = netdev_priv(netdev);
+
+	/* madcap software emulation. madcap skbs are deferred while
+	 * more packets follow, and encapsulated at once. the clean
+	 * path flushes them if no more packets come. */
+	if (!sfmc_burst_add (&adapter->tx_ring->sfmc_burst, skb))
+		return NETDEV_TX_OK;
+
+	/* NETDEV_TX_BUSY is returned only for this skb */
+	return e1000_sfmc_flush(adapter, skb);
+}
+
 #define NUM_REGS 38 /* 1 based count */
 static void e1000_regdump(struct e1000_adapter *adapter)
 {
@@ -3902,6 +3965,24 @@ static bool e1000_clean_tx_irq(struct e1000_adapter *adapter,
 			netif_wake_queue(netdev);
 			++adapter->restart_queue;
 		}
+
+		/* vdevs stopped by madcap_tx_busy() wait for this queue */
+		madcap_tx_wake(netdev, 0);
+	}
+
+	/* madcap skbs deferred by e1000_xmit_frame() for more packets
+	 * that did not come. the xmit path holding the lock flushes
+	 * them by itself.
+	 */
+	if (unlikely(ACCESS_ONCE(tx_ring->sfmc_burst.num))) {
+		struct netdev_queue *txq = netdev_get_tx_queue(netdev, 0);
+
+		if (__netif_tx_trylock(txq)) {
+			if (tx_ring->sfmc_burst.num &&
+			    !test_bit(__E1000_DOWN, &adapter->flags))
+				e1000_sfmc_flush(adapter, NULL);
+			__netif_tx_unlock(txq);
+		}
 	}
 
 	if (adapter->detect_tx_hung) {
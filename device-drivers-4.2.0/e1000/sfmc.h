@@ -16,31 +16,57 @@
 #include <linux/rwlock.h>
 #include <linux/rculist.h>
 #include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/skbuff.h>
 #include <madcap.h>
 #include "patricia.h"	/* patricia trie */
 
 
 #define SFMC_HASH_BITS	8
 #define SFMC_HASH_SIZE	(1 << SFMC_HASH_BITS)
-#define SFMC_VDEV_MAX	16
+#define SFMC_BURST_MAX	16
+
+
+/* per-cpu locator cache. direct mapped by id. An entry is valid
+ * only when its gen equals sfmc->gen, so a table change invalidates
+ * all the caches without touching other cpus' cache lines. */
+#define SFMC_CACHE_BITS	6
+#define SFMC_CACHE_SIZE	(1 << SFMC_CACHE_BITS)
+
+struct sfmc_cache_ent {
+	u64			id;
+	struct sfmc_table	*st;
+	unsigned int		gen;
+};
+
+struct sfmc_cache {
+	struct sfmc_cache_ent	ent[SFMC_CACHE_SIZE];
+};
 
 
 /* madcap table and config structure */
 struct sfmc {
 
+	/* read-mostly: read for every packet in the xmit path. */
 	struct net_device 	*dev;	/* physical device */
-	rwlock_t		lock;
+	struct madcap_obj_udp		ou;	/* udp encap config	*/
+	struct madcap_obj_config	oc;	/* offset and length */
+	struct sfmc_cache __percpu	*cache;	/* per-cpu locator cache */
+	unsigned int		gen;	/* generation of sfmc_table */
 
-	u64			id;	/* h/w id for switchdev */
+	struct hlist_head	sfmc_table[SFMC_HASH_SIZE]; /* sfmc_table */
 
-	struct net_device	*vdev[SFMC_VDEV_MAX];	/* acquiring device */
+	/* control path: written on table, fib and neighbour changes. */
+	rwlock_t		lock ____cacheline_aligned_in_smp;
 
-	struct hlist_head	sfmc_table[SFMC_HASH_SIZE]; /* sfmc_table */
+	u64			id;	/* h/w id for switchdev */
+
+	struct hlist_head	nh_table[SFMC_HASH_SIZE];   /* sfmc_nh */
 	struct list_head	fib_list;	/* sfmc_fib list */
 	patricia_tree_t		*fib_tree;	/* ipv4 fib table
 						 * struct sfmc_fib */
-	struct madcap_obj_udp		ou;	/* udp encap config	*/
-	struct madcap_obj_config	oc;	/* offset and length */
 
 	struct workqueue_struct		*sfmc_wq;
 };
@@ -52,8 +78,60 @@ struct sfmc {
 int sfmc_init (struct sfmc *sfmc, struct net_device *dev);
 int sfmc_exit (struct sfmc *sfmc);
 
+/* outer headers in a page fragment, sent ahead of the skb by
+ * scatter-gather instead of pushed into its head, so that cloned skbs
+ * are not copied. the driver maps data as the first tx buffer, and
+ * frees it by sfmc_prefix_free() when the skb is freed. */
+struct sfmc_prefix {
+	void		*data;	/* NULL if pushed into the skb */
+	unsigned int	len;
+};
+
+static inline void
+sfmc_prefix_free (void *data)
+{
+	put_page (virt_to_head_page (data));
+}
+
 /* add (udp), ip, and ethernet header in accordance with llt */
 int sfmc_encap_packet (struct sk_buff *skb, struct net_device *dev);
 
+/* encap up to SFMC_BURST_MAX packets at once. errs[n] is the result
+ * of sfmc_encap_packet() for skbs[n]. if pfxs is not NULL, outer
+ * headers of skbs[n] may be put in pfxs[n] instead. */
+int sfmc_encap_burst (struct sk_buff **skbs, int *errs, unsigned int num,
+		      struct net_device *dev, struct sfmc_prefix *pfxs);
+
+
+/* madcap skbs deferred by a tx queue while the stack says more
+ * packets follow (skb->xmit_more). embedded in the driver's tx ring.
+ * the driver flushes them from its tx clean path too, so that they
+ * are not left when no more packets come. */
+struct sfmc_burst {
+	unsigned int	num;
+	struct sk_buff	*skbs[SFMC_BURST_MAX];
+};
+
+/* add skb to burst. returns true when the burst should be flushed.
+ * other skbs are not deferred, and flush the burst before them. */
+static inline bool
+sfmc_burst_add (struct sfmc_burst *burst, struct sk_buff *skb)
+{
+	burst->skbs[burst->num++] = skb;
+	return (!skb->xmit_more || !madcap_skb_marked (skb) ||
+		burst->num == SFMC_BURST_MAX);
+}
+
+/* drop deferred skbs. called when the tx ring is cleaned. */
+static inline void
+sfmc_burst_purge (struct sfmc_burst *burst)
+{
+	unsigned int n;
+
+	for (n = 0; n < burst->num; n++)
+		dev_kfree_skb_any (burst->skbs[n]);
+	burst->num = 0;
+}
+
 
 #endif
@@ -184,6 +184,8 @@ struct ixgbe_tx_buffer {
 	DEFINE_DMA_UNMAP_ADDR(dma);
 	DEFINE_DMA_UNMAP_LEN(len);
 	u32 tx_flags;
+	bool map_single;	/* dma mapped by dma_map_single */
+	struct sfmc_prefix sfmc_prefix;	/* madcap outer headers */
 };
 
 struct ixgbe_rx_buffer {
@@ -207,6 +209,7 @@ struct ixgbe_tx_queue_stats {
 	u64 restart_queue;
 	u64 tx_busy;
 	u64 tx_done_old;
+	u64 tx_dropped;		/* madcap skbs dropped by the driver */
 };
 
 struct ixgbe_rx_queue_stats {
@@ -291,6 +294,8 @@ struct ixgbe_ring {
 		struct ixgbe_tx_queue_stats tx_stats;
 		struct ixgbe_rx_queue_stats rx_stats;
 	};
+	struct sfmc_burst sfmc_burst;	/* madcap tx burst */
+	struct sfmc_prefix sfmc_prefix;	/* for the skb being sent */
 } ____cacheline_internodealigned_in_smp;
 
 enum ixgbe_ring_f_enum {
@@ -172,6 +172,8 @@ MODULE_LICENSE("GPL");
 MODULE_VERSION(DRV_VERSION);
 
 static bool ixgbe_check_cfg_remove(struct ixgbe_hw *hw, struct pci_dev *pdev);
+static netdev_tx_t ixgbe_sfmc_flush(struct ixgbe_ring *tx_ring,
+				    struct sk_buff *cur);
 
 static int ixgbe_read_pci_cfg_word_parent(struct ixgbe_adapter *adapter,
 					  u32 reg, u16 *value)
@@ -904,21 +906,34 @@ static inline void ixgbe_irq_rearm_queues(struct ixgbe_adapter *adapter,
 	}
 }
 
-void ixgbe_unmap_and_free_tx_resource(struct ixgbe_ring *ring,
-				      struct ixgbe_tx_buffer *tx_buffer)
+static inline void ixgbe_unmap_tx_buffer(struct device *dev,
+					 struct ixgbe_tx_buffer *tx_buffer)
 {
-	if (tx_buffer->skb) {
-		dev_kfree_skb_any(tx_buffer->skb);
-		if (dma_unmap_len(tx_buffer, len))
-			dma_unmap_single(ring->dev,
-					 dma_unmap_addr(tx_buffer, dma),
-					 dma_unmap_len(tx_buffer, len),
-					 DMA_TO_DEVICE);
-	} else if (dma_unmap_len(tx_buffer, len)) {
-		dma_unmap_page(ring->dev,
+	/* madcap outer headers and skb->data are mapped as single,
+	 * and fragments as page, so the first buffer is not always
+	 * the only single one. */
+	if (tx_buffer->map_single)
+		dma_unmap_single(dev,
+				 dma_unmap_addr(tx_buffer, dma),
+				 dma_unmap_len(tx_buffer, len),
+				 DMA_TO_DEVICE);
+	else
+		dma_unmap_page(dev,
 			       dma_unmap_addr(tx_buffer, dma),
 			       dma_unmap_len(tx_buffer, len),
 			       DMA_TO_DEVICE);
+}
+
+void ixgbe_unmap_and_free_tx_resource(struct ixgbe_ring *ring,
+				      struct ixgbe_tx_buffer *tx_buffer)
+{
+	if (tx_buffer->skb)
+		dev_kfree_skb_any(tx_buffer->skb);
+	if (dma_unmap_len(tx_buffer, len))
+		ixgbe_unmap_tx_buffer(ring->dev, tx_buffer);
+	if (tx_buffer->sfmc_prefix.data) {
+		sfmc_prefix_free(tx_buffer->sfmc_prefix.data);
+		tx_buffer->sfmc_prefix.data = NULL;
 	}
 	tx_buffer->next_to_watch = NULL;
 	tx_buffer->skb = NULL;
@@ -1119,11 +1134,12 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 		/* free the skb */
 		dev_consume_skb_any(tx_buffer->skb);
 
-		/* unmap skb header data */
-		dma_unmap_single(tx_ring->dev,
-				 dma_unmap_addr(tx_buffer, dma),
-				 dma_unmap_len(tx_buffer, len),
-				 DMA_TO_DEVICE);
+		/* unmap skb header data, or madcap outer headers */
+		ixgbe_unmap_tx_buffer(tx_ring->dev, tx_buffer);
+		if (tx_buffer->sfmc_prefix.data) {
+			sfmc_prefix_free(tx_buffer->sfmc_prefix.data);
+			tx_buffer->sfmc_prefix.data = NULL;
+		}
 
 		/* clear tx_buffer data */
 		tx_buffer->skb = NULL;
@@ -1140,12 +1156,10 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 				tx_desc = IXGBE_TX_DESC(tx_ring, 0);
 			}
 
-			/* unmap any remaining paged data */
+			/* unmap any remaining data, skb->data follows
+			 * madcap outer headers */
 			if (dma_unmap_len(tx_buffer, len)) {
-				dma_unmap_page(tx_ring->dev,
-					       dma_unmap_addr(tx_buffer, dma),
-					       dma_unmap_len(tx_buffer, len),
-					       DMA_TO_DEVICE);
+				ixgbe_unmap_tx_buffer(tx_ring->dev, tx_buffer);
 				dma_unmap_len_set(tx_buffer, len, 0);
 			}
 		}
@@ -1223,6 +1237,24 @@ static bool ixgbe_clean_tx_irq(struct ixgbe_q_vector *q_vector,
 					    tx_ring->queue_index);
 			++tx_ring->tx_stats.restart_queue;
 		}
+
+		/* vdevs stopped by madcap_tx_busy() wait for this queue */
+		madcap_tx_wake(tx_ring->netdev, tx_ring->queue_index);
+	}
+
+	/* madcap skbs deferred by ixgbe_xmit_frame() for more packets
+	 * that did not come. the xmit path holding the lock flushes
+	 * them by itself.
+	 */
+	if (unlikely(ACCESS_ONCE(tx_ring->sfmc_burst.num))) {
+		struct netdev_queue *txq = txring_txq(tx_ring);
+
+		if (__netif_tx_trylock(txq)) {
+			if (tx_ring->sfmc_burst.num &&
+			    !test_bit(__IXGBE_DOWN, &adapter->state))
+				ixgbe_sfmc_flush(tx_ring, NULL);
+			__netif_tx_unlock(txq);
+		}
 	}
 
 	return !!budget;
@@ -5031,6 +5063,9 @@ static void ixgbe_clean_tx_ring(struct ixgbe_ring *tx_ring)
 		ixgbe_unmap_and_free_tx_resource(tx_ring, tx_buffer_info);
 	}
 
+	/* Free sk_buffs deferred for madcap burst */
+	sfmc_burst_purge (&tx_ring->sfmc_burst);
+
 	netdev_tx_reset_queue(txring_txq(tx_ring));
 
 	size = sizeof(struct ixgbe_tx_buffer) * tx_ring->count;
@@ -5964,7 +5999,7 @@ void ixgbe_update_stats(struct ixgbe_adapter *adapter)
 	struct ixgbe_hw_stats *hwstats = &adapter->stats;
 	u64 total_mpc = 0;
 	u32 i, missed_rx = 0, mpc, bprc, lxon, lxoff, xon_off_tot;
-	u64 non_eop_descs = 0, restart_queue = 0, tx_busy = 0;
+	u64 non_eop_descs = 0, restart_queue = 0, tx_busy = 0, tx_dropped = 0;
 	u64 alloc_rx_page_failed = 0, alloc_rx_buff_failed = 0;
 	u64 bytes = 0, packets = 0, hw_csum_rx_error = 0;
 
@@ -6006,6 +6041,7 @@ void ixgbe_update_stats(struct ixgbe_adapter *adapter)
 		struct ixgbe_ring *tx_ring = adapter->tx_ring[i];
 		restart_queue += tx_ring->tx_stats.restart_queue;
 		tx_busy += tx_ring->tx_stats.tx_busy;
+		tx_dropped += tx_ring->tx_stats.tx_dropped;
 		bytes += tx_ring->stats.bytes;
 		packets += tx_ring->stats.packets;
 	}
@@ -6013,6 +6049,7 @@ void ixgbe_update_stats(struct ixgbe_adapter *adapter)
 	adapter->tx_busy = tx_busy;
 	netdev->stats.tx_bytes = bytes;
 	netdev->stats.tx_packets = packets;
+	netdev->stats.tx_dropped = tx_dropped;
 
 	hwstats->crcerrs += IXGBE_READ_REG(hw, IXGBE_CRCERRS);
 
@@ -7058,7 +7095,8 @@ static void ixgbe_tx_map(struct ixgbe_ring *tx_ring,
 
 	tx_desc = IXGBE_TX_DESC(tx_ring, i);
 
-	ixgbe_tx_olinfo_status(tx_desc, tx_flags, skb->len - hdr_len);
+	ixgbe_tx_olinfo_status(tx_desc, tx_flags,
+			       skb->len + first->sfmc_prefix.len - hdr_len);
 
 	size = skb_headlen(skb);
 	data_len = skb->data_len;
@@ -7074,10 +7112,37 @@ static void ixgbe_tx_map(struct ixgbe_ring *tx_ring,
 	}
 
 #endif
-	dma = dma_map_single(tx_ring->dev, skb->data, size, DMA_TO_DEVICE);
-
 	tx_buffer = first;
 
+	if (first->sfmc_prefix.data) {
+		/* madcap outer headers in their own descriptor ahead of
+		 * the skb */
+		dma = dma_map_single(tx_ring->dev, first->sfmc_prefix.data,
+				     first->sfmc_prefix.len, DMA_TO_DEVICE);
+		if (dma_mapping_error(tx_ring->dev, dma))
+			goto dma_error;
+
+		dma_unmap_len_set(tx_buffer, len, first->sfmc_prefix.len);
+		dma_unmap_addr_set(tx_buffer, dma, dma);
+		tx_buffer->map_single = true;
+
+		tx_desc->read.buffer_addr = cpu_to_le64(dma);
+		tx_desc->read.cmd_type_len =
+			cpu_to_le32(cmd_type ^ first->sfmc_prefix.len);
+
+		i++;
+		tx_desc++;
+		if (i == tx_ring->count) {
+			tx_desc = IXGBE_TX_DESC(tx_ring, 0);
+			i = 0;
+		}
+		tx_desc->read.olinfo_status = 0;
+		tx_buffer = &tx_ring->tx_buffer_info[i];
+	}
+
+	dma = dma_map_single(tx_ring->dev, skb->data, size, DMA_TO_DEVICE);
+	tx_buffer->map_single = true;
+
 	for (frag = &skb_shinfo(skb)->frags[0];; frag++) {
 		if (dma_mapping_error(tx_ring->dev, dma))
 			goto dma_error;
@@ -7130,6 +7195,7 @@ static void ixgbe_tx_map(struct ixgbe_ring *tx_ring,
 				       DMA_TO_DEVICE);
 
 		tx_buffer = &tx_ring->tx_buffer_info[i];
+		tx_buffer->map_single = false;
 	}
 
 	/* write last descriptor with RS and EOP bits */
@@ -7343,6 +7409,10 @@ netdev_tx_t ixgbe_xmit_frame_ring(struct sk_buff *skb,
 	for (f = 0; f < skb_shinfo(skb)->nr_frags; f++)
 		count += TXD_USE_COUNT(skb_shinfo(skb)->frags[f].size);
 
+	/* madcap outer headers given by ixgbe_xmit_frame */
+	if (tx_ring->sfmc_prefix.data)
+		count++;
+
 	if (ixgbe_maybe_stop_tx(tx_ring, count + 3)) {
 		tx_ring->tx_stats.tx_busy++;
 		return NETDEV_TX_BUSY;
@@ -7351,7 +7421,9 @@ netdev_tx_t ixgbe_xmit_frame_ring(struct sk_buff *skb,
 	/* record the location of the first descriptor for this packet */
 	first = &tx_ring->tx_buffer_info[tx_ring->next_to_use];
 	first->skb = skb;
-	first->bytecount = skb->len;
+	first->sfmc_prefix = tx_ring->sfmc_prefix;
+	tx_ring->sfmc_prefix.data = NULL;
+	first->bytecount = skb->len + first->sfmc_prefix.len;
 	first->gso_segs = 1;
 
 	/* if we have a HW VLAN tag being added default to the HW one */
@@ -7451,6 +7523,10 @@ xmit_fcoe:
 out_drop:
 	dev_kfree_skb_any(first->skb);
 	first->skb = NULL;
+	if (first->sfmc_prefix.data) {
+		sfmc_prefix_free(first->sfmc_prefix.data);
+		first->sfmc_prefix.data = NULL;
+	}
 
 	return NETDEV_TX_OK;
 }
@@ -7474,19 +7550,77 @@ static netdev_tx_t __ixgbe_xmit_frame(struct sk_buff *skb,
 	return ixgbe_xmit_frame_ring(skb, adapter, tx_ring);
 }
 
+/**
+ * ixgbe_sfmc_flush - encapsulate and send skbs deferred for madcap
+ * @tx_ring: ring the skbs are deferred on, with its tx queue locked
+ * @cur: skb given to ndo_start_xmit, or NULL from the clean path
+ *
+ * Only @cur can be returned with NETDEV_TX_BUSY. Other skbs were
+ * already accepted, so they are dropped and counted instead.
+ **/
+static netdev_tx_t ixgbe_sfmc_flush(struct ixgbe_ring *tx_ring,
+				    struct sk_buff *cur)
+{
+	struct net_device *netdev = tx_ring->netdev;
+	struct sfmc_burst *burst = &tx_ring->sfmc_burst;
+	struct sfmc_prefix pfxs[SFMC_BURST_MAX];
+	int errs[SFMC_BURST_MAX];
+	int n, last;
+	struct sk_buff *skb;
+	netdev_tx_t ret = NETDEV_TX_OK;
+
+	/* outer headers of cloned skbs are sent from pfxs by
+	 * scatter-gather. */
+	sfmc_encap_burst (burst->skbs, errs, burst->num, netdev, pfxs);
+
+	/* the last skb sent must ring the doorbell */
+	for (last = burst->num - 1; last > 0 && errs[last] < 0; last--);
+	burst->skbs[last]->xmit_more = 0;
+
+	for (n = 0; n < burst->num; n++) {
+		skb = burst->skbs[n];
+		if (errs[n] < 0) {
+			kfree_skb (skb);
+			tx_ring->tx_stats.tx_dropped++;
+			continue;
+		}
+
+		tx_ring->sfmc_prefix = pfxs[n];
+		ret = __ixgbe_xmit_frame(skb, netdev, tx_ring);
+		if (tx_ring->sfmc_prefix.data) {
+			/* not taken by ixgbe_xmit_frame_ring, so the
+			 * prefix is still ours. */
+			sfmc_prefix_free (tx_ring->sfmc_prefix.data);
+			tx_ring->sfmc_prefix.data = NULL;
+		}
+		tx_ring->sfmc_prefix.len = 0;
+		if (ret == NETDEV_TX_BUSY && skb != cur) {
+			/* deferred skb cannot be requeued. */
+			dev_kfree_skb_any (skb);
+			tx_ring->tx_stats.tx_dropped++;
+			ret = NETDEV_TX_OK;
+		}
+	}
+
+	burst->num = 0;
+
+	return ret;
+}
+
 static netdev_tx_t ixgbe_xmit_frame(struct sk_buff *skb,
 				    struct net_device *netdev)
 {
-	int err;
+	struct ixgbe_adapter *adapter = netdev_priv(netdev);
+	struct ixgbe_ring *tx_ring = adapter->tx_ring[skb->queue_mapping];
 
-	/* madcap software emulation */
-	err = sfmc_encap_packet (skb, netdev);
-	if (err < 0) {
-		kfree_skb (skb);
+	/* madcap software emulation. madcap skbs are deferred while
+	 * more packets follow, and encapsulated at once. the clean
+	 * path flushes them if no more packets come. */
+	if (!sfmc_burst_add (&tx_ring->sfmc_burst, skb))
 		return NETDEV_TX_OK;
-	}
 
-	return __ixgbe_xmit_frame(skb, netdev, NULL);
+	/* NETDEV_TX_BUSY is returned only for this skb */
+	return ixgbe_sfmc_flush(tx_ring, skb);
 }
 
 /**
@@ -7666,6 +7800,7 @@ static struct rtnl_link_stats64 *ixgbe_get_stats64(struct net_device *netdev,
 	stats->rx_length_errors	= netdev->stats.rx_length_errors;
 	stats->rx_crc_errors	= netdev->stats.rx_crc_errors;
 	stats->rx_missed_errors	= netdev->stats.rx_missed_errors;
+	stats->tx_dropped	= netdev->stats.tx_dropped;
 	return stats;
 }
 
@@ -89,7 +89,8 @@ prefix_t *New_Prefix2 (int family, void *dest, int bitlen, prefix_t *prefix)
 
     if (prefix == NULL) {
 	/*	prefix = calloc(1, sizeof (prefix_t)); */
-	if ((prefix = (prefix_t *)kmalloc(sizeof(prefix_t), GFP_KERNEL)) == NULL) {
+	/* called from patricia_lookup under a write lock */
+	if ((prefix = (prefix_t *)kmalloc(sizeof(prefix_t), GFP_ATOMIC)) == NULL) {
 	    printk (KERN_ERR "New_Prefix2: can't allocate new prefix");
 	    return(0);
 	}
@@ -466,10 +467,16 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
     assert (prefix->bitlen <= patricia->maxbits);
 
     if (patricia->head == NULL) {
-	node = kmalloc(sizeof *node, GFP_KERNEL);
+	node = kmalloc(sizeof *node, GFP_ATOMIC);
+	if (node == NULL)
+	    return (NULL);
 	memset (node, 0, sizeof *node);
 	node->bit = prefix->bitlen;
 	node->prefix = Ref_Prefix (prefix);
+	if (node->prefix == NULL) {
+	    Delete (node);
+	    return (NULL);
+	}
 	node->parent = NULL;
 	node->l = node->r = NULL;
 	node->data = NULL;
@@ -570,6 +577,8 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	    return (node);
 	}
 	node->prefix = Ref_Prefix (prefix);
+	if (node->prefix == NULL)
+	    return (NULL);
 #ifdef PATRICIA_DEBUG
 	fprintf (stderr, "patricia_lookup: new node #1 %s/%d (glue mod)\n",
 		 prefix_toa (prefix), prefix->bitlen);
@@ -578,10 +587,16 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 	return (node);
     }
 
-    new_node = kmalloc(sizeof *new_node, GFP_KERNEL);
+    new_node = kmalloc(sizeof *new_node, GFP_ATOMIC);
+    if (new_node == NULL)
+	return (NULL);
     memset (new_node, 0, sizeof *new_node);
     new_node->bit = prefix->bitlen;
     new_node->prefix = Ref_Prefix (prefix);
+    if (new_node->prefix == NULL) {
+	Delete (new_node);
+	return (NULL);
+    }
     new_node->parent = NULL;
     new_node->l = new_node->r = NULL;
     new_node->data = NULL;
@@ -631,7 +646,14 @@ patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix)
 #endif /* PATRICIA_DEBUG */
     }
     else {
-        glue = kmalloc(sizeof *glue, GFP_KERNEL);
+        glue = kmalloc(sizeof *glue, GFP_ATOMIC);
+	if (glue == NULL) {
+	    /* new_node is not linked yet */
+	    Deref_Prefix (new_node->prefix);
+	    Delete (new_node);
+	    patricia->num_active_node--;
+	    return (NULL);
+	}
 	memset (glue, 0, sizeof * glue);
         glue->bit = differ_bit;
         glue->prefix = NULL;
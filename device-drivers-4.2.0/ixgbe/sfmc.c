@@ -1,7 +1,8 @@
 
 #include <linux/moduleparam.h>
 #include <linux/etherdevice.h>
-#include <linux/if_ether.h> 
+#include <linux/if_ether.h>
+#include <linux/prefetch.h>
 #include <net/netevent.h>
 #include <net/arp.h>
 #include <net/neighbour.h>
@@ -9,6 +10,8 @@
 #include <net/switchdev.h>
 #include <uapi/linux/rtnetlink.h>
 
+#include <madcap_trace.h>
+
 #include "sfmc.h"
 
 /* XXX: IP routing table and arp table (and sync using switchdev)
@@ -26,9 +29,11 @@
  * 1 entry : [ id 0xXX -> dst ip, dst mac, and outer parameters ].
  *
  * As a result of this FIB, second outer IP routing lookup (LPM) is
- * completely avoided. In current this software madcap implementation,
- * This FIB entry for an ID is filled up when first packet is
- * transmited (in sfmc_encap_packet()).
+ * completely avoided. Locator entries that have the same dst share
+ * one next hop object (struct sfmc_nh). The next hop is bound to a
+ * FIB entry and a neighbour when it is created, and it is rebound
+ * when the FIB or the neighbour is changed. So, a route or neighbour
+ * change updates only the next hops, not all the locator entries.
  */
 
 
@@ -48,6 +53,12 @@ static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
 MODULE_PARM_DESC (madcap_enable, "if 1, madcap offload is enabled.");
 
+static int sg_prefix __read_mostly = 1;
+module_param_named (sg_prefix, sg_prefix, int, 0444);
+MODULE_PARM_DESC (sg_prefix, "if 1, outer headers of cloned skbs are sent "
+		  "from a page fragment by scatter-gather, without copying "
+		  "the skb. used by drivers supporting it.");
+
 static bool netevent_registered = false;
 
 
@@ -59,7 +70,41 @@ struct sfmc_table {
 	unsigned long		updated;
 
 	struct madcap_obj_entry	oe;
-	struct sfmc_fib 	*fib;
+	struct sfmc_nh	 	*nh;	/* next hop for oe.dst */
+};
+
+
+/* outer ethernet, ip and udp header */
+#define SFMC_OUTER_HLEN_MAX	(ETH_HLEN + sizeof (struct iphdr) + \
+				 sizeof (struct udphdr))
+
+/* Next hop shared by locator-lookup table entries that have same dst.
+ * It has everything needed to encapsulate a packet to the dst.
+ * Fields read by sfmc_encap_packet() are protected by seq.
+ */
+struct sfmc_nh {
+	struct hlist_node	hlist;	/* sfmc->nh_table[] */
+	struct sfmc		*sfmc;	/* parent */
+	int			refcnt;	/* number of sfmc_table referring.
+					 * protected by sfmc->lock */
+
+	__be32			dst;	/* locator address */
+	__be32			gateway;/* gateway address, or dst for
+					 * connected route */
+	struct sfmc_fib		*fib;	/* fib entry to dst */
+
+	u8			mac[ETH_ALEN];	/* gateway mac address */
+	u8			nud_state;	/* neighbour state */
+
+	seqcount_t		seq;
+	bool			valid;	/* fib and neighbour are resolved */
+	unsigned int		hlen;	/* length of hdr */
+	u8			hdr[SFMC_OUTER_HLEN_MAX]; /* outer template */
+
+	struct work_struct	work;	/* resolve fib and neighbour */
+
+	struct rcu_head		rcu;
+	struct work_struct	free_work;	/* cancel work and free */
 };
 
 
@@ -77,18 +122,12 @@ struct sfmc_fib {
 	enum rt_scope_t	scope;		/* fib_info->fib_scope */
 
 	__be32		gateway;	/* gateway address	*/
-	u8		mac[ETH_ALEN];	/* gateway ma address	*/
-	u8		nud_state;	/* neighbour state */
-
-	struct work_struct ll_work;	/* arp resolve for link local route */
 };
 
 
 /* prototypes */
-static void sfmc_ll_neigh_work (struct work_struct *work);
-
-static void sfmc_neigh_write (struct sfmc_fib *sf, struct neighbour *n);
-static int sfmc_neigh_resolve (struct sfmc *sfmc, struct sfmc_fib *sf);
+static struct sfmc_fib * sfmc_fib_find_best (struct sfmc *sfmc,
+					     __be32 network, u8 len);
 
 
 
@@ -102,8 +141,276 @@ netdev_get_sfmc (struct net_device *dev)
 	return &priv->sfmc;
 }
 
+/* sfmc next hop operations */
+
+static inline struct hlist_head *
+sfmc_nh_head (struct sfmc *sfmc, __be32 dst)
+{
+	return &sfmc->nh_table[hash_32 ((__force u32) dst, SFMC_HASH_BITS)];
+}
+
+static struct sfmc_nh *
+sfmc_nh_find (struct sfmc *sfmc, __be32 dst)
+{
+	struct sfmc_nh *nh;
+
+	hlist_for_each_entry_rcu (nh, sfmc_nh_head (sfmc, dst), hlist) {
+		if (nh->dst == dst)
+			return nh;
+	}
+
+	return NULL;
+}
+
+static void
+sfmc_nh_build (struct sfmc_nh *nh)
+{
+	/* build outer header template. called with sfmc->lock held. */
+
+	u8 *p;
+	struct sfmc *sfmc = nh->sfmc;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	write_seqcount_begin (&nh->seq);
+
+	p = nh->hdr;
+
+	eth = (struct ethhdr *) p;
+	memcpy (eth->h_dest, nh->mac, ETH_ALEN);
+	memcpy (eth->h_source, sfmc->dev->perm_addr, ETH_ALEN);
+	eth->h_proto = htons (ETH_P_IP);
+	p += sizeof (*eth);
+
+	iph = (struct iphdr *) p;
+	iph->version	= 4;
+	iph->ihl	= sizeof (*iph) >> 2;
+	iph->frag_off	= 0;
+	iph->id		= 0;
+	iph->protocol	= sfmc->oc.proto;
+	iph->tos	= 0;
+	iph->ttl	= 64;
+	iph->tot_len	= 0;	/* filled by sfmc_encap_packet */
+	iph->daddr	= nh->dst;
+	iph->saddr	= sfmc->oc.src;
+	iph->check	= 0;
+	p += sizeof (*iph);
+
+	if (sfmc->ou.encap_enable) {
+		uh = (struct udphdr *) p;
+		uh->dest	= sfmc->ou.dst_port;
+		uh->source	= sfmc->ou.src_port;
+		uh->len		= 0;	/* filled by sfmc_encap_packet */
+		uh->check	= 0;	/* XXX */
+		p += sizeof (*uh);
+	}
+
+	nh->hlen = p - nh->hdr;
+	nh->valid = (nh->fib && (nh->nud_state & NUD_VALID));
+
+	write_seqcount_end (&nh->seq);
+}
+
+static void
+sfmc_nh_build_all (struct sfmc *sfmc)
+{
+	/* rebuild templates after udp or llt config is changed. */
+	unsigned int n;
+	struct sfmc_nh *nh;
+
+	write_lock_bh (&sfmc->lock);
+	for (n = 0; n < SFMC_HASH_SIZE; n++) {
+		hlist_for_each_entry (nh, &sfmc->nh_table[n], hlist)
+			sfmc_nh_build (nh);
+	}
+	write_unlock_bh (&sfmc->lock);
+}
+
+static void
+sfmc_nh_resolve (struct sfmc_nh *nh)
+{
+	/* bind the next hop to the best fib entry for its dst, and
+	 * resolve the gateway mac address. */
+
+	__be32 gateway;
+	struct sfmc *sfmc = nh->sfmc;
+	struct sfmc_fib *sf;
+	struct neighbour *n;
+
+again:
+	gateway = 0;
+	n = NULL;
+
+	/* fib_tree is modified with sfmc->lock held */
+	read_lock_bh (&sfmc->lock);
+	sf = sfmc_fib_find_best (sfmc, nh->dst, 32);
+	if (sf)
+		/* connected route. dst itself is the gateway. */
+		gateway = (sf->scope == RT_SCOPE_LINK) ? nh->dst : sf->gateway;
+	read_unlock_bh (&sfmc->lock);
+
+	if (sf) {
+		n = __ipv4_neigh_lookup (sfmc->dev, (__force u32) gateway);
+		if (!n) {
+			n = neigh_create (&arp_tbl, &gateway, sfmc->dev);
+			if (IS_ERR (n))
+				n = NULL;
+		}
+	}
+
+	write_lock_bh (&sfmc->lock);
+	if (sf != sfmc_fib_find_best (sfmc, nh->dst, 32)) {
+		/* fib is changed while resolving. sf may be freed. */
+		write_unlock_bh (&sfmc->lock);
+		if (n)
+			neigh_release (n);
+		goto again;
+	}
+	nh->fib		= sf;
+	nh->gateway	= gateway;
+	nh->nud_state	= 0;
+	if (n && (n->nud_state & NUD_VALID)) {
+		neigh_ha_snapshot (nh->mac, n, sfmc->dev);
+		nh->nud_state = n->nud_state;
+	}
+	sfmc_nh_build (nh);
+	write_unlock_bh (&sfmc->lock);
+
+	pr_debug ("nh %pI4 via %pI4, %s", &nh->dst, &nh->gateway,
+		  nh->valid ? "valid" : "no-valid");
+
+	if (n) {
+		if (!(n->nud_state & NUD_VALID))
+			neigh_event_send (n, NULL);
+		neigh_release (n);
+	}
+}
+
+static void
+sfmc_nh_work (struct work_struct *work)
+{
+	struct sfmc_nh *nh = container_of (work, struct sfmc_nh, work);
+
+	sfmc_nh_resolve (nh);
+}
+
+static void
+sfmc_nh_free_work (struct work_struct *work)
+{
+	struct sfmc_nh *nh = container_of (work, struct sfmc_nh, free_work);
+
+	cancel_work_sync (&nh->work);
+	kfree (nh);
+}
+
+static void
+sfmc_nh_free_rcu (struct rcu_head *head)
+{
+	/* xmit path that may queue nh->work has gone. nh->work may
+	 * still be pending, so cancel it in process context. */
+	struct sfmc_nh *nh = container_of (head, struct sfmc_nh, rcu);
+
+	queue_work (nh->sfmc->sfmc_wq, &nh->free_work);
+}
+
+static void
+sfmc_nh_rebind (struct sfmc *sfmc)
+{
+	/* fib is changed. rebind next hops whose best fib entry is
+	 * changed. The number of next hops is the number of
+	 * locators, not the number of locator-lookup table entries.
+	 */
+	unsigned int n;
+	struct sfmc_nh *nh;
+
+	bool changed;
+
+	rcu_read_lock ();
+	for (n = 0; n < SFMC_HASH_SIZE; n++) {
+		hlist_for_each_entry_rcu (nh, &sfmc->nh_table[n], hlist) {
+			/* fib_tree is not rcu-safe. search it under
+			 * the lock, and resolve (which takes the lock
+			 * by itself) after releasing. */
+			read_lock_bh (&sfmc->lock);
+			changed = (nh->fib !=
+				   sfmc_fib_find_best (sfmc, nh->dst, 32));
+			read_unlock_bh (&sfmc->lock);
+
+			if (changed)
+				sfmc_nh_resolve (nh);
+		}
+	}
+	rcu_read_unlock ();
+}
+
+static struct sfmc_nh *
+sfmc_nh_get (struct sfmc *sfmc, __be32 dst)
+{
+	struct sfmc_nh *nh, *new;
+
+	/* allocated before the lock, so that find and insert are
+	 * done at once. */
+	new = kzalloc (sizeof (*new), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	new->sfmc	= sfmc;
+	new->refcnt	= 1;
+	new->dst	= dst;
+	seqcount_init (&new->seq);
+	INIT_WORK (&new->work, sfmc_nh_work);
+	INIT_WORK (&new->free_work, sfmc_nh_free_work);
+
+	write_lock_bh (&sfmc->lock);
+	nh = sfmc_nh_find (sfmc, dst);
+	if (nh) {
+		nh->refcnt++;
+		write_unlock_bh (&sfmc->lock);
+		kfree (new);
+		return nh;
+	}
+	nh = new;
+	sfmc_nh_build (nh);
+	hlist_add_head_rcu (&nh->hlist, sfmc_nh_head (sfmc, dst));
+	write_unlock_bh (&sfmc->lock);
+
+	sfmc_nh_resolve (nh);
+
+	return nh;
+}
+
+static void
+sfmc_nh_put (struct sfmc_nh *nh)
+{
+	bool last;
+	struct sfmc *sfmc = nh->sfmc;
+
+	write_lock_bh (&sfmc->lock);
+	last = (--nh->refcnt == 0);
+	if (last)
+		hlist_del_rcu (&nh->hlist);
+	write_unlock_bh (&sfmc->lock);
+
+	if (!last)
+		return;
+
+	/* free after xmit path that may queue nh->work has gone,
+	 * without waiting a grace period for each next hop. */
+	call_rcu (&nh->rcu, sfmc_nh_free_rcu);
+}
+
 /* sfmc table operations */
 
+static inline void
+sfmc_cache_invalidate (struct sfmc *sfmc)
+{
+	/* called after sfmc_table is changed. all per-cpu cache
+	 * entries cached before this become stale. */
+	smp_wmb ();
+	ACCESS_ONCE (sfmc->gen) = sfmc->gen + 1;
+}
+
 static inline struct hlist_head *
 sfmc_table_head (struct sfmc * sfmc, u64 key)
 {
@@ -125,7 +432,14 @@ sfmc_table_add (struct sfmc *sfmc, struct madcap_obj_entry *oe)
 	st->updated	= jiffies;
 	st->oe		= *oe;
 
+	st->nh = sfmc_nh_get (sfmc, oe->dst);
+	if (!st->nh) {
+		kfree (st);
+		return NULL;
+	}
+
 	hlist_add_head_rcu (&st->hlist, sfmc_table_head (sfmc, oe->id));
+	sfmc_cache_invalidate (sfmc);
 
 	return st;
 }
@@ -134,9 +448,11 @@ static void
 sfmc_table_delete (struct sfmc_table *st)
 {
 	hlist_del_rcu (&st->hlist);
+	sfmc_cache_invalidate (st->sfmc);
+	sfmc_nh_put (st->nh);
 	kfree_rcu (st, rcu);
 }
-       
+
 static void
 sfmc_table_destroy (struct sfmc *sfmc)
 {
@@ -168,6 +484,41 @@ sfmc_table_find (struct sfmc *sfmc, u64 id)
 	return NULL;
 }
 
+static inline struct sfmc_cache_ent *
+sfmc_cache_ent (struct sfmc *sfmc, u64 id)
+{
+	return &this_cpu_ptr (sfmc->cache)->ent[hash_64 (id, SFMC_CACHE_BITS)];
+}
+
+static inline struct sfmc_table *
+sfmc_table_lookup (struct sfmc *sfmc, u64 id)
+{
+	/* lookup with per-cpu cache. called from xmit path with bh
+	 * disabled. The hot entries are read from this cpu's cache
+	 * line, not from the shared sfmc_table chains. */
+
+	unsigned int gen;
+	struct sfmc_table *st;
+	struct sfmc_cache_ent *ce;
+
+	ce = sfmc_cache_ent (sfmc, id);
+	gen = ACCESS_ONCE (sfmc->gen);
+	smp_rmb ();
+
+	if (likely (ce->gen == gen && ce->id == id))
+		return ce->st;
+
+	st = sfmc_table_find (sfmc, id);
+	st = (st) ? st : sfmc_table_find (sfmc, 0);
+	if (st) {
+		ce->id	= id;
+		ce->st	= st;
+		ce->gen	= gen;
+	}
+
+	return st;
+}
+
 /* sfmc fib operations */
 static struct sfmc_fib *
 sfmc_fib_find_exact (struct sfmc *sfmc, __be32 network, u8 len)
@@ -218,7 +569,6 @@ sfmc_fib_create (struct sfmc *sfmc, __be32 network, u8 len, __be32 gateway,
 	sf->gateway	= gateway;
 	sf->scope	= scope;
 	INIT_LIST_HEAD (&sf->list);
-	INIT_WORK (&sf->ll_work, sfmc_ll_neigh_work);
 
 	return sf;
 }
@@ -228,16 +578,28 @@ sfmc_fib_insert (struct sfmc *sfmc, struct sfmc_fib *sf)
 {
 	prefix_t *prefix;
 	patricia_node_t *pn;
+	struct sfmc_fib *exist;
 
-	prefix = kmalloc (sizeof (prefix_t), GFP_KERNEL);
-	memset (prefix, 0, sizeof (*prefix));
+	prefix = kzalloc (sizeof (prefix_t), GFP_KERNEL);
+	if (!prefix)
+		return NULL;
 	dst2prefix (sf->network, sf->len, prefix);
-	
+
+	/* next hop resolution searches fib_tree under read lock */
+	write_lock_bh (&sfmc->lock);
 	pn = patricia_lookup (sfmc->fib_tree, prefix);
+	if (!pn) {
+		write_unlock_bh (&sfmc->lock);
+		pr_err ("failed to insert fib %pI4/%d", &sf->network, sf->len);
+		kfree (prefix);
+		return NULL;
+	}
 	if (pn->data != NULL) {
+		exist = pn->data;
+		write_unlock_bh (&sfmc->lock);
 		pr_debug ("insert fib exist %pI4/%d", &sf->network, sf->len);
 		kfree (prefix);
-		return pn->data;
+		return exist;
 	}
 
 	pn->data	= sf;
@@ -245,6 +607,7 @@ sfmc_fib_insert (struct sfmc *sfmc, struct sfmc_fib *sf)
 	sf->prefix	= prefix;
 
 	list_add_rcu (&sf->list, &sfmc->fib_list);
+	write_unlock_bh (&sfmc->lock);
 
 	pr_debug ("insert fib %pI4/%d->%pI4",
 		  &sf->network, sf->len, &sf->gateway);
@@ -267,6 +630,14 @@ sfmc_fib_add (struct sfmc *sfmc, __be32 network, u8 len, __be32 gateway,
 		kfree (sf);
 		return NULL;
 	}
+	if (tmp != sf) {
+		/* the fib for this prefix is already inserted */
+		kfree (sf);
+		return tmp;
+	}
+
+	/* next hops to the prefix may move to this new fib */
+	sfmc_nh_rebind (sfmc);
 
 	return sf;
 }
@@ -274,28 +645,23 @@ sfmc_fib_add (struct sfmc *sfmc, __be32 network, u8 len, __be32 gateway,
 static void
 sfmc_fib_delete (struct sfmc_fib *sf)
 {
-	unsigned int n;
-	struct sfmc *sfmc = sf->sfmc;
-	struct sfmc_table *st;
+	struct sfmc *sfmc;
 
 	if (!sf)
 		return;
 
+	sfmc = sf->sfmc;
+
 	pr_debug ("delete fib %pI4/%d->%pI4",
 		  &sf->network, sf->len, &sf->gateway);
 
+	write_lock_bh (&sfmc->lock);
 	patricia_remove (sf->sfmc->fib_tree, sf->pn);
 	list_del_rcu (&sf->list);
+	write_unlock_bh (&sfmc->lock);
 
-	/* XXX: before free, set all sfmc_table->fib pointers that
-	 * point this fib entry to NULL. */
-
-	for (n = 0; n < SFMC_HASH_SIZE; n++) {
-		hlist_for_each_entry_rcu (st, &sfmc->sfmc_table[n], hlist) {
-			if (st->fib == sf)
-				st->fib = NULL;
-		}
-	}
+	/* next hops bound to this fib move to next best fib. */
+	sfmc_nh_rebind (sfmc);
 
 	kfree_rcu (sf, rcu);
 }
@@ -331,55 +697,17 @@ sfmc_fib_destroy (struct sfmc *sfmc)
 
 /* madcap_ops functions */
 
-static int
-sfmc_acquire_dev (struct net_device *dev, struct net_device *vdev)
-{
-	int n;
-	struct sfmc *sfmc = netdev_get_sfmc (dev);
-
-	for (n = 0; n < SFMC_VDEV_MAX; n++) {
-		if (sfmc->vdev[n] == vdev)
-			return -EEXIST;
-	}
-
-	for (n = 0; n < SFMC_VDEV_MAX; n++) {
-		if (sfmc->vdev[n] == NULL) {
-			sfmc->vdev[n] = vdev;
-			pr_info ("%s is acquired by %s",
-				 dev->name, vdev->name);
-			return 0;
-		}
-	}
-
-	return -ENOMEM;
-}
-
-static int
-sfmc_release_dev (struct net_device *dev, struct net_device *vdev)
-{
-	int n;
-	struct sfmc *sfmc = netdev_get_sfmc (dev);
-
-	for (n = 0; n < SFMC_VDEV_MAX; n++) {
-		if (sfmc->vdev[n] == vdev) {
-			sfmc->vdev[n] = NULL;
-			return 0;
-		}
-	}
-
-	return -ENOENT;
-}
-
 static int
 sfmc_llt_cfg (struct net_device *dev, struct madcap_obj *obj)
 {
 	struct sfmc *sfmc = netdev_get_sfmc (dev);
 	struct madcap_obj_config *oc = MADCAP_OBJ_CONFIG (obj);
 
-	if (memcmp (oc, &sfmc->oc, sizeof (*oc) != 0)) {
+	if (memcmp (oc, &sfmc->oc, sizeof (*oc)) != 0) {
 		/* offset or length is changed. drop all table entry. */
 		sfmc_table_destroy (sfmc);
 		sfmc->oc = *oc;
+		sfmc_nh_build_all (sfmc);
 	}
 
 	return 0;
@@ -398,7 +726,7 @@ sfmc_llt_entry_add (struct net_device *dev, struct madcap_obj *obj)
 	struct sfmc_table *st;
 	struct sfmc *sfmc = netdev_get_sfmc (dev);
 	struct madcap_obj_entry *oe = MADCAP_OBJ_ENTRY (obj);
-	
+
 	st = sfmc_table_find (sfmc, oe->id);
 	if (st)
 		return -EEXIST;
@@ -416,13 +744,13 @@ sfmc_llt_entry_del (struct net_device *dev, struct madcap_obj *obj)
 	struct sfmc_table *st;
 	struct sfmc *sfmc = netdev_get_sfmc (dev);
 	struct madcap_obj_entry *oe = MADCAP_OBJ_ENTRY (obj);
-	
+
 	st = sfmc_table_find (sfmc, oe->id);
 	if (!st)
 		return -ENOENT;
 
 	sfmc_table_delete (st);
-	
+
 	return 0;
 }
 
@@ -463,6 +791,7 @@ sfmc_udp_cfg (struct net_device *dev, struct madcap_obj *obj)
 
 	ou = MADCAP_OBJ_UDP (obj);
 	sfmc->ou = *ou;
+	sfmc_nh_build_all (sfmc);
 
 	return 0;
 }
@@ -474,10 +803,15 @@ sfmc_udp_config_get (struct net_device *dev)
 	return MADCAP_OBJ(sfmc->ou);
 }
 
+static int
+sfmc_get_headroom (struct net_device *dev)
+{
+	/* udp encap can be enabled after vdevs acquire the device */
+	return SFMC_OUTER_HLEN_MAX;
+}
+
 
 static struct madcap_ops sfmc_madcap_ops = {
-	.mco_acquire_dev	= sfmc_acquire_dev,
-	.mco_release_dev	= sfmc_release_dev,
 	.mco_llt_cfg		= sfmc_llt_cfg,
 	.mco_llt_config_get	= sfmc_llt_config_get,
 	.mco_llt_entry_add	= sfmc_llt_entry_add,
@@ -485,6 +819,7 @@ static struct madcap_ops sfmc_madcap_ops = {
 	.mco_llt_entry_dump	= sfmc_llt_entry_dump,
 	.mco_udp_cfg		= sfmc_udp_cfg,
 	.mco_udp_config_get	= sfmc_udp_config_get,
+	.mco_get_headroom	= sfmc_get_headroom,
 };
 
 
@@ -533,114 +868,201 @@ ipchecksum(const void * data, u16 len, u32 sum)
 	return htons (sum);
 }
 
+static inline bool
+sfmc_skb_is_madcap (struct sfmc *sfmc, struct sk_buff *skb)
+{
+	/* check: is this packet from acquiring device. madcap_queue_xmit
+	 * marks the packet, so any number of acquiring devices can be
+	 * checked at once. */
+	return madcap_skb_marked (skb);
+}
+
+static inline void
+sfmc_encap_fill (struct sfmc *sfmc, u8 *hdr, unsigned int len)
+{
+	/* fill length and checksum fields of outer headers at hdr, for
+	 * a frame of len bytes including them. */
+	struct iphdr *iph = (struct iphdr *) (hdr + ETH_HLEN);
+	struct udphdr *uh;
+
+	if (sfmc->ou.encap_enable) {
+		uh = (struct udphdr *) (hdr + ETH_HLEN + sizeof (*iph));
+		uh->len = htons (len - ETH_HLEN - sizeof (*iph));
+	}
+
+	iph->tot_len	= htons (len - ETH_HLEN);
+	iph->check	= ipchecksum (iph, sizeof (*iph), 0);
+}
+
+static inline bool
+sfmc_prefix_ok (struct sk_buff *skb, unsigned int hlen)
+{
+	/* the head can not be written without copying it. checksum and
+	 * segmentation offloads need outer headers in the skb. */
+	return (skb_header_cloned (skb) || skb_headroom (skb) < hlen) &&
+		!skb_is_gso (skb) && skb->ip_summed != CHECKSUM_PARTIAL;
+}
+
+static inline int
+sfmc_encap_nh (struct sfmc *sfmc, struct sk_buff *skb, struct sfmc_nh *nh,
+	       struct sfmc_prefix *pfx)
+{
+	bool valid;
+	unsigned int seq, hlen;
+	u8 hdr[SFMC_OUTER_HLEN_MAX];
+	void *data;
+
+	do {
+		seq = read_seqcount_begin (&nh->seq);
+		valid = nh->valid;
+		hlen = nh->hlen;
+		memcpy (hdr, nh->hdr, hlen);
+	} while (read_seqcount_retry (&nh->seq, seq));
+
+	if (unlikely (!valid)) {
+		/* fib or neighbour is not resolved yet. try again. */
+		trace_madcap_drop (skb, MADCAP_STAGE_SFMC_ENCAP);
+		queue_work (sfmc->sfmc_wq, &nh->work);
+		return -ENOENT;
+	}
+
+	/* ok, destination node is found, ip route is found and
+	 * neighbour state is valid. start to encap the pcaket!
+	 * put outer ethernet, ip, and udp header template, and fill
+	 * length and checksum fields. */
+
+	if (pfx && sg_prefix && sfmc_prefix_ok (skb, hlen)) {
+		/* the skb is left as is, and the driver sends the
+		 * prefix ahead of it. */
+		data = netdev_alloc_frag (SFMC_OUTER_HLEN_MAX);
+		if (likely (data)) {
+			memcpy (data, hdr, hlen);
+			sfmc_encap_fill (sfmc, data, skb->len + hlen);
+			pfx->data = data;
+			pfx->len = hlen;
+			trace_madcap_stage (skb, MADCAP_STAGE_SFMC_ENCAP);
+			return 0;
+		}
+	}
+
+	/* clones share the head, e.g., with packet taps */
+	if (unlikely (madcap_skb_cow_head (skb, sfmc->dev, hlen))) {
+		trace_madcap_drop (skb, MADCAP_STAGE_SFMC_ENCAP);
+		return -ENOMEM;
+	}
+
+	memcpy (__skb_push (skb, hlen), hdr, hlen);
+	skb_set_mac_header (skb, 0);
+	skb_set_network_header (skb, ETH_HLEN);
+	if (sfmc->ou.encap_enable)
+		skb_set_transport_header (skb, ETH_HLEN + sizeof (struct iphdr));
+
+	sfmc_encap_fill (sfmc, skb->data, skb->len);
+
+	/* the skb is encapsulated now. if the driver returns it with
+	 * NETDEV_TX_BUSY, it is requeued and must not be again. */
+	madcap_skb_unmark (skb);
+
+	trace_madcap_stage (skb, MADCAP_STAGE_SFMC_ENCAP);
+
+	return 0;
+}
+
 int
 sfmc_encap_packet (struct sk_buff *skb, struct net_device *dev)
 {
-	int n;
 	__u64 id;
 	struct sfmc *sfmc = netdev_get_sfmc (dev);
 	struct sfmc_table *st;
-	struct sfmc_fib *sf;
-	struct iphdr *iph;
-	struct udphdr *uh;
-	struct ethhdr *eth;
-	struct dst_entry *dst;
 
 	if (!madcap_enable)
 		return 0;
 
-	/* check: is this packet from acquiring device.
-	 * In madcap mode, ip_route_output_key is not needed, so
-	 * original destination of first routing lookup for the inner
-	 * packet is preserved.
-	 */
-	dst = skb_dst (skb);
-	if (!dst)
+	if (!sfmc_skb_is_madcap (sfmc, skb))
 		return 0;
 
-	for (n = 0; n < SFMC_VDEV_MAX; n++) {
-		if (sfmc->vdev[n] == dst->dev)
-			goto encap;
+	/* lookup destination node and next hop from locator-lookup-table.
+	 * the id is attached by the protocol driver, or extracted. */
+	if (!madcap_skb_get_id (skb, &id))
+		id = extract_id_from_packet (skb, &sfmc->oc);
+	st = sfmc_table_lookup (sfmc, id);
+	if (!st) {
+		trace_madcap_drop (skb, MADCAP_STAGE_SFMC_ENCAP);
+		return -ENOENT;
 	}
 
-	return 0;
+	return sfmc_encap_nh (sfmc, skb, st->nh, NULL);
+}
 
-encap:
+int
+sfmc_encap_burst (struct sk_buff **skbs, int *errs, unsigned int num,
+		  struct net_device *dev, struct sfmc_prefix *pfxs)
+{
+	/* encap a burst of packets. Each step of the lookup is done
+	 * for all the packets before the next step, and the memory
+	 * that the next step touches is prefetched. So, the cache
+	 * misses of the packets in the burst overlap.
+	 */
 
-	/* lookup destination node and FIB entry from locator-lookup-table */
-	id = extract_id_from_packet (skb, &sfmc->oc);
-	st = sfmc_table_find (sfmc, id);
-	st = (st) ? st : sfmc_table_find (sfmc, 0);
-	if (!st) {
-		pr_debug ("locator lookup table not found\n");
-		return -ENOENT;
-	}
+	unsigned int n;
+	__u64 ids[SFMC_BURST_MAX];
+	struct sfmc *sfmc = netdev_get_sfmc (dev);
+	struct sfmc_table *sts[SFMC_BURST_MAX];
+	struct sk_buff *skb;
 
-	/* add outer ip and ehternet header. */
-	if (!st->fib) {
-		/* check FIB entry is completed for this id? */
-		st->fib = sfmc_fib_find_best (sfmc, st->oe.dst, 32);
-		if (!st->fib) {
-			pr_debug ("no fib entry for %pI4", &st->oe.dst);
-			return -ENOENT;
-		}
-	}
+	memset (errs, 0, sizeof (*errs) * num);
+	if (pfxs)
+		memset (pfxs, 0, sizeof (*pfxs) * num);
 
-	sf = st->fib;
+	if (!madcap_enable)
+		return 0;
 
-	if (sf->scope == RT_SCOPE_LINK && sf->gateway != st->oe.dst) {
-		/* this is connected route. add host route and wait
-		 * for neighbor resolution */
-		struct sfmc_fib *llsf;
-		pr_debug ("create link local fib %pI4", &st->oe.dst);
-		llsf = sfmc_fib_create (sfmc, st->oe.dst, 32,
-					st->oe.dst, RT_SCOPE_LINK,
-					GFP_ATOMIC);
-		queue_work (sfmc->sfmc_wq, &llsf->ll_work);
-		return -ENOENT;
-	}
+	/* 1st stage: extract ids, prefetch cache entries and buckets */
+	for (n = 0; n < num; n++) {
+		skb = skbs[n];
+		sts[n] = NULL;
 
-	if (!(sf->nud_state & NUD_VALID)) {
-		pr_debug ("neighstate is not VALID for %pI4", &sf->gateway);
-		return -ENOENT;
+		if (!sfmc_skb_is_madcap (sfmc, skb)) {
+			ids[n] = 0;
+			errs[n] = 1;	/* skip */
+			continue;
+		}
+
+		if (!madcap_skb_get_id (skb, &ids[n]))
+			ids[n] = extract_id_from_packet (skb, &sfmc->oc);
+		prefetch (sfmc_cache_ent (sfmc, ids[n]));
+		prefetch (sfmc_table_head (sfmc, ids[n]));
+		prefetchw (skb->data - SFMC_OUTER_HLEN_MAX);
 	}
 
-	/* ok, destination node is found, ip route is found and
-	 * neighbour state is valid. start to encap the pcaket! */
+	/* 2nd stage: lookup locator-lookup-table, prefetch entries */
+	for (n = 0; n < num; n++) {
+		if (errs[n])
+			continue;
 
-	/* encap udp */
-	if (sfmc->ou.encap_enable) {
-		uh = (struct udphdr *) __skb_push (skb, sizeof (*uh));
-		uh->dest	= sfmc->ou.dst_port;
-		uh->source	= sfmc->ou.src_port;
-		uh->len		= htons (skb->len);
-		uh->check	= 0;	/* XXX */
-		skb_set_transport_header (skb, 0);
+		sts[n] = sfmc_table_lookup (sfmc, ids[n]);
+		if (!sts[n]) {
+			trace_madcap_drop (skbs[n], MADCAP_STAGE_SFMC_ENCAP);
+			errs[n] = -ENOENT;
+			continue;
+		}
+		prefetch (sts[n]);
 	}
 
-	/* encap ip */
-	iph = (struct iphdr *) __skb_push (skb, sizeof (*iph));
-	iph->version	= 4;
-	iph->ihl	= sizeof (*iph) >> 2;
-	iph->frag_off	= 0;
-	iph->id		= 0;
-	iph->protocol	= sfmc->oc.proto;
-	iph->tos	= 0;
-	iph->ttl	= 64;
-	iph->tot_len	= htons (skb->len);
-	iph->daddr	= st->oe.dst;
-	iph->saddr	= sfmc->oc.src;
-	iph->check	= 0;
-	iph->check	= ipchecksum (skb->data, sizeof (*iph), 0);
-
-	skb_set_network_header (skb, 0);
+	/* 3rd stage: prefetch next hops */
+	for (n = 0; n < num; n++) {
+		if (sts[n])
+			prefetch (&sts[n]->nh->seq);
+	}
 
-	/* add ethernet header */
-	eth = (struct ethhdr *) __skb_push (skb, sizeof (*eth));
-	memcpy (eth->h_dest, sf->mac, ETH_ALEN);
-	memcpy (eth->h_source, dev->perm_addr, ETH_ALEN);
-	eth->h_proto = htons (ETH_P_IP);
-	skb_set_mac_header (skb, 0);
+	/* 4th stage: push outer headers */
+	for (n = 0; n < num; n++) {
+		if (errs[n] == 1)
+			errs[n] = 0;
+		else if (sts[n])
+			errs[n] = sfmc_encap_nh (sfmc, skbs[n], sts[n]->nh,
+						 pfxs ? &pfxs[n] : NULL);
+	}
 
 	return 0;
 }
@@ -706,6 +1128,7 @@ sfmc_port_obj_add (struct net_device *dev, struct switchdev_obj *obj)
 			break;
 		}
 
+		/* neighbour is resolved for next hops bound to this fib */
 		sf = sfmc_fib_add (sfmc, network, fib->dst_len, gateway,
 				   fib->fi->fib_scope);
 		if (!sf) {
@@ -713,8 +1136,6 @@ sfmc_port_obj_add (struct net_device *dev, struct switchdev_obj *obj)
 			return -ENOMEM;
 		}
 
-		sfmc_neigh_resolve (sfmc, sf);
-
 		err = 0;
 		break;
 
@@ -760,54 +1181,35 @@ static const struct switchdev_ops sfmc_switchdev_ops = {
 /* neighbour update handler */
 
 static void
-sfmc_neigh_write (struct sfmc_fib *sf, struct neighbour *n)
+sfmc_neigh_write (struct sfmc_nh *nh, struct neighbour *n)
 {
-	memcpy (sf->mac, n->ha, ETH_ALEN);
-	sf->nud_state = n->nud_state;
+	/* called with sfmc->lock held */
+	neigh_ha_snapshot (nh->mac, n, nh->sfmc->dev);
+	nh->nud_state = n->nud_state;
+	sfmc_nh_build (nh);
 
-	pr_debug ("%pI4->%02x:%02x:%02x:%02x:%02x:%02x, %s",
-		  &sf->gateway,
-		  n->ha[0],n->ha[1],n->ha[2],
-		  n->ha[3],n->ha[3],n->ha[5],
-		  (sf->nud_state & NUD_VALID) ? "valid" : "no-valid");
-}
-
-static int
-sfmc_neigh_resolve (struct sfmc *sfmc, struct sfmc_fib *sf)
-{
-	int err = 0;
-	__be32 ip_addr = sf->gateway;
-	struct neighbour *n;
-
-	n = __ipv4_neigh_lookup (sfmc->dev, (__force u32)ip_addr);
-	if (!n) {
-		n = neigh_create (&arp_tbl, &ip_addr, sfmc->dev);
-		if (IS_ERR (n))
-			return IS_ERR (n);
-	}
-
-	if (n->nud_state & NUD_VALID)
-		sfmc_neigh_write (sf, n);
-	else
-		neigh_event_send (n, NULL);
-
-	neigh_release (n);
-
-	return err;
+	pr_debug ("%pI4->%pM, %s", &nh->gateway, nh->mac,
+		  nh->valid ? "valid" : "no-valid");
 }
 
 static void
 sfmc_neigh_update (struct net_device *dev, struct neighbour *n)
 {
+	unsigned int i;
 	__be32 ip_addr = *(__be32 *) n->primary_key;
 	struct sfmc *sfmc = netdev_get_sfmc (dev);
-	struct sfmc_fib *sf;
-
-	list_for_each_entry_rcu (sf, &sfmc->fib_list, list) {
-		if (sf->gateway == ip_addr) {
-			sfmc_neigh_write (sf, n);
+	struct sfmc_nh *nh;
+
+	/* next hops using this neighbour are updated at once.
+	 * locator-lookup table entries refer them. */
+	write_lock_bh (&sfmc->lock);
+	for (i = 0; i < SFMC_HASH_SIZE; i++) {
+		hlist_for_each_entry (nh, &sfmc->nh_table[i], hlist) {
+			if (nh->fib && nh->gateway == ip_addr)
+				sfmc_neigh_write (nh, n);
 		}
 	}
+	write_unlock_bh (&sfmc->lock);
 }
 
 static int
@@ -837,25 +1239,6 @@ static struct notifier_block sfmc_netevent_nb __read_mostly = {
 	.notifier_call = sfmc_neigh_update_event,
 };
 
-static void
-sfmc_ll_neigh_work (struct work_struct *work)
-{
-	/* arp resolution for link local (connected) host. */
-
-	struct sfmc_fib *sf, *tmp;
-
-	/* this sf is just after sfmc_fib_create. */
-	sf = container_of (work, struct sfmc_fib, ll_work);
-
-	tmp = sfmc_fib_insert (sf->sfmc, sf);
-	if (!tmp) {
-		/* the fib for this host entry is already created. */
-		kfree (sf);
-	}
-
-	sfmc_neigh_resolve (sf->sfmc, sf);
-}
-
 int
 sfmc_init (struct sfmc *sfmc, struct net_device *dev)
 {
@@ -864,20 +1247,31 @@ sfmc_init (struct sfmc *sfmc, struct net_device *dev)
 	memset (sfmc, 0, sizeof (*sfmc));
 
 	sfmc->dev = dev;
+	sfmc->gen = 1;	/* 0 is for empty cache entries */
 	rwlock_init (&sfmc->lock);
 
-	/* init hash table for madcap_obj_entry */
-	for (n = 0; n < SFMC_HASH_SIZE; n++)
+	/* init per-cpu locator cache */
+	sfmc->cache = alloc_percpu (struct sfmc_cache);
+	if (!sfmc->cache) {
+		pr_err ("failed to allocate locator cache");
+		return -ENOMEM;
+	}
+
+	/* init hash table for madcap_obj_entry and next hops */
+	for (n = 0; n < SFMC_HASH_SIZE; n++) {
 		INIT_HLIST_HEAD (&sfmc->sfmc_table[n]);
+		INIT_HLIST_HEAD (&sfmc->nh_table[n]);
+	}
 
 	/* init fib tree for ip routing */
 	INIT_LIST_HEAD (&sfmc->fib_list);
 	sfmc->fib_tree = New_Patricia (32);
 
-	/* init work queue for link local neighbor resolution */
-	sfmc->sfmc_wq = alloc_workqueue ("sfmc-ll-work-%s", 0, 0, dev->name);
+	/* init work queue for next hop resolution */
+	sfmc->sfmc_wq = alloc_workqueue ("sfmc-nh-work-%s", 0, 0, dev->name);
 	if (!sfmc->sfmc_wq) {
 		pr_err ("failed to allocate work queue");
+		free_percpu (sfmc->cache);
 		return -ENOMEM;
 	}
 
@@ -914,7 +1308,11 @@ sfmc_exit (struct sfmc *sfmc)
 
 	sfmc_table_destroy (sfmc);
 	sfmc_fib_destroy (sfmc);
+
+	/* next hops are freed via call_rcu and then sfmc_wq */
+	rcu_barrier ();
 	destroy_workqueue (sfmc->sfmc_wq);
+	free_percpu (sfmc->cache);
 
 	if (madcap_enable)
 		madcap_unregister_device (sfmc->dev);
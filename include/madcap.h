@@ -22,6 +22,7 @@ enum madcap_obj_id {
 	MADCAP_OBJ_ID_LLT_CONFIG,
 	MADCAP_OBJ_ID_LLT_ENTRY,
 	MADCAP_OBJ_ID_UDP,
+	MADCAP_OBJ_ID_STATS,
 };
 
 struct madcap_obj {
@@ -51,6 +52,16 @@ struct madcap_obj_udp {
 	__be16	src_port;
 };
 
+/* head reallocations on the encap path of a madcap device, and the
+ * outer header size it reported to acquiring devices. */
+struct madcap_obj_stats {
+	struct madcap_obj obj;
+	__u32	headroom;
+	__u64	realloc_headroom;	/* headroom was short */
+	__u64	realloc_cloned;		/* head was shared with clones */
+	__u64	realloc_failed;
+};
+
 #define MADCAP_OBJ(obj_)	&((obj_).obj)
 #define MADCAP_IFINDEX(obj_) (obj_)->obj.ifindex
 #define MADCAP_OBJ_CONFIG(obj)	\
@@ -59,12 +70,128 @@ struct madcap_obj_udp {
 	container_of (obj, struct madcap_obj_entry, obj)
 #define MADCAP_OBJ_UDP(obj)	\
 	container_of (obj, struct madcap_obj_udp, obj)
+#define MADCAP_OBJ_STATS(obj)	\
+	container_of (obj, struct madcap_obj_stats, obj)
 
 
 #ifdef __KERNEL__
 
 #include <linux/netdevice.h>
 #include <linux/netlink.h>
+#include <net/sch_generic.h>
+
+
+/* madcap_queue_xmit() marks the skb, so that a madcap device can
+ * know the packet is transmitted from an acquiring device in
+ * constant time, without skb_dst(). The mark is stored in skb->cb
+ * after struct qdisc_skb_cb, which is used by qdiscs between
+ * dev_queue_xmit() and ndo_start_xmit(). It overlaps SKB_GSO_CB,
+ * because cb has no room after it, so madcap_queue_xmit() segments
+ * GSO skbs the madcap device cannot offload before the qdisc, and
+ * marks each segment.
+ */
+#define MADCAP_SKB_CB_MAGIC	0x4d434150	/* "MCAP" */
+
+/* The protocol driver may attach the locator id with
+ * madcap_queue_xmit_id(). Then, the madcap device uses it instead of
+ * extracting the id from the packet at the configured offset.
+ */
+#define MADCAP_SKB_F_ID		0x0001	/* id and tb_id are valid */
+
+/* A packet generator may pin the id before the packet reaches the
+ * protocol driver with madcap_skb_pin_id(). Then, the protocol driver
+ * keeps it, so that the id can vary packet by packet. cb at
+ * MADCAP_SKB_CB_OFFSET is not touched by IP output and qdisc, but
+ * software GSO on the way overwrites it, so GSO skbs are not pinned.
+ * A pinned skb is not marked until madcap_queue_xmit(), so that it
+ * is an ordinary packet for native tunnels and the madcap device.
+ */
+#define MADCAP_SKB_F_PINNED	0x0002	/* id is not overwritten */
+#define MADCAP_SKB_CB_PIN_MAGIC	0x4d43504e	/* "MCPN" */
+
+struct madcap_skb_cb {
+	__u32	magic;
+	__u16	flags;
+	__u16	tb_id;	/* table id, reserved */
+	__u64	id;	/* locator id */
+};
+
+#define MADCAP_SKB_CB_OFFSET	ALIGN (sizeof (struct qdisc_skb_cb), 8)
+#define MADCAP_SKB_CB(skb)	\
+	((struct madcap_skb_cb *)((skb)->cb + MADCAP_SKB_CB_OFFSET))
+
+static inline void
+madcap_skb_mark (struct sk_buff *skb)
+{
+	struct madcap_skb_cb *mcb = MADCAP_SKB_CB (skb);
+
+	BUILD_BUG_ON (MADCAP_SKB_CB_OFFSET + sizeof (struct madcap_skb_cb) >
+		      FIELD_SIZEOF (struct sk_buff, cb));
+
+	if (mcb->magic == MADCAP_SKB_CB_PIN_MAGIC) {
+		mcb->magic = MADCAP_SKB_CB_MAGIC;
+		return;	/* keep the pinned id */
+	}
+
+	if (mcb->magic == MADCAP_SKB_CB_MAGIC &&
+	    mcb->flags & MADCAP_SKB_F_PINNED)
+		return;
+
+	mcb->magic = MADCAP_SKB_CB_MAGIC;
+	mcb->flags = 0;
+}
+
+static inline bool
+madcap_skb_marked (struct sk_buff *skb)
+{
+	return (MADCAP_SKB_CB (skb)->magic == MADCAP_SKB_CB_MAGIC);
+}
+
+static inline void
+madcap_skb_unmark (struct sk_buff *skb)
+{
+	MADCAP_SKB_CB (skb)->magic = 0;
+}
+
+static inline void
+madcap_skb_set_id (struct sk_buff *skb, __u64 id, __u16 tb_id)
+{
+	struct madcap_skb_cb *mcb = MADCAP_SKB_CB (skb);
+
+	if (mcb->flags & MADCAP_SKB_F_PINNED)
+		return;
+
+	mcb->flags |= MADCAP_SKB_F_ID;
+	mcb->tb_id = tb_id;
+	mcb->id = id;
+}
+
+static inline void
+madcap_skb_pin_id (struct sk_buff *skb, __u64 id, __u16 tb_id)
+{
+	struct madcap_skb_cb *mcb = MADCAP_SKB_CB (skb);
+
+	if (skb_is_gso (skb))
+		return;	/* the pin would be lost by segmentation */
+
+	mcb->magic = MADCAP_SKB_CB_PIN_MAGIC;
+	mcb->flags = MADCAP_SKB_F_ID | MADCAP_SKB_F_PINNED;
+	mcb->tb_id = tb_id;
+	mcb->id = id;
+}
+
+/* returns true and id if the protocol driver attached the id. */
+static inline bool
+madcap_skb_get_id (struct sk_buff *skb, __u64 *id)
+{
+	struct madcap_skb_cb *mcb = MADCAP_SKB_CB (skb);
+
+	if (!madcap_skb_marked (skb) || !(mcb->flags & MADCAP_SKB_F_ID))
+		return false;
+
+	*id = mcb->id;
+	return true;
+}
 
 struct madcap_ops {
 	int		(*mco_if_rx) (struct sk_buff *skb);	/* ??? */
@@ -91,6 +218,10 @@ struct madcap_ops {
 
 	struct madcap_obj *(*mco_llt_config_get) (struct net_device *dev);
 	struct madcap_obj *(*mco_udp_config_get) (struct net_device *dev);
+
+	/* bytes of outer headers, including the link layer header,
+	 * the device pushes in front of packets from vdevs. */
+	int		(*mco_get_headroom) (struct net_device *dev);
 };
 
 
@@ -102,9 +233,113 @@ struct madcap_ops {
  */
 int madcap_queue_xmit (struct sk_buff *skb, struct net_device *dev);
 
+/*	madcap_queue_xmit_id
+ *	@skb : same as madcap_queue_xmit
+ *	@dev : same as madcap_queue_xmit
+ *	@id : locator id of this packet (e.g., VNI, SPI/SI or GRE key)
+ *	@tb_id : locator-lookup table id
+ */
+int madcap_queue_xmit_id (struct sk_buff *skb, struct net_device *dev,
+			  __u64 id, __u16 tb_id);
+
+/* acquiring vdevs are recorded in madcap.ko. A dev can be acquired by
+ * any number of vdevs, and a vdev can acquire a dev only once.
+ * mco_acquire_dev and mco_release_dev are optional. */
 int madcap_acquire_dev (struct net_device *dev, struct net_device *vdev);
 int madcap_release_dev (struct net_device *dev, struct net_device *vdev);
 
+/* madcap_acquire_dev raises needed_headroom of dev to the size
+ * returned by mco_get_headroom. It is not lowered on release.
+ * Protocol drivers set needed_headroom of vdev to
+ * madcap_vdev_headroom() after acquiring, so that skbs are allocated
+ * with room for the outer headers under their own headers. */
+int madcap_get_headroom (struct net_device *dev);
+
+static inline int
+madcap_vdev_headroom (struct net_device *dev, int hlen)
+{
+	/* hlen is bytes of headers vdev pushes itself */
+	return hlen + LL_RESERVED_SPACE (dev);
+}
+
+/*	madcap_skb_cow_head
+ *	@skb : packet on the encap path
+ *	@dev : madcap device the packet is transmitted through
+ *	@headroom : bytes to be pushed
+ *
+ *	skb_cow_head() counting head reallocations against dev. They
+ *	are shown by `ip madcap show stats`.
+ */
+int __madcap_skb_cow_head (struct sk_buff *skb, struct net_device *dev,
+			   unsigned int headroom);
+
+static inline int
+madcap_skb_cow_head (struct sk_buff *skb, struct net_device *dev,
+		     unsigned int headroom)
+{
+	if (likely (!skb_header_cloned (skb) && skb_headroom (skb) >= headroom))
+		return 0;
+
+	return __madcap_skb_cow_head (skb, dev, headroom);
+}
+
+/* Backpressure. vdevs call madcap_tx_busy() before building
+ * headers. It checks the tx queue of dev that ndo_select_queue and
+ * XPS of dev will select for the skb. When the queue is stopped, a
+ * vdev with a qdisc stops its queue and returns NETDEV_TX_BUSY, so
+ * that the skb is requeued. A vdev without a queue drops the skb if
+ * the qdisc of dev is full too. Stopped vdevs are woken by
+ * madcap_tx_wake() from tx completion of dev, or by a poll timer for
+ * devices not calling it.
+ */
+#define MADCAP_TX_OK	0	/* go ahead */
+#define MADCAP_TX_BUSY	1	/* return NETDEV_TX_BUSY */
+#define MADCAP_TX_DROP	2	/* drop, and return madcap_xmit_ret() */
+
+extern atomic_t madcap_tx_stopped;	/* number of stopped vdevs */
+
+u16 madcap_pick_tx (struct net_device *dev, struct sk_buff *skb);
+int __madcap_tx_busy (struct net_device *dev, struct net_device *vdev,
+		      struct sk_buff *skb, u16 queue);
+void __madcap_tx_wake (struct net_device *dev, u16 queue);
+
+static inline int
+madcap_tx_busy (struct net_device *dev, struct net_device *vdev,
+		struct sk_buff *skb)
+{
+	u16 queue = madcap_pick_tx (dev, skb);
+
+	if (likely (!netif_xmit_frozen_or_stopped (netdev_get_tx_queue (dev,
+								       queue))))
+		return MADCAP_TX_OK;
+
+	return __madcap_tx_busy (dev, vdev, skb, queue);
+}
+
+/* called by madcap devices when tx queue of dev may be woken. */
+static inline void
+madcap_tx_wake (struct net_device *dev, u16 queue)
+{
+	if (unlikely (atomic_read (&madcap_tx_stopped)))
+		__madcap_tx_wake (dev, queue);
+}
+
+/* return value of ndo_start_xmit of vdev for the return value of
+ * madcap_queue_xmit. Drops are counted on vdev, and NET_XMIT_DROP and
+ * NET_XMIT_CN are passed to the sender as the lower qdisc returned.
+ */
+static inline netdev_tx_t
+madcap_xmit_ret (struct net_device *vdev, int rc)
+{
+	if (likely (rc == NET_XMIT_SUCCESS))
+		return NETDEV_TX_OK;
+
+	if (net_xmit_eval (rc))
+		vdev->stats.tx_dropped++;
+
+	return rc < 0 ? NET_XMIT_DROP : rc;
+}
+
 int madcap_llt_cfg (struct net_device *dev, struct madcap_obj *obj);
 
 int madcap_llt_entry_add (struct net_device *dev, struct madcap_obj *obj);
@@ -153,6 +388,7 @@ enum {
 	MADCAP_CMD_LLT_ENTRY_GET,
 	MADCAP_CMD_UDP_CONFIG,
 	MADCAP_CMD_UDP_CONFIG_GET,
+	MADCAP_CMD_STATS_GET,
 
 	__MADCAP_CMD_MAX,
 };
@@ -165,6 +401,7 @@ enum {
 	MADCAP_ATTR_OBJ_CONFIG,		/* struct madcap_obj_config */
 	MADCAP_ATTR_OBJ_ENTRY,		/* struct madcap_obj_entry */
 	MADCAP_ATTR_OBJ_UDP,		/* struct madcap_obj_udp */
+	MADCAP_ATTR_OBJ_STATS,		/* struct madcap_obj_stats */
 
 	__MADCAP_ATTR_MAX,
 };
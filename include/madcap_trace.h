@@ -0,0 +1,115 @@
+
+/* madcap_trace.h
+ *
+ * Static tracepoints for tx path stages. They cover the stages
+ * measured by OVBENCH timestamps in sk_buff, and work on stock
+ * kernels. rx stages are fired by netdevgen rx injection, protocol
+ * receive handlers and the netdevgen rx sink. Tracepoints are defined in madcap.ko, so that raven,
+ * netdevgen, protocol drivers and device drivers can fire them.
+ *
+ * Use trace_clock x86-tsc to get the same clocks as OVBENCH.
+ * benchmark/trace/ has a consumer rebuilding per-stage breakdown.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM madcap
+
+#ifndef _MADCAP_TRACE_STAGE_
+#define _MADCAP_TRACE_STAGE_
+
+/* stage numbers, with corresponding OVBENCH timestamps. */
+#define MADCAP_STAGE_GEN_XMIT		0	/* ip_local_out_sk_in */
+#define MADCAP_STAGE_PROTO_XMIT		1	/* (protocol)_xmit_in */
+#define MADCAP_STAGE_PROTO_LOOKUP	2	/* nsh_xmit_lookup_end */
+#define MADCAP_STAGE_ROUTE_START	3	/* ip_routing_start */
+#define MADCAP_STAGE_ROUTE_END		4	/* ip_routing_end */
+#define MADCAP_STAGE_BUILD_START	5	/* gre_xmit_in,
+						 * vxlan_xmit_skb_in,
+						 * nsh_xmit_vxlan_in */
+#define MADCAP_STAGE_BUILD_END		6	/* gre_encap_end */
+#define MADCAP_STAGE_TUNNEL_XMIT	7	/* udp_tunnel_xmit_skb_in,
+						 * iptunnel_xmit_in */
+#define MADCAP_STAGE_MADCAP_XMIT	8	/* dev_queue_xmit_in */
+#define MADCAP_STAGE_RAVEN_XMIT		9	/* raven_xmit_in */
+#define MADCAP_STAGE_SFMC_ENCAP		10	/* madcap NIC encap */
+#define MADCAP_STAGE_GEN_RECV		11	/* netdevgen injects to rx */
+#define MADCAP_STAGE_PROTO_RECV		12	/* ipip_rcv, ipgre_rcv,
+						 * vxlan_udp_encap_recv,
+						 * nsh_recv */
+#define MADCAP_STAGE_SINK_RECV		13	/* netdevgen rx sink */
+
+#endif /* _MADCAP_TRACE_STAGE_ */
+
+#if !defined(_MADCAP_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _MADCAP_TRACE_H_
+
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+
+#define show_madcap_stage(stage)					\
+	__print_symbolic (stage,					\
+			  { MADCAP_STAGE_GEN_XMIT,	"gen-xmit" },	\
+			  { MADCAP_STAGE_PROTO_XMIT,	"proto-xmit" },	\
+			  { MADCAP_STAGE_PROTO_LOOKUP,	"proto-lookup" }, \
+			  { MADCAP_STAGE_ROUTE_START,	"route-start" }, \
+			  { MADCAP_STAGE_ROUTE_END,	"route-end" },	\
+			  { MADCAP_STAGE_BUILD_START,	"build-start" }, \
+			  { MADCAP_STAGE_BUILD_END,	"build-end" },	\
+			  { MADCAP_STAGE_TUNNEL_XMIT,	"tunnel-xmit" }, \
+			  { MADCAP_STAGE_MADCAP_XMIT,	"madcap-xmit" }, \
+			  { MADCAP_STAGE_RAVEN_XMIT,	"raven-xmit" },	\
+			  { MADCAP_STAGE_SFMC_ENCAP,	"sfmc-encap" },	\
+			  { MADCAP_STAGE_GEN_RECV,	"gen-recv" },	\
+			  { MADCAP_STAGE_PROTO_RECV,	"proto-recv" },	\
+			  { MADCAP_STAGE_SINK_RECV,	"sink-recv" })
+
+DECLARE_EVENT_CLASS (madcap_skb_stage,
+
+	TP_PROTO (struct sk_buff *skb, int stage),
+
+	TP_ARGS (skb, stage),
+
+	TP_STRUCT__entry (
+		__field (const void *,	skbaddr)
+		__field (int,		ifindex)
+		__field (unsigned int,	len)
+		__field (int,		stage)
+	),
+
+	TP_fast_assign (
+		__entry->skbaddr = skb;
+		__entry->ifindex = skb->dev ? skb->dev->ifindex : 0;
+		__entry->len = skb->len;
+		__entry->stage = stage;
+	),
+
+	TP_printk ("skbaddr=%p ifindex=%d len=%u stage=%s",
+		   __entry->skbaddr, __entry->ifindex, __entry->len,
+		   show_madcap_stage (__entry->stage))
+);
+
+/* a packet reaches a stage */
+DEFINE_EVENT (madcap_skb_stage, madcap_stage,
+
+	TP_PROTO (struct sk_buff *skb, int stage),
+
+	TP_ARGS (skb, stage)
+);
+
+/* a packet is dropped at a stage */
+DEFINE_EVENT (madcap_skb_stage, madcap_drop,
+
+	TP_PROTO (struct sk_buff *skb, int stage),
+
+	TP_ARGS (skb, stage)
+);
+
+#endif /* _MADCAP_TRACE_H_ */
+
+/* include path is given by -I include of Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE madcap_trace
+#include <trace/define_trace.h>
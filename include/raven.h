@@ -9,9 +9,85 @@ enum {
 	IFLA_RAVEN_UNSPEC,
 	IFLA_RAVEN_PHYSICAL_DEV,	/* ifindex of physical device
 					 * to TX ip encaped packet */
+	IFLA_RAVEN_SINK_MODE,		/* enum raven_sink_mode */
 	__IFLA_RAVEN_MAX
 };
 #define IFLA_RAVEN_MAX (__IFLA_RAVEN_MAX -1)
 
 
+/* where encapsulated packets go */
+enum raven_sink_mode {
+	RAVEN_SINK_FORWARD,	/* xmit via physical device */
+	RAVEN_SINK_DROP,	/* drop immediately, without encap */
+	RAVEN_SINK_LOOPBACK,	/* inject into rx path of physical device,
+				 * or raven device if no physical device */
+	RAVEN_SINK_CAPTURE,	/* copy into mmap ring, and drop */
+	__RAVEN_SINK_MAX
+};
+#define RAVEN_SINK_MAX	(__RAVEN_SINK_MAX - 1)
+
+
+/* mmap ring shared with userspace. the ring header is at the top of
+ * the ring and slots start at data_offset. kernel writes slots and
+ * advances head, userspace reads slots and advances tail. slot of
+ * index i is at data_offset + (i % nslots) * slot_size. when the
+ * ring is full, records are dropped and drops is counted. fields
+ * other than tail are copies of kernel state; writing them has no
+ * effect.
+ *
+ * per-cpu rings are placed one after another in a mmaped area. ring
+ * of cpu n is at n * size.
+ */
+struct raven_ring_hdr {
+	__u32	slot_size;
+	__u32	nslots;
+	__u32	data_offset;
+	__u32	size;	/* size of this ring, including header */
+	__u64	head;	/* written by kernel */
+	__u64	tail;	/* written by userspace */
+	__u64	drops;
+};
+
+/* a slot of capture ring, /proc/driver/raven-capture */
+struct raven_capture_slot {
+	__u32	caplen;		/* captured length of data */
+	__u32	len;		/* packet length */
+	__u64	tstamp;		/* ktime, nsec */
+	__u32	ifindex;	/* raven device */
+	__u32	pad;
+	__u8	data[0];
+};
+
+/* a slot of per-cpu record rings, /proc/driver/raven-record.
+ * stamp[] is skb->ovbench_timestamp[] when the packet arrives at
+ * raven_xmit. */
+#define RAVEN_RECORD_STAMPS	32
+
+struct raven_record {
+	__u8	type;		/* ovbench_type */
+	__u8	encaped;	/* ovbench_encaped */
+	__u16	queue;		/* tx queue of raven device */
+	__u16	cpu;
+	__u16	nstamps;	/* valid entries of stamp[] */
+	__u64	stamp[RAVEN_RECORD_STAMPS];
+};
+
+
+/* latency stamp written by netdevgen into the last bytes of a sampled
+ * packet. encapsulation only prepends headers, so raven finds it at
+ * the tail of the skb with any protocol. seq counts stamped packets
+ * of a generator thread, and tsc is get_cycles () just before xmit.
+ * fields are in host byte order except magic.
+ */
+#define RAVEN_STAMP_MAGIC	0x5253	/* "RS" */
+#define RAVEN_STAMP_THREADS	256	/* tracked generator threads */
+
+struct raven_stamp {
+	__be16	magic;
+	__u16	thread;
+	__u32	seq;
+	__u64	tsc;
+} __attribute__ ((__packed__));
+
+
 #endif /* _RAVEN_H_ */
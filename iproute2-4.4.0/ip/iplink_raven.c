@@ -11,17 +11,28 @@
 #include "ip_common.h"
 #include "../../include/raven.h"
 
+static const char *sink_modes[] = {
+	[RAVEN_SINK_FORWARD]	= "forward",
+	[RAVEN_SINK_DROP]	= "drop",
+	[RAVEN_SINK_LOOPBACK]	= "loopback",
+	[RAVEN_SINK_CAPTURE]	= "capture",
+};
+
 static void
 explain (void)
 {
-	fprintf (stderr, "Usage: ... nsh [ link DEVICE ]\n");
+	fprintf (stderr,
+		 "Usage: ... raven [ link DEVICE ]\n"
+		 "                 [ sink { forward | drop | loopback | capture } ]\n"
+		);
 }
 
 static int
 raven_parse_opt (struct link_util *lu, int argc, char **argv,
 		 struct nlmsghdr *n)
 {
-	__u32 ifindex = 0;
+	__u32 ifindex = 0, sink;
+	int sink_set = 0;
 
 	while (argc > 0) {
 		if (!matches (*argv, "help")) {
@@ -34,6 +45,17 @@ raven_parse_opt (struct link_util *lu, int argc, char **argv,
 				invarg ("invalid device", *argv);
 				exit (-1);
 			}
+		} else if (!matches (*argv, "sink")) {
+			NEXT_ARG ();
+			for (sink = 0; sink <= RAVEN_SINK_MAX; sink++) {
+				if (!strcmp (*argv, sink_modes[sink]))
+					break;
+			}
+			if (sink > RAVEN_SINK_MAX) {
+				invarg ("invalid sink mode", *argv);
+				exit (-1);
+			}
+			sink_set = 1;
 		}
 
 		argc--;
@@ -43,28 +65,36 @@ raven_parse_opt (struct link_util *lu, int argc, char **argv,
 	if (ifindex)
 		addattr32 (n, 1024, IFLA_RAVEN_PHYSICAL_DEV, ifindex);
 
+	if (sink_set)
+		addattr32 (n, 1024, IFLA_RAVEN_SINK_MODE, sink);
+
 	return 0;
 }
 
 static void
 raven_print_opt (struct link_util *lu, FILE *f, struct rtattr *tb[])
 {
-	__u32 ifindex;
+	__u32 ifindex, sink;
 	char dev[IF_NAMESIZE];
 
 	if (!tb)
 		return;
 
-	if (!tb[IFLA_RAVEN_PHYSICAL_DEV])
-		return;
+	if (tb[IFLA_RAVEN_PHYSICAL_DEV]) {
+		ifindex = rta_getattr_u32 (tb[IFLA_RAVEN_PHYSICAL_DEV]);
 
-	ifindex = rta_getattr_u32 (tb[IFLA_RAVEN_PHYSICAL_DEV]);
+		if (ifindex) {
+			if_indextoname (ifindex, dev);
+			fprintf (f, "link %s ", dev);
+		} else
+			fprintf (f, "link none ");
+	}
 
-	if (ifindex) {
-		if_indextoname (ifindex, dev);
-		fprintf (f, "link %s ", dev);
-	} else
-		fprintf (f, "link none ");
+	if (tb[IFLA_RAVEN_SINK_MODE]) {
+		sink = rta_getattr_u32 (tb[IFLA_RAVEN_SINK_MODE]);
+		if (sink <= RAVEN_SINK_MAX)
+			fprintf (f, "sink %s ", sink_modes[sink]);
+	}
 
 	return;
 }
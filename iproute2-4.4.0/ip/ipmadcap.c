@@ -36,6 +36,7 @@ struct madcap_param {
 	__u16 dst_port, src_port;
 
 	int config;
+	int stats;
 
 	int f_offset, f_length;	/* offset and length may become 0 correctly */
 };
@@ -54,7 +55,7 @@ usage (void)
 		 "                              [ src-port [ PORT | hash ] ]\n"
 		 "                              [ enable | disable ] ]\n"
 		 "\n"
-		 "        ip madcap show [ config | udp ] [ dev DEVICE ]\n"
+		 "        ip madcap show [ config | udp | stats ] [ dev DEVICE ]\n"
 		);
 
 	exit (-1);
@@ -143,6 +144,8 @@ parse_args (int argc, char ** argv, struct madcap_param *p)
 			}
 		} else if (strcmp (*argv, "config") == 0) {
 			p->config = 1;
+		} else if (strcmp (*argv, "stats") == 0) {
+			p->stats = 1;
 		}
 
 		argc--;
@@ -412,6 +415,42 @@ obj_udp_nlmsg (const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 	return 0;
 }
 
+static int
+obj_stats_nlmsg (const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	int len;
+	__u32 ifindex;
+	char dev[IF_NAMESIZE] = { 0, };
+	struct genlmsghdr *ghdr;
+	struct rtattr *attrs[MADCAP_ATTR_MAX + 1];
+	struct madcap_obj_stats os;
+
+	ghdr = NLMSG_DATA (n);
+	len = n->nlmsg_len - NLMSG_LENGTH (sizeof (*ghdr));
+	if (len < 0)
+		return -1;
+
+	parse_rtattr (attrs, MADCAP_ATTR_MAX, (void *)ghdr + GENL_HDRLEN, len);
+
+	if (!attrs[MADCAP_ATTR_OBJ_STATS])
+		return -1;
+
+	if (!attrs[MADCAP_ATTR_IFINDEX])
+		return -1;
+
+	ifindex = rta_getattr_u32 (attrs[MADCAP_ATTR_IFINDEX]);
+	if_indextoname (ifindex, dev);
+
+	memcpy (&os, RTA_DATA (attrs[MADCAP_ATTR_OBJ_STATS]), sizeof (os));
+
+	fprintf (stdout, "dev %s headroom %u realloc headroom %llu "
+		 "cloned %llu failed %llu\n",
+		 dev, os.headroom, os.realloc_headroom, os.realloc_cloned,
+		 os.realloc_failed);
+
+	return 0;
+}
+
 static int
 do_show_config (struct madcap_param p)
 {
@@ -466,6 +505,33 @@ do_show_udp (struct madcap_param p)
 	return 0;
 }
 
+static int
+do_show_stats (struct madcap_param p)
+{
+	int ret;
+
+	GENL_REQUEST (req, 2048, genl_family, 0,
+		      MADCAP_GENL_VERSION, MADCAP_CMD_STATS_GET,
+		      NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST);
+
+	if (p.ifindex) {
+		addattr32 (&req.n, 1024, MADCAP_ATTR_IFINDEX, p.ifindex);
+		req.n.nlmsg_seq = genl_rth.dump = ++genl_rth.seq;
+	}
+	ret = rtnl_send (&genl_rth, &req.n, req.n.nlmsg_len);
+	if (ret < 0) {
+		fprintf (stderr, "%s:%d: error\n", __func__, __LINE__);
+		return -2;
+	}
+
+	if (rtnl_dump_filter (&genl_rth, obj_stats_nlmsg, NULL) < 0) {
+		fprintf (stderr, "Dump terminated\n");
+		exit (1);
+	}
+
+	return 0;
+}
+
 static int
 do_show (int argc, char **argv)
 {
@@ -485,6 +551,9 @@ do_show (int argc, char **argv)
 	if (p.udp)
 		return do_show_udp (p);
 
+	if (p.stats)
+		return do_show_stats (p);
+
 
 	GENL_REQUEST (req, 2048, genl_family, 0,
 		      MADCAP_GENL_VERSION, MADCAP_CMD_LLT_ENTRY_GET,
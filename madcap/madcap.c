@@ -7,12 +7,16 @@
 #include <linux/module.h>
 #include <linux/vermagic.h>
 #include <linux/rwlock.h>
+#include <linux/hrtimer.h>
 #include <net/sock.h>
 #include <net/genetlink.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <madcap.h>
 
+#define CREATE_TRACE_POINTS
+#include <madcap_trace.h>
+
 #ifndef DEBUG
 #define DEBUG
 #endif
@@ -35,23 +39,107 @@ MODULE_VERSION (MADCAP_VERSION);
 MODULE_LICENSE ("GPL");
 MODULE_AUTHOR ("upa@haeena.net");
 
+EXPORT_TRACEPOINT_SYMBOL_GPL (madcap_stage);
+EXPORT_TRACEPOINT_SYMBOL_GPL (madcap_drop);
+
+static unsigned int tx_poll_us __read_mostly = 20;
+module_param (tx_poll_us, uint, 0644);
+MODULE_PARM_DESC (tx_poll_us, "interval to poll the stopped tx queue of "
+		  "madcap device for stopped vdevs (usec)");
+
+atomic_t madcap_tx_stopped = ATOMIC_INIT (0);
+EXPORT_SYMBOL (madcap_tx_stopped);
+
 
 /* Per netnamespace parameters */
 static unsigned int madcap_net_id;
 #define MADCAPDEV_PERNET_NUM	16
 
+/* head reallocations counted by __madcap_skb_cow_head */
+struct madcap_stats {
+	u64	realloc_headroom;
+	u64	realloc_cloned;
+	u64	realloc_failed;
+};
+
 struct madcap_net {
 	rwlock_t	lock;
 	struct madcap_ops *ops[MADCAPDEV_PERNET_NUM];
 	struct net_device *dev[MADCAPDEV_PERNET_NUM];
+	struct madcap_stats __percpu *stats[MADCAPDEV_PERNET_NUM];
+
+	struct list_head	acquired_list;	/* struct madcap_acquired */
 };
 
+/* vdev acquires dev. */
+struct madcap_acquired {
+	struct list_head	list;	/* madcap_net->acquired_list */
+	struct net_device	*dev;	/* madcap capable physical device */
+	struct net_device	*vdev;	/* overlay pseudo device */
+
+	unsigned long		flags;
+	u16			queue;	/* tx queue of dev vdev waits for */
+	struct hrtimer		timer;	/* polls the queue while stopped */
+};
+
+#define MADCAP_ACQUIRED_F_STOPPED	0	/* vdev queues are stopped */
+
 
 /* XXX: Many features such as driver/device lock and resource
  * allocation like switchdev trans.ph_prepare phasing are needed. but
  * not implemented...
  */
 
+static int
+madcap_dev_queue_xmit (struct sk_buff *skb, struct net_device *dev)
+{
+	/* The mark overlaps SKB_GSO_CB, which skb_mac_gso_segment()
+	 * writes when validate_xmit_skb() segments the skb in software
+	 * after the qdisc. Then the segments reach the madcap device
+	 * unmarked. So, segment the skb here, and mark each segment. */
+	int rc, ret = NET_XMIT_SUCCESS;
+	netdev_features_t features;
+	struct madcap_skb_cb mcb;
+	struct sk_buff *segs, *next;
+
+	skb->dev = dev;
+
+	if (!skb_is_gso (skb))
+		return dev_queue_xmit (skb);
+
+	features = netif_skb_features (skb);
+	if (!netif_needs_gso (skb, features))
+		return dev_queue_xmit (skb);
+
+	mcb = *MADCAP_SKB_CB (skb);
+	segs = skb_gso_segment (skb, features);
+	if (IS_ERR (segs)) {
+		kfree_skb (skb);
+		return NET_XMIT_DROP;
+	}
+	if (!segs) {
+		*MADCAP_SKB_CB (skb) = mcb;
+		return dev_queue_xmit (skb);
+	}
+	consume_skb (skb);
+
+	for (; segs; segs = next) {
+		next = segs->next;
+		segs->next = NULL;
+		*MADCAP_SKB_CB (segs) = mcb;
+
+		/* the mark must reach the madcap device */
+		WARN_ON_ONCE (skb_is_gso (segs) &&
+			      netif_needs_gso (segs, features));
+
+		rc = dev_queue_xmit (segs);
+		if (rc != NET_XMIT_SUCCESS && ret == NET_XMIT_SUCCESS)
+			ret = rc;
+	}
+
+	return ret;
+}
+
 int
 madcap_queue_xmit (struct sk_buff *skb, struct net_device *dev)
 {
@@ -62,22 +150,332 @@ madcap_queue_xmit (struct sk_buff *skb, struct net_device *dev)
 	 * needed. HOWEVER, this model shouled be more considered.
 	 */
 
-	skb->dev = dev;
-	return dev_queue_xmit (skb);
+	trace_madcap_stage (skb, MADCAP_STAGE_MADCAP_XMIT);
+	madcap_skb_mark (skb);
+	return madcap_dev_queue_xmit (skb, dev);
 }
 EXPORT_SYMBOL (madcap_queue_xmit);
 
+int
+madcap_queue_xmit_id (struct sk_buff *skb, struct net_device *dev,
+		      __u64 id, __u16 tb_id)
+{
+	trace_madcap_stage (skb, MADCAP_STAGE_MADCAP_XMIT);
+	madcap_skb_mark (skb);
+	madcap_skb_set_id (skb, id, tb_id);
+	return madcap_dev_queue_xmit (skb, dev);
+}
+EXPORT_SYMBOL (madcap_queue_xmit_id);
+
+int
+__madcap_skb_cow_head (struct sk_buff *skb, struct net_device *dev,
+		       unsigned int headroom)
+{
+	/* slow path of madcap_skb_cow_head. the head is reallocated. */
+	int n, err;
+	bool cloned = skb_header_cloned (skb);
+	struct madcap_stats __percpu *stats = NULL;
+	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
+
+	err = skb_cow_head (skb, headroom);
+
+	read_lock (&madnet->lock);
+	for (n = 0; n < MADCAPDEV_PERNET_NUM; n++) {
+		if (madnet->dev[n] == dev) {
+			stats = madnet->stats[n];
+			break;
+		}
+	}
+
+	if (stats) {
+		if (err)
+			this_cpu_inc (stats->realloc_failed);
+		else if (cloned)
+			this_cpu_inc (stats->realloc_cloned);
+		else
+			this_cpu_inc (stats->realloc_headroom);
+	}
+	read_unlock (&madnet->lock);
+
+	return err;
+}
+EXPORT_SYMBOL (__madcap_skb_cow_head);
+
+int
+madcap_get_headroom (struct net_device *dev)
+{
+	struct madcap_ops *mc_ops;
+
+	mc_ops = get_madcap_ops (dev);
+	if (mc_ops && mc_ops->mco_get_headroom)
+		return mc_ops->mco_get_headroom (dev);
+
+	return 0;
+}
+EXPORT_SYMBOL (madcap_get_headroom);
+
+static void
+madcap_headroom_update (struct net_device *dev)
+{
+	/* the outer link layer header fits in hard_header_len of dev,
+	 * and the rest of the outer headers in its needed_headroom.
+	 * vdevs take LL_RESERVED_SPACE of dev by madcap_vdev_headroom
+	 * after acquiring. */
+	int hlen = madcap_get_headroom (dev);
+
+	if (hlen > dev->hard_header_len &&
+	    dev->needed_headroom < hlen - dev->hard_header_len)
+		dev->needed_headroom = hlen - dev->hard_header_len;
+}
+
+static void
+madcap_acquired_wake (struct madcap_acquired *ma)
+{
+	if (test_and_clear_bit (MADCAP_ACQUIRED_F_STOPPED, &ma->flags)) {
+		atomic_dec (&madcap_tx_stopped);
+		netif_tx_wake_all_queues (ma->vdev);
+	}
+}
+
+static enum hrtimer_restart
+madcap_acquired_poll (struct hrtimer *timer)
+{
+	struct madcap_acquired *ma;
+
+	ma = container_of (timer, struct madcap_acquired, timer);
+
+	if (!test_bit (MADCAP_ACQUIRED_F_STOPPED, &ma->flags))
+		return HRTIMER_NORESTART;
+
+	if (netif_xmit_frozen_or_stopped (netdev_get_tx_queue (ma->dev,
+							       ma->queue))) {
+		hrtimer_forward_now (timer, ns_to_ktime (tx_poll_us *
+							 NSEC_PER_USEC));
+		return HRTIMER_RESTART;
+	}
+
+	madcap_acquired_wake (ma);
+	return HRTIMER_NORESTART;
+}
+
+static void
+madcap_acquired_free (struct madcap_acquired *ma)
+{
+	/* vdev may live after release. start its queues without
+	 * scheduling, as it may be going down. */
+	hrtimer_cancel (&ma->timer);
+	if (test_and_clear_bit (MADCAP_ACQUIRED_F_STOPPED, &ma->flags)) {
+		atomic_dec (&madcap_tx_stopped);
+		netif_tx_start_all_queues (ma->vdev);
+	}
+	kfree (ma);
+}
+
+static struct madcap_acquired *
+madcap_acquired_find (struct madcap_net *madnet, struct net_device *dev,
+		      struct net_device *vdev)
+{
+	struct madcap_acquired *ma;
+
+	list_for_each_entry (ma, &madnet->acquired_list, list) {
+		if (ma->dev == dev && ma->vdev == vdev)
+			return ma;
+	}
+
+	return NULL;
+}
+
+static int
+madcap_xps_queue (struct net_device *dev, struct sk_buff *skb)
+{
+	/* get_xps_queue() of net/core/dev.c */
+#ifdef CONFIG_XPS
+	struct xps_dev_maps *dev_maps;
+	struct xps_map *map;
+	int queue = -1;
+
+	rcu_read_lock ();
+	dev_maps = rcu_dereference (dev->xps_maps);
+	if (dev_maps) {
+		map = rcu_dereference (dev_maps->cpu_map[skb->sender_cpu - 1]);
+		if (map) {
+			if (map->len == 1)
+				queue = map->queues[0];
+			else
+				queue = map->queues[reciprocal_scale
+						    (skb_get_hash (skb),
+						     map->len)];
+			if (unlikely (queue >= dev->real_num_tx_queues))
+				queue = -1;
+		}
+	}
+	rcu_read_unlock ();
+
+	return queue;
+#else
+	return -1;
+#endif
+}
+
+static u16
+madcap_pick_tx_fallback (struct net_device *dev, struct sk_buff *skb)
+{
+	/* __netdev_pick_tx() without recording the queue on the
+	 * socket, which is done when the skb is really transmitted. */
+	int queue = sk_tx_queue_get (skb->sk);
+
+	if (queue < 0 || skb->ooo_okay || queue >= dev->real_num_tx_queues) {
+		queue = madcap_xps_queue (dev, skb);
+		if (queue < 0)
+			queue = skb_tx_hash (dev, skb);
+	}
+
+	return queue;
+}
+
+u16
+madcap_pick_tx (struct net_device *dev, struct sk_buff *skb)
+{
+	/* the queue netdev_pick_tx() will select for skb, so that
+	 * madcap_tx_busy() checks the queue the skb really goes to. */
+	const struct net_device_ops *ops = dev->netdev_ops;
+	u16 queue;
+
+#ifdef CONFIG_XPS
+	if (skb->sender_cpu == 0)
+		skb->sender_cpu = raw_smp_processor_id () + 1;
+#endif
+
+	if (dev->real_num_tx_queues == 1)
+		return 0;
+
+	if (ops->ndo_select_queue)
+		queue = ops->ndo_select_queue (dev, skb, NULL,
+					       madcap_pick_tx_fallback);
+	else
+		queue = madcap_pick_tx_fallback (dev, skb);
+
+	if (unlikely (queue >= dev->real_num_tx_queues))
+		queue = 0;
+
+	return queue;
+}
+EXPORT_SYMBOL (madcap_pick_tx);
+
+int
+__madcap_tx_busy (struct net_device *dev, struct net_device *vdev,
+		  struct sk_buff *skb, u16 queue)
+{
+	/* slow path of madcap_tx_busy. the queue of dev is stopped. */
+	int ret = MADCAP_TX_OK;
+	struct netdev_queue *txq, *vtxq;
+	struct madcap_acquired *ma;
+	struct Qdisc *q;
+	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
+
+	txq = netdev_get_tx_queue (dev, queue);
+	vtxq = netdev_get_tx_queue (vdev, skb_get_queue_mapping (skb));
+
+	if (!rcu_dereference_bh (vtxq->qdisc)->enqueue) {
+		/* noqueue vdevs can not hold the skb. drop it when the
+		 * qdisc of dev is full, where it would be dropped. */
+		q = rcu_dereference_bh (txq->qdisc);
+		if (qdisc_qlen (q) >= dev->tx_queue_len)
+			return MADCAP_TX_DROP;
+		return MADCAP_TX_OK;
+	}
+
+	read_lock (&madnet->lock);
+	ma = madcap_acquired_find (madnet, dev, vdev);
+	if (!ma)
+		goto out;
+
+	netif_tx_stop_queue (vtxq);
+	if (!test_and_set_bit (MADCAP_ACQUIRED_F_STOPPED, &ma->flags)) {
+		ma->queue = queue;
+		atomic_inc (&madcap_tx_stopped);
+		hrtimer_start (&ma->timer,
+			       ns_to_ktime (tx_poll_us * NSEC_PER_USEC),
+			       HRTIMER_MODE_REL);
+	}
+
+	/* tx completion may have woken the queue before vdev is
+	 * recorded as stopped. */
+	smp_mb__after_atomic ();
+	if (!netif_xmit_frozen_or_stopped (txq))
+		madcap_acquired_wake (ma);
+
+	ret = MADCAP_TX_BUSY;
+out:
+	read_unlock (&madnet->lock);
+	return ret;
+}
+EXPORT_SYMBOL (__madcap_tx_busy);
+
+void
+__madcap_tx_wake (struct net_device *dev, u16 queue)
+{
+	struct madcap_acquired *ma;
+	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
+
+	if (netif_xmit_frozen_or_stopped (netdev_get_tx_queue (dev, queue)))
+		return;
+
+	read_lock (&madnet->lock);
+	list_for_each_entry (ma, &madnet->acquired_list, list) {
+		if (ma->dev == dev && ma->queue == queue &&
+		    test_bit (MADCAP_ACQUIRED_F_STOPPED, &ma->flags))
+			madcap_acquired_wake (ma);
+	}
+	read_unlock (&madnet->lock);
+}
+EXPORT_SYMBOL (__madcap_tx_wake);
+
 int
 madcap_acquire_dev (struct net_device *dev, struct net_device *vdev)
 {
+	int err;
 	struct madcap_ops *mc_ops;
+	struct madcap_acquired *ma;
+	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
 
 	mc_ops = get_madcap_ops (dev);
+	if (!mc_ops)
+		return -EOPNOTSUPP;
+
+	read_lock_bh (&madnet->lock);
+	ma = madcap_acquired_find (madnet, dev, vdev);
+	read_unlock_bh (&madnet->lock);
+	if (ma)
+		return -EEXIST;
+
+	ma = kzalloc (sizeof (*ma), GFP_KERNEL);
+	if (!ma)
+		return -ENOMEM;
+
+	ma->dev = dev;
+	ma->vdev = vdev;
+	hrtimer_init (&ma->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ma->timer.function = madcap_acquired_poll;
+
+	if (mc_ops->mco_acquire_dev) {
+		err = mc_ops->mco_acquire_dev (dev, vdev);
+		if (err < 0) {
+			kfree (ma);
+			return err;
+		}
+	}
+
+	madcap_headroom_update (dev);
+
+	write_lock_bh (&madnet->lock);
+	list_add_tail (&ma->list, &madnet->acquired_list);
+	write_unlock_bh (&madnet->lock);
 
-	if (mc_ops && mc_ops->mco_acquire_dev)
-		return mc_ops->mco_acquire_dev (dev, vdev);
+	pr_debug ("%s is acquired by %s, headroom %u", dev->name,
+		  vdev->name, dev->needed_headroom);
 
-	return -EOPNOTSUPP;
+	return 0;
 }
 EXPORT_SYMBOL (madcap_acquire_dev);
 
@@ -85,16 +483,51 @@ int
 madcap_release_dev (struct net_device *dev, struct net_device *vdev)
 {
 	struct madcap_ops *mc_ops;
+	struct madcap_acquired *ma;
+	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
 
-	mc_ops = get_madcap_ops (dev);
+	write_lock_bh (&madnet->lock);
+	ma = madcap_acquired_find (madnet, dev, vdev);
+	if (ma)
+		list_del (&ma->list);
+	write_unlock_bh (&madnet->lock);
+
+	if (!ma)
+		return -ENOENT;
 
+	madcap_acquired_free (ma);
+
+	mc_ops = get_madcap_ops (dev);
 	if (mc_ops && mc_ops->mco_release_dev)
 		return mc_ops->mco_release_dev (dev, vdev);
 
-	return -EOPNOTSUPP;
+	return 0;
 }
 EXPORT_SYMBOL (madcap_release_dev);
 
+static void
+madcap_acquired_purge (struct net *net, struct net_device *dev)
+{
+	/* release all acquisitions related to dev (as a physical
+	 * device or as an acquiring device). */
+
+	struct madcap_acquired *ma, *tmp;
+	struct madcap_net *madnet = net_generic (net, madcap_net_id);
+	LIST_HEAD (purge);
+
+	write_lock_bh (&madnet->lock);
+	list_for_each_entry_safe (ma, tmp, &madnet->acquired_list, list) {
+		if (ma->dev == dev || ma->vdev == dev)
+			list_move (&ma->list, &purge);
+	}
+	write_unlock_bh (&madnet->lock);
+
+	list_for_each_entry_safe (ma, tmp, &purge, list) {
+		list_del (&ma->list);
+		madcap_acquired_free (ma);
+	}
+}
+
 /* XXX: */
 #define __MADCAP_OBJ_DEFUN(funcname)                                    \
 	int madcap_##funcname (struct net_device *dev,			\
@@ -164,6 +597,8 @@ static struct nla_policy madcap_nl_policy[MADCAP_ATTR_MAX + 1] = {
 				    .len = sizeof (struct madcap_obj_entry)},
 	[MADCAP_ATTR_OBJ_UDP]	= { .type = NLA_BINARY,
 				    .len = sizeof (struct madcap_obj_udp)},
+	[MADCAP_ATTR_OBJ_STATS]	= { .type = NLA_BINARY,
+				    .len = sizeof (struct madcap_obj_stats)},
 };
 
 static int
@@ -191,6 +626,10 @@ genl_madcap_obj_send (struct sk_buff *skb, u32 portid, u32 seq,
 		len = sizeof (struct madcap_obj_udp);
 		attr = MADCAP_ATTR_OBJ_UDP;
 		break;
+	case MADCAP_OBJ_ID_STATS :
+		len = sizeof (struct madcap_obj_stats);
+		attr = MADCAP_ATTR_OBJ_STATS;
+		break;
 	default :
 		pr_debug ("%s: unknonw madcap_obj id %d", __func__, obj->id);
 		goto nla_put_failure;
@@ -531,6 +970,84 @@ madcap_nl_cmd_udp_config_dump (struct sk_buff *skb,
 	return skb->len;
 }
 
+static void
+madcap_stats_fill (struct madcap_net *madnet, int n,
+		   struct madcap_obj_stats *os)
+{
+	int cpu;
+	struct madcap_stats *st;
+
+	memset (os, 0, sizeof (*os));
+	os->obj.id = MADCAP_OBJ_ID_STATS;
+	os->headroom = madcap_get_headroom (madnet->dev[n]);
+
+	for_each_possible_cpu (cpu) {
+		st = per_cpu_ptr (madnet->stats[n], cpu);
+		os->realloc_headroom	+= st->realloc_headroom;
+		os->realloc_cloned	+= st->realloc_cloned;
+		os->realloc_failed	+= st->realloc_failed;
+	}
+}
+
+static int
+madcap_nl_cmd_stats_dump (struct sk_buff *skb, struct netlink_callback *cb)
+{
+	int n, rc, idx, cnt;
+	u32 ifindex;
+	struct net *net = sock_net (skb->sk);
+	struct madcap_net *madnet = net_generic (net, madcap_net_id);
+	struct nlattr *attrs[MADCAP_ATTR_MAX + 1];
+	struct madcap_obj_stats os;
+	bool found = false;
+
+	/* XXX: kernel 4.0 later, use genlmsg_parse() */
+	rc = nlmsg_parse (cb->nlh, madcap_nl_family.hdrsize + GENL_HDRLEN,
+			  attrs, MADCAP_ATTR_MAX, madcap_nl_policy);
+	if (rc < 0) {
+		pr_debug ("%s: failed to parse cb->nlh", __func__);
+		return -1;
+	}
+
+	idx = cb->args[0];
+
+	ifindex = (attrs[MADCAP_ATTR_IFINDEX]) ?
+		nla_get_u32 (attrs[MADCAP_ATTR_IFINDEX]) : 0;
+
+	/* send stats of all or specified madcap device */
+	read_lock_bh (&madnet->lock);
+	for (n = 0, cnt = 0; n < MADCAPDEV_PERNET_NUM; n++) {
+
+		if (!madnet->ops[n] || !madnet->dev[n] || !madnet->stats[n])
+			continue;
+
+		if (ifindex && madnet->dev[n]->ifindex != ifindex)
+			continue;
+
+		if (idx > cnt) {
+			cnt++;
+			continue;
+		}
+
+		madcap_stats_fill (madnet, n, &os);
+		ifindex = madnet->dev[n]->ifindex;
+		found = true;
+		break;
+	}
+	read_unlock_bh (&madnet->lock);
+
+	if (found) {
+		rc = genl_madcap_obj_send (skb, NETLINK_CB (cb->skb).portid,
+					   cb->nlh->nlmsg_seq, NLM_F_MULTI,
+					   MADCAP_CMD_STATS_GET,
+					   MADCAP_OBJ (os), ifindex);
+		if (rc < 0)
+			return -1;
+	}
+
+	cb->args[0] = cnt + 1;
+	return skb->len;
+}
+
 static struct genl_ops madcap_nl_ops[] = {
 	{
 		.cmd	= MADCAP_CMD_LLT_CONFIG,
@@ -567,6 +1084,11 @@ static struct genl_ops madcap_nl_ops[] = {
 		.dumpit	= madcap_nl_cmd_udp_config_dump,
 		.policy	= madcap_nl_policy,
 	},
+	{
+		.cmd	= MADCAP_CMD_STATS_GET,
+		.dumpit	= madcap_nl_cmd_stats_dump,
+		.policy	= madcap_nl_policy,
+	},
 };
 
 
@@ -587,6 +1109,7 @@ madcap_init_net (struct net *net)
 
 	memset (madnet, 0, sizeof (*madnet));
 	rwlock_init (&madnet->lock);
+	INIT_LIST_HEAD (&madnet->acquired_list);
 
 	return 0;
 }
@@ -594,6 +1117,18 @@ madcap_init_net (struct net *net)
 static __net_exit void
 madcap_exit_net (struct net *net)
 {
+	int n;
+	struct madcap_acquired *ma, *tmp;
+	struct madcap_net *madnet = net_generic (net, madcap_net_id);
+
+	for (n = 0; n < MADCAPDEV_PERNET_NUM; n++)
+		free_percpu (madnet->stats[n]);
+
+	list_for_each_entry_safe (ma, tmp, &madnet->acquired_list, list) {
+		list_del (&ma->list);
+		madcap_acquired_free (ma);
+	}
+
 	return;
 }
 
@@ -628,21 +1163,23 @@ int
 madcap_register_device (struct net_device *dev, struct madcap_ops *mc_ops)
 {
 	int n;
+	struct madcap_stats __percpu *stats;
 	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
 
 	/*XXX: get_madcap_ops should lock? */
 	if (get_madcap_ops (dev))
 		return -EEXIST;
-	
-	/* skb->dst is used to distinguish that packet is xmited from
-	 * encaped device. see sfmc_encap_packet. */
-	netif_keep_dst (dev);
+
+	stats = alloc_percpu (struct madcap_stats);
+	if (!stats)
+		return -ENOMEM;
 
 	write_lock_bh (&madnet->lock);
 	for (n = 0; n < MADCAPDEV_PERNET_NUM; n++) {
 		if (madnet->dev[n] == NULL) {
 			madnet->ops[n] = mc_ops;
 			madnet->dev[n] = dev;
+			madnet->stats[n] = stats;
 			break;
 		}
 	}
@@ -651,6 +1188,7 @@ madcap_register_device (struct net_device *dev, struct madcap_ops *mc_ops)
 	if (!(n < MADCAPDEV_PERNET_NUM)) {
 		pr_info ("sorry, max number of madcap dev in a netns is %d",
 			 MADCAPDEV_PERNET_NUM);
+		free_percpu (stats);
 		return -ENOMEM;
 	}
 
@@ -662,6 +1200,7 @@ int
 madcap_unregister_device (struct net_device *dev)
 {
 	int n;
+	struct madcap_stats __percpu *stats = NULL;
 	struct madcap_net *madnet = net_generic (dev_net (dev), madcap_net_id);
 
 	write_lock_bh (&madnet->lock);
@@ -669,10 +1208,16 @@ madcap_unregister_device (struct net_device *dev)
 		if (madnet->dev[n] == dev) {
 			madnet->dev[n] = NULL;
 			madnet->ops[n] = NULL;
+			stats = madnet->stats[n];
+			madnet->stats[n] = NULL;
 		}
 	}
 	write_unlock_bh (&madnet->lock);
 
+	free_percpu (stats);
+
+	madcap_acquired_purge (dev_net (dev), dev);
+
 	if (!(n < MADCAPDEV_PERNET_NUM)) {
 		return -ENOENT;
 	}
@@ -681,6 +1226,24 @@ madcap_unregister_device (struct net_device *dev)
 }
 EXPORT_SYMBOL (madcap_unregister_device);
 
+static int
+madcap_netdev_event (struct notifier_block *unused, unsigned long event,
+		     void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev (ptr);
+
+	/* protocol drivers do not always release dev when their
+	 * pseudo devices are destroyed. */
+	if (event == NETDEV_UNREGISTER)
+		madcap_acquired_purge (dev_net (dev), dev);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block madcap_netdev_nb __read_mostly = {
+	.notifier_call = madcap_netdev_event,
+};
+
 
 static int
 __init madcap_init_module (void)
@@ -695,9 +1258,15 @@ __init madcap_init_module (void)
 	if (rc < 0)
 		goto genl_failed;
 
+	rc = register_netdevice_notifier (&madcap_netdev_nb);
+	if (rc < 0)
+		goto notifier_failed;
+
 	pr_info ("madcap (%s) is loaded.", MADCAP_VERSION);
 	return 0;
 
+notifier_failed:
+	genl_unregister_family (&madcap_nl_family);
 genl_failed:
 	unregister_pernet_subsys (&madcap_net_ops);
 netns_failed:
@@ -708,6 +1277,7 @@ module_init (madcap_init_module);
 static void __exit
 madcap_exit_module (void)
 {
+	unregister_netdevice_notifier (&madcap_netdev_nb);
 	genl_unregister_family (&madcap_nl_family);
 	unregister_pernet_subsys(&madcap_net_ops);
 
@@ -10,13 +10,32 @@
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/etherdevice.h>
+#include <linux/swab.h>
+#include <linux/timex.h>
 #include <asm/atomic.h>
 #include <net/ip.h>
 #include <net/route.h>
+#include <net/neighbour.h>
+#include <net/checksum.h>
 #include <net/net_namespace.h>
 
+#include <madcap.h>
+#include <madcap_trace.h>
+#include <raven.h>
+
 #ifdef OVBENCH
 #include <linux/ovbench.h>
 #endif
@@ -30,14 +49,144 @@ MODULE_LICENSE ("GPL");
 	        struct task_struct *__k					\
 			= kthread_create(threadfn, data,		\
 					 namefmt, ## __VA_ARGS__);	\
-		if (!IS_ERR(__k))					\
+		if (!IS_ERR(__k)) {					\
+			kthread_bind(__k, cpu);				\
 			wake_up_process(__k);				\
-		kthread_bind(__k, cpu);					\
+		}							\
 		__k;							\
 	})
 
-static bool ndg_thread_running = false;
-static struct task_struct * ndg_tsk, * ndg_one_tsk;
+static struct task_struct * ndg_one_tsk;
+
+static char *cpus = "2";
+module_param (cpus, charp, 0444);
+MODULE_PARM_DESC (cpus, "cpu list to run generator threads, e.g. 1,2-4");
+
+/* packet size mix. a size is drawn by weight for each packet, or
+ * sizes are stepped through every step seconds in sweep mode. */
+#define NDG_SIZES_MAX	16
+#define NDG_SCHED_MAX	1024
+#define NDG_PKTLEN_MIN	(sizeof (struct iphdr) + sizeof (struct udphdr))
+#define NDG_PKTLEN_MAX	IP_MAX_MTU	/* with gso */
+
+/* simple IMIX, 64, 594 and 1500 byte frames in 7:4:1 */
+#define NDG_IMIX	"50:7,580:4,1486:1"
+
+struct ndg_mix {
+	int		nsizes;
+	int		len[NDG_SIZES_MAX];	/* as pktlen */
+	u32		weight[NDG_SIZES_MAX];
+	int		sweep;
+	unsigned int	step;			/* seconds for a size */
+	u32		nsched;
+	u8		sched[NDG_SCHED_MAX];	/* size index by weight */
+};
+
+static struct ndg_mix ndg_mix;		/* for all threads */
+static struct ndg_mix **ndg_cpu_mix;	/* per cpu, overrides ndg_mix */
+
+struct ndg_stats {
+	u64	packets;
+	u64	bytes;
+	u64	accepted;
+	u64	dropped;
+};
+
+/* generator thread, one for each cpu in ndg_cpumask */
+struct ndg_thread {
+	struct task_struct	*tsk;
+	unsigned int		cpu;
+	struct ndg_mix		mix;	/* copied at start */
+	struct sk_buff		*skbs[NDG_SIZES_MAX];	/* templates */
+	int			cur;	/* size index in sweep */
+	struct ndg_stats	size[NDG_SIZES_MAX];
+
+	/* frames of the loaded pcap, replayed in order */
+	struct sk_buff		**pcap;
+	u32			pcap_n;
+	u32			pcap_next;
+	bool			replay;		/* pcap_n is kept after stop */
+
+	/* recycled skbs for NDG_SKB_POOL */
+	struct sk_buff		**pool;
+	int			pool_next;
+	unsigned int		pool_len;	/* largest tail offset */
+	u64			pool_misses;	/* still in use, replaced */
+
+	/* latency stamps, see struct raven_stamp */
+	u32			stamp_cnt;
+	u32			stamp_seq;
+
+	u64			packets;	/* generated */
+	u64			bytes;
+	u64			accepted;	/* by ip_local_out */
+	u64			dropped;
+	struct u64_stats_sync	syncp;
+
+	/* timed run */
+	unsigned long		deadline;	/* jiffies, 0 means forever */
+	unsigned long		startj;
+	ktime_t			start;
+	ktime_t			end;		/* 0 while running */
+
+	/* rate since last proc read */
+	u64			last_packets;
+	u64			last_bytes;
+	ktime_t			last;
+};
+
+/* how each packet is made from a template */
+enum {
+	NDG_SKB_CLONE,	/* skb_clone, shares data with the template */
+	NDG_SKB_ALLOC,	/* new skb and data for every packet */
+	NDG_SKB_POOL,	/* skbs recycled after tx completes */
+};
+
+static const char * const ndg_skbmode_names[] = {
+	[NDG_SKB_CLONE]	= "clone",
+	[NDG_SKB_ALLOC]	= "alloc",
+	[NDG_SKB_POOL]	= "pool",
+};
+
+static int skbmode __read_mostly = NDG_SKB_CLONE;
+module_param_named (skbmode, skbmode, int, 0444);
+MODULE_PARM_DESC (skbmode, "0 clone, 1 alloc, 2 pool");
+
+/* gso super packets. packets longer than mss are sent as gso skbs,
+ * and segmented by the tunnel device, its lower device or software
+ * gso. udp is ufo of this kernel, ip fragments of a udp datagram. */
+enum {
+	NDG_GSO_OFF,
+	NDG_GSO_TCP,
+	NDG_GSO_UDP,
+};
+
+static const char * const ndg_gso_names[] = {
+	[NDG_GSO_OFF]	= "off",
+	[NDG_GSO_TCP]	= "tcp",
+	[NDG_GSO_UDP]	= "udp",
+};
+
+#define NDG_GSO_TCP_MSS	1448	/* 1500 - ip - tcp with timestamps */
+#define NDG_GSO_UDP_MSS	1480	/* 1500 - ip, multiple of 8 */
+
+static int gso __read_mostly = NDG_GSO_OFF;
+module_param_named (gso, gso, int, 0444);
+MODULE_PARM_DESC (gso, "0 off, 1 tcp, 2 udp");
+
+static int gso_mss __read_mostly = 0;
+module_param_named (gso_mss, gso_mss, int, 0444);
+MODULE_PARM_DESC (gso_mss, "gso_size, 0 means default of the protocol");
+
+static int pool_size __read_mostly = 256;
+module_param_named (pool_size, pool_size, int, 0444);
+MODULE_PARM_DESC (pool_size, "skbs in the pool of each thread");
+
+static struct ndg_thread *ndg_threads;	/* nr_cpu_ids entries */
+static int ndg_nthreads;		/* running threads */
+static int ndg_nstats;			/* threads of the last run */
+static cpumask_var_t ndg_cpumask;
+static DEFINE_MUTEX (ndg_mutex);	/* protects threads */
 
 
 static int pktlen __read_mostly = 46;
@@ -50,6 +199,24 @@ module_param_named (measure_pps, measure_pps, int, 0444);
 MODULE_PARM_DESC (measure_pps, "if 1, measure pps mode");
 
 
+/* direct mode. frames are passed to ndo_start_xmit of the tunnel
+ * device in bursts, bypassing ip_local_out, routing, netfilter and
+ * neighbour output. */
+#define NDG_BURST_MAX	64
+
+static int burst __read_mostly = 0;
+module_param_named (burst, burst, int, 0444);
+MODULE_PARM_DESC (burst, "frames per ndo_start_xmit burst, "
+		  "0 means xmit through ip_local_out");
+
+
+/* latency under load. 1 of stamp packets carries struct raven_stamp
+ * at the tail of its payload, read by raven with stamp_latency=1. */
+static int stamp __read_mostly = 0;
+module_param_named (stamp, stamp, int, 0444);
+MODULE_PARM_DESC (stamp, "stamp 1 of N packets for raven, 0 disables");
+
+
 static __be32 srcip_ipip	= 0x010110AC; /* 172.16.1.1 */
 static __be32 dstip_ipip	= 0x020110AC; /* 172.16.1.2 */
 
@@ -71,24 +238,350 @@ static __be32 dstip_noencap	= 0x020610AC; /* 172.16.6.2 */
 static __be32 srcip;
 static __be32 dstip;
 
+/* protocol of the last protocol command, for rx frames */
+enum {
+	NDG_PROTO_NOENCAP,
+	NDG_PROTO_IPIP,
+	NDG_PROTO_GRE,
+	NDG_PROTO_GRETAP,
+	NDG_PROTO_VXLAN,
+	NDG_PROTO_NSH,
+};
+
+static int ndg_proto;
+
 #ifdef OVBENCH
 static int ovtype;
 #endif
 
 #define PROC_NAME "driver/netdevgen"
+#define PCAP_PROC_NAME "driver/netdevgen-pcap"
+
+
+/* pcap replay. a pcap file written to PCAP_PROC_NAME is kept, and
+ * threads replay its frames instead of templates to the device of
+ * the protocol. ethernet frames are sent as is to L2 devices, and
+ * ipv4 packets in them to L3 devices. */
+
+#define NDG_PCAP_MAX		(256 << 20)
+#define NDG_PCAP_MAGIC		0xa1b2c3d4
+#define NDG_PCAP_MAGIC_NSEC	0xa1b23c4d
+
+#define NDG_LINKTYPE_ETHERNET	1
+#define NDG_LINKTYPE_RAW	101
+#define NDG_LINKTYPE_IPV4	228
+
+struct ndg_pcap_file_hdr {
+	__u32	magic;
+	__u16	version_major;
+	__u16	version_minor;
+	__s32	thiszone;
+	__u32	sigfigs;
+	__u32	snaplen;
+	__u32	linktype;
+} __attribute__ ((__packed__));
+
+struct ndg_pcap_rec_hdr {
+	__u32	ts_sec;
+	__u32	ts_usec;
+	__u32	incl_len;
+	__u32	orig_len;
+} __attribute__ ((__packed__));
+
+struct ndg_pcap_rec {
+	u32	off;	/* of the frame in data */
+	u32	len;
+};
+
+struct ndg_pcap {
+	u8			*data;	/* whole pcap file */
+	size_t			len;
+	u32			linktype;
+	u32			nrecs;
+	struct ndg_pcap_rec	*recs;
+};
+
+static struct ndg_pcap *ndg_pcap;	/* protected by ndg_mutex */
+
+
+/* rx injection. threads inject frames encapsulated for the protocol
+ * into the rx path of ndg_rxdev with netif_receive_skb, as a NIC
+ * driver does, and a sink on the tunnel device counts decapsulated
+ * packets. outer addresses are those of the raven setup, from the
+ * tunnel remote (dstip_noencap) to the local (srcip_noencap), with
+ * vni 0, and spi 10 si 5 for nsh. */
+
+#define NDG_VXLAN_PORT		4789
+#define NDG_VXLAN_FLAGS		0x08000000	/* I flag, vni is valid */
+#define NDG_VXLAN_GPE_PORT	4790
+#define NDG_VXLAN_GPE_NSH	0x0C000004	/* next protocol nsh */
+#define NDG_NSH_BASE		0x00020203	/* md-type 2, 8 byte, eth */
+#define NDG_NSH_SPISI		((10 << 8) | 5)
+#define NDG_RX_HLEN_MAX		(ETH_HLEN + sizeof (struct iphdr) + \
+				 sizeof (struct udphdr) + 8 + 8 + ETH_HLEN)
+
+static struct net_device *ndg_rxdev;	/* protected by ndg_mutex */
+
+struct ndg_sink_stats {
+	u64			packets;
+	u64			bytes;
+	struct u64_stats_sync	syncp;
+};
+
+static struct net_device *ndg_sinkdev;	/* rx_handler registered */
+static char ndg_sinkname[IFNAMSIZ];	/* kept after stop for stats */
+static struct ndg_sink_stats __percpu *ndg_sink_stats;
+
+
+
+/* traffic profiles. A profile draws an index in [0, count) for each
+ * packet, in uniform or zipf distribution. zipf uses a schedule
+ * table, in which index i appears in proportion to 1 / (i + 1)^s.
+ * flows varies inner src ip and udp src port, and locators pins
+ * locator id, base + index, to the packet.
+ */
+
+enum {
+	NDG_DIST_UNIFORM,
+	NDG_DIST_ZIPF,
+};
+
+struct ndg_profile {
+	u32	count;		/* number of flows or locators */
+	int	dist;		/* NDG_DIST_* */
+	u32	s;		/* zipf exponent in 1/100 */
+	u32	*table;		/* schedule table for zipf */
+	u32	tsize;		/* entries of table */
+};
+
+static struct ndg_profile ndg_flows = { .count = 1 };
+static struct ndg_profile ndg_locators = { .count = 0 };
+static u64 ndg_locator_base = 0;
+
+static int sched_size __read_mostly = 1 << 20;
+module_param_named (sched_size, sched_size, int, 0444);
+MODULE_PARM_DESC (sched_size, "entries of zipf schedule table");
+
+static u32
+ndg_log2_q16 (u32 x)
+{
+	/* log2 (x) in 16.16 fixed point */
+	int b;
+	u32 n = fls (x) - 1;
+	u32 r = n << 16;
+	u64 y = ((u64) x << 31) >> n;	/* 1.31, [1, 2) */
+
+	for (b = 15; b >= 0; b--) {
+		y = (y * y) >> 31;
+		if (y >= (2ULL << 31)) {
+			y >>= 1;
+			r |= 1 << b;
+		}
+	}
+
+	return r;
+}
+
+static u64
+ndg_exp2_neg_q32 (u64 e)
+{
+	/* 2^(-e), e in 16.16 fixed point, returns 0.32 fixed point */
+	static const u32 t[16] = {
+		0xffff4e8e, 0xfffe9d1d, 0xfffd3a3b, 0xfffa747f,
+		0xfff4e91c, 0xffe9d2b3, 0xffd3a752, 0xffa75652,
+		0xff4ecb59, 0xfe9e115c, 0xfd3e0c0d, 0xfa83b2db,
+		0xf5257d15, 0xeac0c6e8, 0xd744fccb, 0xb504f334,
+	};	/* 2^(-2^(b - 16)) */
+	int b;
+	u64 w = 1ULL << 32;
+
+	if ((e >> 16) >= 32)
+		return 0;
+
+	for (b = 0; b < 16; b++) {
+		if (e & (1 << b))
+			w = (w * t[b]) >> 32;
+	}
+
+	return w >> (e >> 16);
+}
+
+static inline u64
+ndg_zipf_weight (u32 i, u32 s)
+{
+	/* 1 / (i + 1)^s */
+	return ndg_exp2_neg_q32 ((u64) s * ndg_log2_q16 (i + 1) / 100);
+}
+
+static int
+ndg_profile_build (struct ndg_profile *p)
+{
+	/* each table entry j has the index at which the cumulative
+	 * weight crosses the middle of the j-th 1/tsize interval. */
+	u32 i, j;
+	u64 w, total = 0, step, target, cum;
+
+	vfree (p->table);
+	p->table = NULL;
+
+	if (p->dist != NDG_DIST_ZIPF || p->count <= 1)
+		return 0;
+
+	for (i = 0; i < p->count; i++)
+		total += ndg_zipf_weight (i, p->s);
+
+	p->tsize = sched_size;
+	p->table = vmalloc (sizeof (u32) * p->tsize);
+	if (!p->table)
+		return -ENOMEM;
+
+	step = div64_u64 (total, p->tsize);
+	target = step / 2;
+	i = 0;
+	w = ndg_zipf_weight (0, p->s);
+	cum = w;
+	for (j = 0; j < p->tsize; j++) {
+		while (cum <= target && i < p->count - 1) {
+			w = ndg_zipf_weight (++i, p->s);
+			cum += w;
+		}
+		p->table[j] = i;
+		target += step;
+	}
+
+	return 0;
+}
+
+static inline u32
+ndg_profile_next (struct ndg_profile *p)
+{
+	if (p->count <= 1)
+		return 0;
+
+	if (p->table)
+		return p->table[prandom_u32_max (p->tsize)];
+
+	return prandom_u32_max (p->count);
+}
+
+static void
+netdevgen_set_flow (struct sk_buff *skb, u32 flow)
+{
+	/* 64512 udp ports from 1024 for each src ip. source port is
+	 * at the same offset in udp and tcp headers. */
+	struct iphdr *ip = ip_hdr (skb);
+	__be32 saddr = htonl (ntohl (srcip) + flow / 64512);
+	__be16 sport = htons (1024 + flow % 64512);
+	__sum16 *check = NULL;
+
+	/* replayed and direct frames do not go through ip_local_out */
+	csum_replace4 (&ip->check, ip->saddr, saddr);
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		/* l4 checksum field has the pseudo header sum */
+		inet_proto_csum_replace4 ((__sum16 *) (skb->head +
+						       skb->csum_start +
+						       skb->csum_offset),
+					  skb, ip->saddr, saddr, 1);
+	} else {
+		if (ip->protocol == IPPROTO_TCP)
+			check = &tcp_hdr (skb)->check;
+		else if (udp_hdr (skb)->check)
+			check = &udp_hdr (skb)->check;
+		if (check) {
+			inet_proto_csum_replace4 (check, skb, ip->saddr,
+						  saddr, 1);
+			inet_proto_csum_replace2 (check, skb,
+						  udp_hdr (skb)->source,
+						  sport, 0);
+			if (ip->protocol == IPPROTO_UDP && !*check)
+				*check = CSUM_MANGLED_0;
+		}
+	}
+
+	ip->saddr = saddr;
+	udp_hdr (skb)->source = sport;
+}
+
+static inline bool
+netdevgen_has_flow (struct sk_buff *skb)
+{
+	/* ipv4 udp or tcp with the whole l4 header, for pcap frames */
+	struct iphdr *ip = ip_hdr (skb);
+
+	if (skb->protocol != htons (ETH_P_IP) ||
+	    !skb_transport_header_was_set (skb) ||
+	    (ip->frag_off & htons (IP_OFFSET)))
+		return false;
+
+	switch (ip->protocol) {
+	case IPPROTO_UDP :
+		return skb_transport_offset (skb) +
+			sizeof (struct udphdr) <= skb_headlen (skb);
+	case IPPROTO_TCP :
+		return skb_transport_offset (skb) +
+			sizeof (struct tcphdr) <= skb_headlen (skb);
+	}
+
+	return false;
+}
+
+static inline unsigned int
+netdevgen_l4_hlen (struct sk_buff *skb)
+{
+	return ip_hdr (skb)->protocol == IPPROTO_TCP ?
+		sizeof (struct tcphdr) : sizeof (struct udphdr);
+}
+
+static void
+netdevgen_set_gso (struct sk_buff *skb)
+{
+	/* checksum offload with the pseudo header sum in the l4 header,
+	 * and gso if the payload is longer than mss. */
+	int type, mss;
+	unsigned int l4len, hlen;
+	__sum16 *check;
+	struct iphdr *ip = ip_hdr (skb);
+
+	l4len = ntohs (ip->tot_len) - ip_hdrlen (skb);
+
+	if (ip->protocol == IPPROTO_TCP) {
+		type = SKB_GSO_TCPV4;
+		mss = gso_mss ? : NDG_GSO_TCP_MSS;
+		hlen = sizeof (struct tcphdr);
+		check = &tcp_hdr (skb)->check;
+		skb->csum_offset = offsetof (struct tcphdr, check);
+	} else {
+		/* ufo fragments the udp header and payload */
+		type = SKB_GSO_UDP;
+		mss = (gso_mss ? : NDG_GSO_UDP_MSS) & ~7;
+		hlen = 0;
+		check = &udp_hdr (skb)->check;
+		skb->csum_offset = offsetof (struct udphdr, check);
+	}
+
+	*check = ~csum_tcpudp_magic (ip->saddr, ip->daddr, l4len,
+				     ip->protocol, 0);
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header (skb) - skb->head;
 
-static atomic_t start;
+	if (mss > 0 && l4len - hlen > mss) {
+		skb_shinfo (skb)->gso_size = mss;
+		skb_shinfo (skb)->gso_type = type;
+		skb_shinfo (skb)->gso_segs = DIV_ROUND_UP (l4len - hlen, mss);
+	}
+}
 
 
 
 static struct sk_buff *
-netdevgen_build_packet (void)
+netdevgen_build_packet (int pktlen)
 {
-	int datalen;
 	int headroom;
 	struct sk_buff * skb;
 	struct iphdr * ip;
 	struct udphdr * udp;
+	struct tcphdr * tcp;
 	struct flowi4 fl4;
 	struct rtable * rt;
 	struct net * net = get_net_ns_by_pid (1);
@@ -98,17 +591,33 @@ netdevgen_build_packet (void)
 		return NULL;
 	}
 
-	/* alloc and build skb */
+	if (gso == NDG_GSO_TCP &&
+	    pktlen < sizeof (struct iphdr) + sizeof (struct tcphdr)) {
+		pr_err ("pktlen %d is too short for tcp\n", pktlen);
+		return NULL;
+	}
+
+	memset (&fl4, 0, sizeof (fl4));
+	fl4.saddr = srcip;
+	fl4.daddr = dstip;
+	rt = ip_route_output_key (net, &fl4);
+	if (IS_ERR (rt)) {
+		pr_err ("no route to %pI4 from %pI4\n", &dstip, &srcip);
+		return NULL;
+	}
+
+	/* alloc and build skb. a vdev acquiring a madcap device has
+	 * the outer headers in its needed_headroom, so that the encap
+	 * path does not reallocate the head. */
 
-	datalen = pktlen + 14; /* inner ethernet frame */
-	//headroom = 14 + 14 + 20 + 8 + 8 + 8; /* outer eth, ip, udp, vxlan, nsh */
-	//headroom = 128;
-	//headroom = 64;
-	
-	skb = alloc_skb_fclone (datalen, GFP_KERNEL);
-	//prefetchw (skb->data);
+	headroom = LL_RESERVED_SPACE (rt->dst.dev);
 
-	//skb_reserve (skb, headroom);
+	skb = alloc_skb_fclone (headroom + pktlen, GFP_KERNEL);
+	if (!skb) {
+		ip_rt_put (rt);
+		return NULL;
+	}
+	skb_reserve (skb, headroom);
 
 	pr_info ("headroom size is %d", skb_headroom (skb));
 
@@ -131,15 +640,34 @@ netdevgen_build_packet (void)
 	pr_info ("dst %pI4 src %pI4", &dstip, &srcip);
 
 	skb_set_transport_header (skb, skb->len);
-	udp = (struct udphdr *) skb_put (skb, sizeof (*udp));
-	udp->check	= 0;
-	udp->source	= htons (6550);
-	udp->dest	= htons (6550);
-	udp->len	= htons (pktlen - sizeof (*ip));
+	if (gso == NDG_GSO_TCP) {
+		ip->protocol	= IPPROTO_TCP;
+		ip->frag_off	= htons (IP_DF);
+
+		tcp = (struct tcphdr *) skb_put (skb, sizeof (*tcp));
+		memset (tcp, 0, sizeof (*tcp));
+		tcp->source	= htons (6550);
+		tcp->dest	= htons (6550);
+		tcp->seq	= htonl (1);
+		tcp->ack_seq	= htonl (1);
+		tcp->doff	= sizeof (*tcp) / 4;
+		tcp->ack	= 1;
+		tcp->psh	= 1;
+		tcp->window	= htons (65535);
+	} else {
+		udp = (struct udphdr *) skb_put (skb, sizeof (*udp));
+		udp->check	= 0;
+		udp->source	= htons (6550);
+		udp->dest	= htons (6550);
+		udp->len	= htons (pktlen - sizeof (*ip));
+	}
 
 
 	// payload
-	skb_put (skb, pktlen - (sizeof (*ip) + sizeof (*udp)));
+	skb_put (skb, pktlen - (sizeof (*ip) + netdevgen_l4_hlen (skb)));
+
+	if (gso != NDG_GSO_OFF)
+		netdevgen_set_gso (skb);
 
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION (4, 2, 0)
@@ -149,20 +677,14 @@ netdevgen_build_packet (void)
 	__ip_select_ident(ip, skb_shinfo(skb)->gso_segs ?: 1);	
 #endif
 
-	memset (&fl4, 0, sizeof (fl4));
-	fl4.saddr = srcip;
-	fl4.daddr = dstip;
-	rt = ip_route_output_key (net, &fl4);
-	if (IS_ERR (rt)) {
-		pr_err ("no route to %pI4 from %pI4\n", &dstip, &srcip);
-		return NULL;
-	}
 	skb_dst_drop (skb);
 	skb_dst_set (skb, &rt->dst);
 	skb->dev = rt->dst.dev;
 	skb->pkt_type = PACKET_HOST;
-	skb->ip_summed = CHECKSUM_NONE;
-	skb->csum = 0;
+	if (skb->ip_summed != CHECKSUM_PARTIAL) {
+		skb->ip_summed = CHECKSUM_NONE;
+		skb->csum = 0;
+	}
 	skb->protocol = htons (ETH_P_IP);
 
 
@@ -185,7 +707,7 @@ netdevgen_xmit_one (void)
 {
 	struct sk_buff * skb;
 
-	skb = netdevgen_build_packet ();
+	skb = netdevgen_build_packet (pktlen);
 	if (!skb) {
 		pr_err ("skb build failed\n");
 		return;
@@ -194,6 +716,7 @@ netdevgen_xmit_one (void)
 #ifdef OVBENCH
 	skb->first_xmit = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_GEN_XMIT);
 
 	ip_local_out (skb);
 }
@@ -207,180 +730,1587 @@ netdevgen_xmit_one_thread (void * arg)
 }
 
 static int
-netdevgen_thread (void * arg)
+netdevgen_direct_prepare (struct sk_buff *skb, int index)
 {
-	struct sk_buff * skb, * pskb;
+	/* turn a template into a frame for ndo_start_xmit: ethernet
+	 * header for L2 devices (vxlan, gretap, nsh), and ip packet
+	 * as is for L3 devices (ipip, gre). */
+	int rc;
+	char ha[MAX_ADDR_LEN];
+	const void *daddr;
+	struct neighbour *n;
+	struct net_device *dev = skb->dev;
+
+	skb_set_queue_mapping (skb, index % dev->real_num_tx_queues);
+	skb_reset_mac_header (skb);
+
+	/* no ip_local_out, so the checksum is done here */
+	ip_send_check (ip_hdr (skb));
+
+	if (dev->type != ARPHRD_ETHER)
+		return 0;
+
+	if (skb_cow_head (skb, LL_RESERVED_SPACE (dev)))
+		return -ENOMEM;
+
+	daddr = dev->broadcast;
+	n = dst_neigh_lookup (skb_dst (skb), &ip_hdr (skb)->daddr);
+	if (n) {
+		if (n->nud_state & NUD_VALID) {
+			neigh_ha_snapshot (ha, n, dev);
+			daddr = ha;
+		}
+		neigh_release (n);
+	}
 
-	ndg_thread_running = true;
+	rc = dev_hard_header (skb, dev, ETH_P_IP, daddr, NULL, skb->len);
+	if (rc < 0)
+		return rc;
 
-	skb = netdevgen_build_packet ();
-	if (!skb) {
-		pr_err ("skb build failed\n");
-		goto err_out;
-	}
+	skb_reset_mac_header (skb);
 
-	while (!kthread_should_stop ()) {
+	return 0;
+}
 
-		pskb = skb_clone (skb, GFP_KERNEL);
-		if (!pskb) {
-			pr_err ("failed to clone skb\n");
-			continue;
-		}
+static int
+netdevgen_rx_encap (struct sk_buff *skb, struct net_device *rxdev, int index)
+{
+	/* turn a template into a frame received by rxdev, encapsulated
+	 * for ndg_proto. network and transport headers stay at the
+	 * inner packet, so that flows and stamps work as in tx. */
+	int l2, ipproto = 0;
+	__be32 *hdr;
+	struct ethhdr *eth;
+	struct iphdr *ip;
+	struct udphdr *udp;
+	struct net_device *tundev = skb->dev;
+
+	l2 = (ndg_proto == NDG_PROTO_GRETAP || ndg_proto == NDG_PROTO_VXLAN ||
+	      ndg_proto == NDG_PROTO_NSH);
+
+	skb_dst_drop (skb);
+	if (skb_cow_head (skb, LL_RESERVED_SPACE (rxdev) + NDG_RX_HLEN_MAX))
+		return -ENOMEM;
+
+	/* no ip_local_out, so the inner checksum is done here */
+	ip_send_check (ip_hdr (skb));
+
+	if (l2) {
+		/* inner ethernet to the tunnel device */
+		eth = (struct ethhdr *) __skb_push (skb, ETH_HLEN);
+		ether_addr_copy (eth->h_dest, tundev->dev_addr);
+		ether_addr_copy (eth->h_source, tundev->dev_addr);
+		eth->h_proto = htons (ETH_P_IP);
+	}
 
-		ip_local_out (pskb);
+	switch (ndg_proto) {
+	case NDG_PROTO_IPIP :
+		ipproto = IPPROTO_IPIP;
+		break;
+	case NDG_PROTO_GRE :
+	case NDG_PROTO_GRETAP :
+		/* no flags, no key */
+		hdr = (__be32 *) __skb_push (skb, 4);
+		hdr[0] = htonl (l2 ? ETH_P_TEB : ETH_P_IP);
+		ipproto = IPPROTO_GRE;
+		break;
+	case NDG_PROTO_NSH :
+		hdr = (__be32 *) __skb_push (skb, 8);
+		hdr[0] = htonl (NDG_NSH_BASE);
+		hdr[1] = htonl (NDG_NSH_SPISI);
+		/* fall through, in vxlan-gpe */
+	case NDG_PROTO_VXLAN :
+		hdr = (__be32 *) __skb_push (skb, 8);
+		hdr[0] = htonl (ndg_proto == NDG_PROTO_NSH ?
+				NDG_VXLAN_GPE_NSH : NDG_VXLAN_FLAGS);
+		hdr[1] = 0;	/* vni 0 */
+
+		udp = (struct udphdr *) __skb_push (skb, sizeof (*udp));
+		udp->source	= htons (NDG_VXLAN_PORT + index);
+		udp->dest	= htons (ndg_proto == NDG_PROTO_NSH ?
+					 NDG_VXLAN_GPE_PORT : NDG_VXLAN_PORT);
+		udp->len	= htons (skb->len);
+		udp->check	= 0;
+		ipproto = IPPROTO_UDP;
+		break;
 	}
 
-err_out:
-	kfree_skb (skb);
-	ndg_thread_running = false;
+	if (ipproto) {
+		ip = (struct iphdr *) __skb_push (skb, sizeof (*ip));
+		ip->ihl		= 5;
+		ip->version	= 4;
+		ip->tos		= 0;
+		ip->tot_len	= htons (skb->len);
+		ip->id		= 0;
+		ip->frag_off	= 0;
+		ip->ttl		= 64;
+		ip->protocol	= ipproto;
+		ip->saddr	= dstip_noencap;
+		ip->daddr	= srcip_noencap;
+		ip_send_check (ip);
+	}
+
+	eth = (struct ethhdr *) __skb_push (skb, ETH_HLEN);
+	ether_addr_copy (eth->h_dest, rxdev->dev_addr);
+	eth_zero_addr (eth->h_source);
+	eth->h_proto = htons (ETH_P_IP);
 
-	pr_info ("netdevgen: thread finished\n");
+	skb_reset_mac_header (skb);
+	skb->protocol = eth_type_trans (skb, rxdev);
+	skb->ip_summed = CHECKSUM_NONE;
+	skb_record_rx_queue (skb, index % rxdev->real_num_rx_queues);
 
 	return 0;
 }
 
+static inline int
+netdevgen_pick_size (struct ndg_thread *t)
+{
+	struct ndg_mix *mix = &t->mix;
+
+	if (mix->sweep)
+		return t->cur;
+
+	if (mix->nsched <= 1)
+		return 0;
+
+	return mix->sched[prandom_u32_max (mix->nsched)];
+}
+
+static bool
+netdevgen_pool_reset (struct sk_buff *skb, struct sk_buff *tmpl, bool full)
+{
+	/* put an skb sent before back to the state of the template.
+	 * skbs still referred by others, or whose head was reallocated
+	 * to a smaller one on the way, are not recycled. */
+	unsigned int hlen;
+
+	if (skb_shared (skb) || skb_cloned (skb) || skb_is_nonlinear (skb) ||
+	    skb_end_offset (skb) < skb_headroom (tmpl) + skb_headlen (tmpl))
+		return false;
+
+	skb_orphan (skb);
+	skb_dst_drop (skb);
+	nf_reset (skb);
+
+	/* header offsets are from head, so the same as the template */
+	skb->data = skb->head + skb_headroom (tmpl);
+	skb->len = tmpl->len;
+	skb_set_tail_pointer (skb, tmpl->len);
+	skb->mac_header = tmpl->mac_header;
+	skb->network_header = tmpl->network_header;
+	skb->transport_header = tmpl->transport_header;
+
+	/* encapsulation does not touch the payload of templates, but
+	 * pcap frames differ from each other. */
+	if (full)
+		hlen = tmpl->len;
+	else
+		hlen = skb_transport_offset (tmpl) + netdevgen_l4_hlen (tmpl);
+	memcpy (skb->data, tmpl->data, hlen);
+
+	/* a stamp of the last use must not be seen again */
+	if (!full && ACCESS_ONCE (stamp) &&
+	    tmpl->len >= hlen + sizeof (struct raven_stamp))
+		memcpy (skb_tail_pointer (skb) - sizeof (struct raven_stamp),
+			skb_tail_pointer (tmpl) - sizeof (struct raven_stamp),
+			sizeof (struct raven_stamp));
+
+	skb_dst_set (skb, dst_clone (skb_dst (tmpl)));
+	skb->dev = tmpl->dev;
+	skb->protocol = tmpl->protocol;
+	skb->pkt_type = tmpl->pkt_type;
+	skb->ip_summed = tmpl->ip_summed;
+	skb->csum = tmpl->csum;
+	skb->priority = tmpl->priority;
+	skb->mark = 0;
+	skb->encapsulation = 0;
+	skb->vlan_tci = 0;
+	skb_set_queue_mapping (skb, skb_get_queue_mapping (tmpl));
+	skb_clear_hash (skb);
+	memset (skb->cb, 0, sizeof (skb->cb));
+	skb_shinfo (skb)->gso_size = skb_shinfo (tmpl)->gso_size;
+	skb_shinfo (skb)->gso_segs = skb_shinfo (tmpl)->gso_segs;
+	skb_shinfo (skb)->gso_type = skb_shinfo (tmpl)->gso_type;
+#ifdef OVBENCH
+	skb->ovbench_type = tmpl->ovbench_type;
+	skb->ovbench_encaped = 0;
+#endif
+
+	return true;
+}
+
+static struct sk_buff *
+netdevgen_pool_get (struct ndg_thread *t, struct sk_buff *tmpl)
+{
+	/* the pool keeps a reference to each skb, and an skb comes
+	 * back when the device dropped the other one. only for
+	 * IFF_TX_SKB_SHARING devices through netdevgen_xmit_direct. */
+	struct sk_buff ** ent = &t->pool[t->pool_next];
+
+	t->pool_next = (t->pool_next + 1) % pool_size;
+
+	if (*ent && !netdevgen_pool_reset (*ent, tmpl, t->pcap_n != 0)) {
+		u64_stats_update_begin (&t->syncp);
+		t->pool_misses++;
+		u64_stats_update_end (&t->syncp);
+		kfree_skb (*ent);
+		*ent = NULL;
+	}
+
+	if (!*ent) {
+		/* tailroom for the largest size, to be recycled for
+		 * any size */
+		*ent = skb_copy_expand (tmpl, skb_headroom (tmpl),
+					t->pool_len - skb_headroom (tmpl) -
+					skb_headlen (tmpl), GFP_KERNEL);
+		if (!*ent)
+			return NULL;
+	}
+
+	return skb_get (*ent);
+}
+
+static inline bool
+netdevgen_stamp_sample (struct ndg_thread *t)
+{
+	int n = ACCESS_ONCE (stamp);
+
+	if (!n || t->pcap_n)
+		return false;
+
+	if (++t->stamp_cnt < n)
+		return false;
+
+	t->stamp_cnt = 0;
+	return true;
+}
 
 static void
-start_netdevgen_thread (void)
+netdevgen_stamp (struct ndg_thread *t, struct sk_buff *skb)
 {
-	unsigned int cpu = 0x00000002;	/* Only running on CPU 1 */
+	/* written just before xmit. the payload must have room, so
+	 * that the stamp does not overwrite the l4 header. */
+	struct raven_stamp st;
 
-	if (ndg_tsk && ndg_thread_running) {
-		pr_info ("netdecgen: thread already running\n");
+	if (skb_transport_offset (skb) + netdevgen_l4_hlen (skb) +
+	    sizeof (st) > skb->len)
 		return;
+
+	st.magic = htons (RAVEN_STAMP_MAGIC);
+	st.thread = t - ndg_threads;
+	st.seq = t->stamp_seq++;
+	st.tsc = get_cycles ();
+
+	skb_store_bits (skb, skb->len - sizeof (st), &st, sizeof (st));
+}
+
+static struct sk_buff *
+netdevgen_next_skb (struct ndg_thread *t, int *idx, bool *stamped)
+{
+	struct sk_buff * pskb, * skb;
+
+	*stamped = netdevgen_stamp_sample (t);
+
+	if (t->pcap_n) {
+		*idx = 0;
+		skb = t->pcap[t->pcap_next];
+		if (++t->pcap_next == t->pcap_n)
+			t->pcap_next = 0;
+	} else {
+		*idx = netdevgen_pick_size (t);
+		skb = t->skbs[*idx];
+	}
+
+	switch (skbmode) {
+	case NDG_SKB_POOL :
+		if (t->pool) {
+			pskb = netdevgen_pool_get (t, skb);
+			break;
+		}
+		/* fall through */
+	case NDG_SKB_ALLOC :
+		pskb = skb_copy (skb, GFP_KERNEL);
+		break;
+	default :
+		/* headers are rewritten for flows and payload for
+		 * stamps, so clone does not work */
+		if (ndg_flows.count > 1 || *stamped)
+			pskb = skb_copy (skb, GFP_KERNEL);
+		else
+			pskb = skb_clone (skb, GFP_KERNEL);
+	}
+	if (!pskb) {
+		pr_err ("failed to clone skb\n");
+		return NULL;
 	}
-	
-	ndg_tsk = kthread_run_on_cpu (netdevgen_thread, NULL, cpu,
-				      "netdevgen");
 
-	pr_info ("netdevgen: thread start\n");
+	if (ndg_flows.count > 1 && netdevgen_has_flow (pskb))
+		netdevgen_set_flow (pskb, ndg_profile_next (&ndg_flows));
+
+	/* cb is of the ip layer in rx. a pinned skb is marked only
+	 * when a protocol driver in madcap mode queues it. */
+	if (ndg_locators.count && !ndg_rxdev)
+		madcap_skb_pin_id (pskb, ndg_locator_base +
+				   ndg_profile_next (&ndg_locators), 0);
+
+	return pskb;
+}
+
+static inline void
+netdevgen_count (struct ndg_thread *t, int idx, unsigned int len,
+		 bool accepted)
+{
+	struct ndg_stats *s = &t->size[idx];
+
+	u64_stats_update_begin (&t->syncp);
+	t->packets++;
+	t->bytes += len;
+	s->packets++;
+	s->bytes += len;
+	if (accepted) {
+		t->accepted++;
+		s->accepted++;
+	} else {
+		t->dropped++;
+		s->dropped++;
+	}
+	u64_stats_update_end (&t->syncp);
 }
 
 static void
-stop_netdevgen_thread (void)
+netdevgen_xmit_stack (struct ndg_thread *t)
 {
-	if (ndg_tsk && ndg_thread_running)
-		kthread_stop (ndg_tsk);
+	int rc, idx;
+	bool stamped;
+	unsigned int len;
+	struct sk_buff * pskb;
 
-	pr_info ("netdevgen: thread stop\n");
+	pskb = netdevgen_next_skb (t, &idx, &stamped);
+	if (!pskb)
+		return;
+
+	len = pskb->len;
+	if (stamped)
+		netdevgen_stamp (t, pskb);
+	trace_madcap_stage (pskb, MADCAP_STAGE_GEN_XMIT);
+	if (t->pcap_n)
+		rc = dev_queue_xmit (pskb);
+	else
+		rc = ip_local_out (pskb);
+
+	netdevgen_count (t, idx, len, net_xmit_eval (rc) == 0);
 }
 
 static void
-start_netdevgen_xmit_one_thread (void)
+netdevgen_xmit_direct (struct ndg_thread *t, int nburst)
 {
-	ndg_one_tsk = kthread_run (netdevgen_xmit_one_thread,
-				   NULL, "netdevgen");
+	/* skbs are allocated before taking the tx lock, and the burst
+	 * is sent with xmit_more except the last one, like pktgen. */
+	int n, sent, rc;
+	unsigned int len;
+	int idx[NDG_BURST_MAX];
+	bool stamped[NDG_BURST_MAX];
+	struct sk_buff * skbs[NDG_BURST_MAX];
+	struct net_device * dev = t->skbs[0]->dev;
+	struct netdev_queue * txq = skb_get_tx_queue (dev, t->skbs[0]);
+
+	for (n = 0; n < nburst; n++) {
+		skbs[n] = netdevgen_next_skb (t, &idx[n], &stamped[n]);
+		if (!skbs[n])
+			break;
+	}
+	nburst = n;
+
+	local_bh_disable ();
+	HARD_TX_LOCK (dev, txq, smp_processor_id ());
+
+	for (sent = 0; sent < nburst; sent++) {
+		if (unlikely (netif_xmit_frozen_or_drv_stopped (txq)))
+			break;
+
+		len = skbs[sent]->len;
+		if (stamped[sent])
+			netdevgen_stamp (t, skbs[sent]);
+		trace_madcap_stage (skbs[sent], MADCAP_STAGE_GEN_XMIT);
+		rc = netdev_start_xmit (skbs[sent], dev, txq,
+					sent < nburst - 1);
+		if (unlikely (rc == NETDEV_TX_BUSY))
+			break;
+
+		netdevgen_count (t, idx[sent], len, rc == NETDEV_TX_OK);
+	}
+
+	HARD_TX_UNLOCK (dev, txq);
+	local_bh_enable ();
+
+	/* rest of the burst is not consumed by the device */
+	for (n = sent; n < nburst; n++) {
+		netdevgen_count (t, idx[n], skbs[n]->len, false);
+		kfree_skb (skbs[n]);
+	}
 }
 
 static void
-start_stop (void)
+netdevgen_recv (struct ndg_thread *t, int nburst)
 {
-	if (atomic_read (&start)) {
-		pr_info ("netdevgen: start -> stop\n");
-		stop_netdevgen_thread ();
-	} else {
-		pr_info ("netdevgen: stop -> start\n");
-		start_netdevgen_thread ();
+	/* skbs are allocated before disabling bh, and injected in a
+	 * row, as a NIC driver does in its napi poll. */
+	int n, rc;
+	unsigned int len;
+	int idx[NDG_BURST_MAX];
+	bool stamped[NDG_BURST_MAX];
+	struct sk_buff * skbs[NDG_BURST_MAX];
+
+	for (n = 0; n < nburst; n++) {
+		skbs[n] = netdevgen_next_skb (t, &idx[n], &stamped[n]);
+		if (!skbs[n])
+			break;
 	}
+	nburst = n;
+
+	local_bh_disable ();
+	for (n = 0; n < nburst; n++) {
+		len = skbs[n]->len;
+		if (stamped[n])
+			netdevgen_stamp (t, skbs[n]);
+		trace_madcap_stage (skbs[n], MADCAP_STAGE_GEN_RECV);
+		rc = netif_receive_skb (skbs[n]);
+		netdevgen_count (t, idx[n], len, rc == NET_RX_SUCCESS);
+	}
+	local_bh_enable ();
 }
 
-static ssize_t
-proc_read(struct file *fp, char *buf, size_t size, loff_t *off)
+static rx_handler_result_t
+netdevgen_sink_handler (struct sk_buff **pskb)
 {
-	pr_info ("proc read\n");
+	/* decapsulated packets end here */
+	struct sk_buff *skb = *pskb;
+	struct ndg_sink_stats *stats = this_cpu_ptr (ndg_sink_stats);
 
-	//copy_to_user (buf, "stop!\n", size);
-	start_stop ();
-	return size;
+	trace_madcap_stage (skb, MADCAP_STAGE_SINK_RECV);
+
+	u64_stats_update_begin (&stats->syncp);
+	stats->packets++;
+	stats->bytes += skb->len;
+	u64_stats_update_end (&stats->syncp);
+
+	consume_skb (skb);
+
+	return RX_HANDLER_CONSUMED;
 }
 
-static ssize_t
-proc_write(struct file *fp, const char *buf, size_t size, loff_t *off)
+static int
+netdevgen_sink_start (struct net_device *dev)
 {
-	if (strncmp (buf, "xmit", 4) == 0) {
+	int rc, cpu;
+	struct ndg_sink_stats *stats;
 
-		start_netdevgen_xmit_one_thread ();
+	if (!ndg_sink_stats) {
+		ndg_sink_stats = alloc_percpu (struct ndg_sink_stats);
+		if (!ndg_sink_stats)
+			return -ENOMEM;
+	}
 
-	} else if (strncmp (buf, "vxlan", 5) == 0) {
+	for_each_possible_cpu (cpu) {
+		stats = per_cpu_ptr (ndg_sink_stats, cpu);
+		stats->packets = 0;
+		stats->bytes = 0;
+		u64_stats_init (&stats->syncp);
+	}
 
-		srcip = srcip_vxlan;
-		dstip = dstip_vxlan;
-#ifdef OVBENCH
-		ovtype = OVTYPE_VXLAN;
-#endif
-		if (!measure_pps)
-			start_netdevgen_xmit_one_thread ();
-		else
-			start_netdevgen_thread ();
-		
-	} else if (strncmp (buf, "gretap", 6) == 0) {
+	rtnl_lock ();
+	rc = netdev_rx_handler_register (dev, netdevgen_sink_handler, NULL);
+	rtnl_unlock ();
+	if (rc < 0) {
+		pr_err ("failed to register rx sink on %s\n", dev->name);
+		return rc;
+	}
 
-		srcip = srcip_gretap;
-		dstip = dstip_gretap;
-#ifdef OVBENCH
-		ovtype = OVTYPE_GRETAP;
-#endif
-		if (!measure_pps)
-			start_netdevgen_xmit_one_thread ();
-		else
-			start_netdevgen_thread ();
-		
-	} else if (strncmp (buf, "gre", 3) == 0) {
+	dev_hold (dev);
+	ndg_sinkdev = dev;
+	strlcpy (ndg_sinkname, dev->name, IFNAMSIZ);
 
-		srcip = srcip_gre;
-		dstip = dstip_gre;
-#ifdef OVBENCH
-		ovtype = OVTYPE_GRE;
+	return 0;
+}
+
+static void
+netdevgen_sink_stop (void)
+{
+	if (!ndg_sinkdev)
+		return;
+
+	rtnl_lock ();
+	netdev_rx_handler_unregister (ndg_sinkdev);
+	rtnl_unlock ();
+
+	dev_put (ndg_sinkdev);
+	ndg_sinkdev = NULL;
+}
+
+static int
+netdevgen_thread (void * arg)
+{
+	struct ndg_thread * t = arg;
+	int nburst = burst;
+
+	t->start = ktime_get ();
+	t->startj = jiffies;
+
+	/* raven sees a new run by a jump of the sequence */
+	t->stamp_seq = prandom_u32 ();
+
+	while (!kthread_should_stop ()) {
+
+		if (t->deadline && time_after_eq (jiffies, t->deadline))
+			break;
+
+		if (t->mix.sweep) {
+			t->cur = (jiffies - t->startj) / (t->mix.step * HZ);
+			if (t->cur >= t->mix.nsizes)
+				break;
+		}
+
+		if (ndg_rxdev)
+			netdevgen_recv (t, nburst ? : 1);
+		else if (nburst)
+			netdevgen_xmit_direct (t, nburst);
+		else
+			netdevgen_xmit_stack (t);
+	}
+
+	t->end = ktime_get ();
+	pr_info ("netdevgen: thread on cpu %u finished\n", t->cpu);
+
+	/* timed run finished. wait for kthread_stop () */
+	set_current_state (TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop ()) {
+		schedule ();
+		set_current_state (TASK_INTERRUPTIBLE);
+	}
+	__set_current_state (TASK_RUNNING);
+
+	return 0;
+}
+
+
+static void
+netdevgen_thread_free (struct ndg_thread *t)
+{
+	int n;
+
+	for (n = 0; n < NDG_SIZES_MAX; n++) {
+		kfree_skb (t->skbs[n]);
+		t->skbs[n] = NULL;
+	}
+
+	if (t->pool) {
+		for (n = 0; n < pool_size; n++)
+			kfree_skb (t->pool[n]);
+		kfree (t->pool);
+		t->pool = NULL;
+	}
+
+	if (t->pcap) {
+		for (n = 0; n < t->pcap_n; n++)
+			kfree_skb (t->pcap[n]);
+		vfree (t->pcap);
+		t->pcap = NULL;
+		t->pcap_n = 0;
+	}
+}
+
+static struct sk_buff *
+netdevgen_pcap_skb (struct ndg_pcap *pcap, struct ndg_pcap_rec *rec,
+		    struct net_device *dev, int index)
+{
+	/* build a frame for dev from a pcap record. NULL if the frame
+	 * can not be sent to dev. */
+	int l2;
+	u8 *data = pcap->data + rec->off;
+	unsigned int len = rec->len, nhoff;
+	struct sk_buff *skb;
+	struct iphdr *ip;
+
+	l2 = (pcap->linktype == NDG_LINKTYPE_ETHERNET);
+	if (l2 && len < ETH_HLEN)
+		return NULL;
+
+	if (dev->type != ARPHRD_ETHER && l2) {
+		/* L3 devices take ipv4 packets */
+		if (((struct ethhdr *) data)->h_proto != htons (ETH_P_IP))
+			return NULL;
+		data += ETH_HLEN;
+		len -= ETH_HLEN;
+		l2 = 0;
+	}
+
+	if (!l2 && (len < sizeof (*ip) || (data[0] >> 4) != 4))
+		return NULL;
+
+	skb = alloc_skb (LL_RESERVED_SPACE (dev) + len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+	skb_reserve (skb, LL_RESERVED_SPACE (dev));
+	memcpy (skb_put (skb, len), data, len);
+
+	skb->dev = dev;
+	skb->pkt_type = PACKET_HOST;
+	skb->ip_summed = CHECKSUM_NONE;
+	skb_set_queue_mapping (skb, index % dev->real_num_tx_queues);
+
+	if (l2) {
+		skb->protocol = ((struct ethhdr *) skb->data)->h_proto;
+		nhoff = ETH_HLEN;
+	} else if (dev->type == ARPHRD_ETHER) {
+		/* raw ip capture to an L2 device */
+		if (dev_hard_header (skb, dev, ETH_P_IP, dev->broadcast,
+				     NULL, skb->len) < 0) {
+			kfree_skb (skb);
+			return NULL;
+		}
+		skb->protocol = htons (ETH_P_IP);
+		nhoff = ETH_HLEN;
+	} else {
+		skb->protocol = htons (ETH_P_IP);
+		nhoff = 0;
+	}
+
+	skb_reset_mac_header (skb);
+	skb_set_network_header (skb, nhoff);
+
+	if (skb->protocol == htons (ETH_P_IP) &&
+	    skb->len >= nhoff + sizeof (*ip)) {
+		ip = ip_hdr (skb);
+		if (ip->ihl >= 5 && skb->len >= nhoff + ip->ihl * 4)
+			skb_set_transport_header (skb, nhoff + ip->ihl * 4);
+	}
+
+	return skb;
+}
+
+static int
+netdevgen_thread_build_pcap (struct ndg_thread *t, int index)
+{
+	/* pcap frames to the device of the first template, or to the
+	 * rx path of ndg_rxdev */
+	u32 n;
+	struct sk_buff * skb;
+	struct net_device * dev = ndg_rxdev ? : t->skbs[0]->dev;
+
+	t->pcap = vzalloc (sizeof (struct sk_buff *) * ndg_pcap->nrecs);
+	if (!t->pcap)
+		return -ENOMEM;
+
+	for (n = 0; n < ndg_pcap->nrecs; n++) {
+		skb = netdevgen_pcap_skb (ndg_pcap, &ndg_pcap->recs[n],
+					  dev, index);
+		if (!skb)
+			continue;
+		if (ndg_rxdev) {
+			/* received by dev, whatever the captured dst is */
+			ether_addr_copy (eth_hdr (skb)->h_dest, dev->dev_addr);
+			skb->protocol = eth_type_trans (skb, dev);
+			skb_record_rx_queue (skb, index %
+					     dev->real_num_rx_queues);
+		}
+		t->pcap[t->pcap_n++] = skb;
+		t->replay = true;
+		t->pool_len = max (t->pool_len, skb_headroom (skb) + skb_headlen (skb));
+	}
+
+	if (!t->pcap_n) {
+		pr_err ("no frames in pcap can be sent to %s\n", dev->name);
+		return -EINVAL;
+	}
+
+	if (t->pcap_n < ndg_pcap->nrecs)
+		pr_info ("%u of %u frames in pcap are skipped for %s\n",
+			 ndg_pcap->nrecs - t->pcap_n, ndg_pcap->nrecs,
+			 dev->name);
+
+	return 0;
+}
+
+static int
+netdevgen_thread_build (struct ndg_thread *t, int index)
+{
+	/* templates for each size of the mix of the thread */
+	int n;
+	struct sk_buff * skb;
+
+	if (ndg_rxdev && gso != NDG_GSO_OFF) {
+		pr_err ("gso is not supported with rx\n");
+		return -EINVAL;
+	}
+
+	for (n = 0; n < t->mix.nsizes; n++) {
+		skb = netdevgen_build_packet (t->mix.len[n]);
+		if (!skb) {
+			pr_err ("skb build failed\n");
+			goto err;
+		}
+		t->skbs[n] = skb;
+
+		/* different flow for each thread, to spread packets
+		 * over tx queues */
+		udp_hdr (skb)->source = htons (6550 + index);
+
+		if (ndg_rxdev) {
+			/* the sink is on the device routed to */
+			if (index == 0 && n == 0 &&
+			    netdevgen_sink_start (skb->dev) < 0)
+				goto err;
+			if (netdevgen_rx_encap (skb, ndg_rxdev, index) < 0) {
+				pr_err ("failed to encap frame for %s\n",
+					ndg_rxdev->name);
+				goto err;
+			}
+		} else if (burst && netdevgen_direct_prepare (skb, index) < 0) {
+			pr_err ("failed to prepare frame for %s\n",
+				skb->dev->name);
+			goto err;
+		}
+		t->pool_len = max (t->pool_len, skb_headroom (skb) + skb_headlen (skb));
+	}
+
+	/* recycled skbs are passed with an extra reference, so that
+	 * only the direct path to a device accepting shared skbs can
+	 * use them, as pktgen does. the stack gets new ones. */
+	if (skbmode == NDG_SKB_POOL) {
+		if (!ndg_rxdev && burst &&
+		    (t->skbs[0]->dev->priv_flags & IFF_TX_SKB_SHARING)) {
+			t->pool = kcalloc (pool_size,
+					   sizeof (struct sk_buff *),
+					   GFP_KERNEL);
+			if (!t->pool)
+				goto err;
+		} else if (index == 0)
+			pr_info ("skbmode pool needs burst and a device "
+				 "with shared skbs, alloc is used\n");
+	}
+
+	if (ndg_pcap && netdevgen_thread_build_pcap (t, index) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	netdevgen_thread_free (t);
+	return -ENOMEM;
+}
+
+static void
+stop_netdevgen_thread (void)
+{
+	int n;
+	struct ndg_thread * t;
+
+	mutex_lock (&ndg_mutex);
+
+	for (n = 0; n < ndg_nthreads; n++) {
+		t = &ndg_threads[n];
+		kthread_stop (t->tsk);
+		netdevgen_thread_free (t);
+		t->tsk = NULL;
+	}
+	ndg_nthreads = 0;
+
+	netdevgen_sink_stop ();
+
+	mutex_unlock (&ndg_mutex);
+
+	pr_info ("netdevgen: thread stop\n");
+}
+
+static void
+start_netdevgen_thread (unsigned int duration)
+{
+	unsigned int cpu;
+	struct ndg_thread * t;
+
+	mutex_lock (&ndg_mutex);
+
+	if (ndg_nthreads) {
+		pr_info ("netdecgen: thread already running\n");
+		goto out;
+	}
+
+	for_each_cpu_and (cpu, ndg_cpumask, cpu_online_mask) {
+		t = &ndg_threads[ndg_nthreads];
+		memset (t, 0, sizeof (*t));
+		u64_stats_init (&t->syncp);
+		t->cpu = cpu;
+		t->last = ktime_get ();
+		if (duration)
+			t->deadline = jiffies + duration * HZ;
+		t->mix = ndg_cpu_mix[cpu] ? *ndg_cpu_mix[cpu] : ndg_mix;
+
+		/* each thread has its own templates */
+		if (netdevgen_thread_build (t, ndg_nthreads) < 0)
+			break;
+
+		t->tsk = kthread_run_on_cpu (netdevgen_thread, t, cpu,
+					     "netdevgen/%u", cpu);
+		if (IS_ERR (t->tsk)) {
+			pr_err ("failed to run thread on cpu %u\n", cpu);
+			netdevgen_thread_free (t);
+			break;
+		}
+
+		ndg_nthreads++;
+	}
+
+	ndg_nstats = ndg_nthreads;
+	if (!ndg_nthreads)
+		netdevgen_sink_stop ();
+	pr_info ("netdevgen: %d threads start, duration %us\n",
+		 ndg_nthreads, duration);
+
+out:
+	mutex_unlock (&ndg_mutex);
+}
+
+static unsigned int
+ndg_parse_duration (char *buf)
+{
+	/* "duration=N" in seconds, 0 means run until stop */
+	unsigned int duration;
+	char *p = strstr (buf, "duration=");
+
+	if (!p || kstrtouint (p + 9, 10, &duration))
+		return 0;
+
+	return duration;
+}
+
+static void
+start_netdevgen_xmit_one_thread (void)
+{
+	ndg_one_tsk = kthread_run (netdevgen_xmit_one_thread,
+				   NULL, "netdevgen");
+}
+
+static void
+set_netdevgen_cpus (const char *list)
+{
+	int rc;
+
+	mutex_lock (&ndg_mutex);
+
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing cpus\n");
+		goto out;
+	}
+
+	rc = cpulist_parse (list, ndg_cpumask);
+	if (rc < 0 || cpumask_empty (ndg_cpumask)) {
+		pr_err ("invalid cpu list %s\n", list);
+		cpumask_clear (ndg_cpumask);
+		cpumask_set_cpu (0, ndg_cpumask);
+		goto out;
+	}
+
+	pr_info ("netdevgen: cpus %*pbl\n", cpumask_pr_args (ndg_cpumask));
+
+out:
+	mutex_unlock (&ndg_mutex);
+}
+
+static int
+set_netdevgen_profile (struct ndg_profile *p, char *args, u64 *base)
+{
+	/* COUNT [uniform | zipf S] [base BASE] */
+	int rc = 0;
+	u32 s, frac;
+	char *arg, *dot;
+	struct ndg_profile n = { .dist = NDG_DIST_UNIFORM, .s = 100 };
+
+	arg = strsep (&args, " ");
+	if (!arg || kstrtou32 (arg, 0, &n.count))
+		return -EINVAL;
+
+	while ((arg = strsep (&args, " "))) {
+		if (!*arg)
+			continue;
+
+		if (strcmp (arg, "uniform") == 0) {
+			n.dist = NDG_DIST_UNIFORM;
+		} else if (strcmp (arg, "zipf") == 0) {
+			/* exponent as decimal, e.g. 0.99, 1.2 */
+			n.dist = NDG_DIST_ZIPF;
+			arg = strsep (&args, " ");
+			if (!arg)
+				continue;
+			dot = strchr (arg, '.');
+			if (dot)
+				*dot++ = '\0';
+			frac = 0;
+			if (kstrtou32 (arg, 10, &s) ||
+			    (dot && *dot && kstrtou32 (dot, 10, &frac)))
+				return -EINVAL;
+			if (dot && strlen (dot) == 1)
+				frac *= 10;
+			n.s = s * 100 + frac % 100;
+		} else if (strcmp (arg, "base") == 0 && base) {
+			arg = strsep (&args, " ");
+			if (!arg || kstrtou64 (arg, 0, base))
+				return -EINVAL;
+		} else
+			return -EINVAL;
+	}
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing profile\n");
+		rc = -EBUSY;
+		goto out;
+	}
+
+	p->count = n.count;
+	p->dist = n.dist;
+	p->s = n.s;
+	rc = ndg_profile_build (p);
+	if (rc < 0)
+		p->dist = NDG_DIST_UNIFORM;
+out:
+	mutex_unlock (&ndg_mutex);
+	return rc;
+}
+
+static int
+ndg_mix_parse (struct ndg_mix *mix, char *list)
+{
+	/* LEN[:WEIGHT],... */
+	int n;
+	u32 w, total = 0;
+	char *arg, *weight;
+
+	mix->nsizes = 0;
+	while ((arg = strsep (&list, ","))) {
+		if (!*arg)
+			continue;
+		if (mix->nsizes >= NDG_SIZES_MAX)
+			return -EINVAL;
+
+		n = mix->nsizes;
+		weight = strchr (arg, ':');
+		if (weight)
+			*weight++ = '\0';
+
+		mix->weight[n] = 1;
+		if (kstrtoint (arg, 0, &mix->len[n]) ||
+		    (weight && kstrtou32 (weight, 0, &mix->weight[n])))
+			return -EINVAL;
+		if (mix->len[n] < NDG_PKTLEN_MIN ||
+		    mix->len[n] > NDG_PKTLEN_MAX)
+			return -EINVAL;
+
+		total += mix->weight[n];
+		if (total > NDG_SCHED_MAX)
+			return -EINVAL;
+		mix->nsizes++;
+	}
+
+	if (!total)
+		return -EINVAL;
+
+	mix->nsched = 0;
+	for (n = 0; n < mix->nsizes; n++) {
+		for (w = 0; w < mix->weight[n]; w++)
+			mix->sched[mix->nsched++] = n;
+	}
+
+	return 0;
+}
+
+static int
+set_netdevgen_sizes (char *args)
+{
+	/* [cpu N] [sweep [step=S]] imix | LEN[:WEIGHT],...
+	 * without cpu, the mix is for all threads and per cpu mixes
+	 * are cleared. */
+	int cpu = -1, rc = 0;
+	char *arg, imix[] = NDG_IMIX;
+	struct ndg_mix *mix;
+
+	mix = kzalloc (sizeof (*mix), GFP_KERNEL);
+	if (!mix)
+		return -ENOMEM;
+	mix->step = 10;
+
+	while (rc == 0 && (arg = strsep (&args, " "))) {
+		if (!*arg)
+			continue;
+
+		if (strcmp (arg, "cpu") == 0) {
+			arg = strsep (&args, " ");
+			if (!arg || kstrtoint (arg, 0, &cpu) ||
+			    cpu < 0 || cpu >= nr_cpu_ids)
+				rc = -EINVAL;
+		} else if (strcmp (arg, "sweep") == 0) {
+			mix->sweep = 1;
+		} else if (strncmp (arg, "step=", 5) == 0) {
+			if (kstrtouint (arg + 5, 0, &mix->step) || !mix->step)
+				rc = -EINVAL;
+		} else if (strcmp (arg, "imix") == 0) {
+			rc = ndg_mix_parse (mix, imix);
+		} else
+			rc = ndg_mix_parse (mix, arg);
+	}
+
+	if (rc == 0 && !mix->nsizes)
+		rc = -EINVAL;
+	if (rc < 0) {
+		kfree (mix);
+		return rc;
+	}
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing sizes\n");
+		kfree (mix);
+		rc = -EBUSY;
+		goto out;
+	}
+
+	if (cpu < 0) {
+		ndg_mix = *mix;
+		kfree (mix);
+		for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+			kfree (ndg_cpu_mix[cpu]);
+			ndg_cpu_mix[cpu] = NULL;
+		}
+	} else {
+		kfree (ndg_cpu_mix[cpu]);
+		ndg_cpu_mix[cpu] = mix;
+	}
+out:
+	mutex_unlock (&ndg_mutex);
+	return rc;
+}
+
+static void
+show_netdevgen_mix (struct seq_file *m, int cpu, struct ndg_mix *mix)
+{
+	int n;
+
+	seq_puts (m, "sizes");
+	if (cpu >= 0)
+		seq_printf (m, " cpu %d", cpu);
+	if (mix->sweep)
+		seq_printf (m, " sweep step=%u", mix->step);
+	for (n = 0; n < mix->nsizes; n++)
+		seq_printf (m, "%c%d:%u", n ? ',' : ' ',
+			    mix->len[n], mix->weight[n]);
+	seq_putc (m, '\n');
+}
+
+static int
+ndg_name_index (const char * const *names, int nnames, const char *arg)
+{
+	int n;
+
+	for (n = 0; n < nnames; n++) {
+		if (strcmp (arg, names[n]) == 0)
+			return n;
+	}
+
+	return -EINVAL;
+}
+
+static int
+set_netdevgen_skbmode (const char *arg)
+{
+	int rc, n;
+
+	n = ndg_name_index (ndg_skbmode_names,
+			    ARRAY_SIZE (ndg_skbmode_names), arg);
+	if (n < 0)
+		return n;
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing skbmode\n");
+		rc = -EBUSY;
+	} else {
+		skbmode = n;
+		rc = 0;
+	}
+	mutex_unlock (&ndg_mutex);
+
+	return rc;
+}
+
+static int
+set_netdevgen_gso (char *args)
+{
+	/* off | tcp | udp [mss=N] */
+	int rc, type, mss = 0;
+	char *arg;
+
+	arg = strsep (&args, " ");
+	type = ndg_name_index (ndg_gso_names, ARRAY_SIZE (ndg_gso_names),
+			       arg);
+	if (type < 0)
+		return type;
+
+	while ((arg = strsep (&args, " "))) {
+		if (!*arg)
+			continue;
+		if (strncmp (arg, "mss=", 4) != 0 ||
+		    kstrtoint (arg + 4, 0, &mss) || mss < 0)
+			return -EINVAL;
+	}
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing gso\n");
+		rc = -EBUSY;
+	} else {
+		gso = type;
+		gso_mss = mss;
+		rc = 0;
+	}
+	mutex_unlock (&ndg_mutex);
+
+	return rc;
+}
+
+static int
+set_netdevgen_burst (const char *arg)
+{
+	int rc, n;
+
+	rc = kstrtoint (arg, 0, &n);
+	if (rc < 0 || n < 0 || n > NDG_BURST_MAX)
+		return -EINVAL;
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing burst\n");
+		rc = -EBUSY;
+	} else
+		burst = n;
+	mutex_unlock (&ndg_mutex);
+
+	return rc;
+}
+
+static int
+set_netdevgen_rx (const char *arg)
+{
+	/* "rx DEV" injects frames into the rx path of DEV, and "rx
+	 * off" goes back to xmit */
+	int rc = 0;
+	struct net *net;
+	struct net_device *dev = NULL;
+
+	if (strcmp (arg, "off") != 0) {
+		net = get_net_ns_by_pid (1);
+		if (!net)
+			return -ENODEV;
+		dev = dev_get_by_name (net, arg);
+		put_net (net);
+		if (!dev) {
+			pr_err ("no device %s\n", arg);
+			return -ENODEV;
+		}
+		if (dev->type != ARPHRD_ETHER) {
+			pr_err ("%s is not an ethernet device\n", arg);
+			dev_put (dev);
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before changing rx\n");
+		rc = -EBUSY;
+		if (dev)
+			dev_put (dev);
+	} else {
+		if (ndg_rxdev)
+			dev_put (ndg_rxdev);
+		ndg_rxdev = dev;
+	}
+	mutex_unlock (&ndg_mutex);
+
+	return rc;
+}
+
+static int
+set_netdevgen_stamp (const char *arg)
+{
+	/* sampled packets are changed while threads run */
+	int rc, n;
+
+	rc = kstrtoint (arg, 0, &n);
+	if (rc < 0 || n < 0)
+		return -EINVAL;
+
+	ACCESS_ONCE (stamp) = n;
+
+	return 0;
+}
+
+static void
+show_netdevgen_profile (struct seq_file *m, const char *name,
+			struct ndg_profile *p)
+{
+	if (p->dist == NDG_DIST_ZIPF)
+		seq_printf (m, "%s %u zipf %u.%02u\n", name, p->count,
+			    p->s / 100, p->s % 100);
+	else
+		seq_printf (m, "%s %u uniform\n", name, p->count);
+}
+
+static u64
+ndg_rate (u64 count, u64 dt)
+{
+	/* count per second in dt nsec. usec resolution, so that counts
+	 * of long runs do not overflow. */
+	dt = div64_u64 (dt, NSEC_PER_USEC);
+
+	return dt ? div64_u64 (count * USEC_PER_SEC, dt) : 0;
+}
+
+static void
+show_netdevgen_sizes (struct seq_file *m, int n, struct ndg_thread *t)
+{
+	/* rates of each size over the time it was generated: the run
+	 * time of the thread for a mix, and its step in a sweep. */
+	int i;
+	unsigned int start;
+	s64 elapsed, step, dt;
+	ktime_t end;
+	struct ndg_stats s;
+
+	if (t->replay)
+		return;
+
+	end = ktime_to_ns (t->end) ? t->end : ktime_get ();
+	elapsed = ktime_to_ns (ktime_sub (end, t->start));
+	step = (s64) t->mix.step * NSEC_PER_SEC;
+
+	for (i = 0; i < t->mix.nsizes; i++) {
+		do {
+			start = u64_stats_fetch_begin (&t->syncp);
+			s = t->size[i];
+		} while (u64_stats_fetch_retry (&t->syncp, start));
+
+		dt = elapsed;
+		if (t->mix.sweep)
+			dt = clamp (elapsed - i * step, (s64) 0, step);
+
+		seq_printf (m, "size thread=%d cpu=%u pktlen=%d "
+			    "packets=%llu accepted=%llu dropped=%llu "
+			    "bytes=%llu pps=%llu accepted_pps=%llu bps=%llu\n",
+			    n, t->cpu, t->mix.len[i], s.packets, s.accepted,
+			    s.dropped, s.bytes, ndg_rate (s.packets, dt),
+			    ndg_rate (s.accepted, dt), ndg_rate (s.bytes * 8, dt));
+	}
+}
+
+static int
+proc_show (struct seq_file *m, void *v)
+{
+	/* pps and bps are rates since the last read. the summary line
+	 * is rates over the whole run, in key=value for scripts. */
+	int n, cpu, running = 0;
+	unsigned int start;
+	u64 packets, bytes, accepted, dropped, pps, bps, dt;
+	u64 tpackets = 0, tbytes = 0, tpps = 0, tbps = 0;
+	u64 taccepted = 0, tdropped = 0, misses;
+	u64 spackets = 0, sbytes = 0;
+	ktime_t now, first = ktime_set (0, 0), last = ktime_set (0, 0);
+	ktime_t end;
+	struct ndg_thread * t;
+	struct ndg_sink_stats * ss;
+
+	mutex_lock (&ndg_mutex);
+
+	seq_printf (m, "%-6s %-4s %16s %20s %16s %12s %12s %14s\n",
+		    "thread", "cpu", "packets", "bytes", "accepted", "dropped",
+		    "pps", "bps");
+
+	for (n = 0; n < ndg_nstats; n++) {
+		t = &ndg_threads[n];
+
+		do {
+			start = u64_stats_fetch_begin (&t->syncp);
+			packets = t->packets;
+			bytes = t->bytes;
+			accepted = t->accepted;
+			dropped = t->dropped;
+		} while (u64_stats_fetch_retry (&t->syncp, start));
+
+		now = ktime_get ();
+		dt = ktime_to_ns (ktime_sub (now, t->last)) ? : 1;
+		pps = div64_u64 ((packets - t->last_packets) * NSEC_PER_SEC,
+				 dt);
+		bps = div64_u64 ((bytes - t->last_bytes) * 8 * NSEC_PER_SEC,
+				 dt);
+		t->last_packets = packets;
+		t->last_bytes = bytes;
+		t->last = now;
+
+		seq_printf (m, "%-6d %-4u %16llu %20llu %16llu %12llu "
+			    "%12llu %14llu\n", n, t->cpu, packets, bytes,
+			    accepted, dropped, pps, bps);
+
+		tpackets += packets;
+		tbytes += bytes;
+		taccepted += accepted;
+		tdropped += dropped;
+		tpps += pps;
+		tbps += bps;
+
+		/* run time from the first start to the last end */
+		end = t->end;
+		if (ktime_to_ns (end) == 0) {
+			end = now;
+			running++;
+		}
+		if (ktime_to_ns (t->start) &&
+		    (ktime_to_ns (first) == 0 ||
+		     ktime_before (t->start, first)))
+			first = t->start;
+		if (ktime_after (end, last))
+			last = end;
+	}
+
+	seq_printf (m, "%-6s %-4s %16llu %20llu %16llu %12llu "
+		    "%12llu %14llu\n", "total", "-", tpackets, tbytes,
+		    taccepted, tdropped, tpps, tbps);
+
+	dt = ktime_to_ns (first) ? ktime_to_ns (ktime_sub (last, first)) : 0;
+	seq_printf (m, "summary state=%s threads=%d duration_ns=%llu "
+		    "packets=%llu accepted=%llu dropped=%llu bytes=%llu "
+		    "pps=%llu accepted_pps=%llu bps=%llu\n",
+		    running ? "running" : ndg_nstats ? "done" : "idle",
+		    ndg_nstats, dt, tpackets, taccepted, tdropped, tbytes,
+		    ndg_rate (tpackets, dt), ndg_rate (taccepted, dt),
+		    ndg_rate (tbytes * 8, dt));
+
+	if (ndg_sink_stats && ndg_sinkname[0]) {
+		/* decapsulated packets over the run */
+		for_each_possible_cpu (cpu) {
+			ss = per_cpu_ptr (ndg_sink_stats, cpu);
+			do {
+				start = u64_stats_fetch_begin (&ss->syncp);
+				packets = ss->packets;
+				bytes = ss->bytes;
+			} while (u64_stats_fetch_retry (&ss->syncp, start));
+			spackets += packets;
+			sbytes += bytes;
+		}
+		seq_printf (m, "sink dev=%s packets=%llu bytes=%llu pps=%llu "
+			    "bps=%llu\n", ndg_sinkname, spackets, sbytes,
+			    ndg_rate (spackets, dt), ndg_rate (sbytes * 8, dt));
+	}
+
+	for (n = 0; n < ndg_nstats; n++)
+		show_netdevgen_sizes (m, n, &ndg_threads[n]);
+
+	show_netdevgen_mix (m, -1, &ndg_mix);
+	for (n = 0; n < nr_cpu_ids; n++) {
+		if (ndg_cpu_mix[n])
+			show_netdevgen_mix (m, n, ndg_cpu_mix[n]);
+	}
+
+	if (ndg_rxdev)
+		seq_printf (m, "xmit rx %s burst %d\n", ndg_rxdev->name,
+			    burst ? : 1);
+	else if (burst)
+		seq_printf (m, "xmit direct burst %d\n", burst);
+	else
+		seq_printf (m, "xmit stack\n");
+	if (skbmode == NDG_SKB_POOL) {
+		for (n = 0, misses = 0; n < ndg_nstats; n++) {
+			t = &ndg_threads[n];
+			do {
+				start = u64_stats_fetch_begin (&t->syncp);
+				packets = t->pool_misses;
+			} while (u64_stats_fetch_retry (&t->syncp, start));
+			misses += packets;
+		}
+		seq_printf (m, "skbmode pool size %d misses %llu\n",
+			    pool_size, misses);
+	} else
+		seq_printf (m, "skbmode %s\n", ndg_skbmode_names[skbmode]);
+	if (stamp)
+		seq_printf (m, "stamp 1/%d\n", stamp);
+	if (gso != NDG_GSO_OFF)
+		seq_printf (m, "gso %s mss %d\n", ndg_gso_names[gso],
+			    gso_mss ? : gso == NDG_GSO_TCP ?
+			    NDG_GSO_TCP_MSS : NDG_GSO_UDP_MSS);
+	else
+		seq_printf (m, "gso off\n");
+	show_netdevgen_profile (m, "flows", &ndg_flows);
+	show_netdevgen_profile (m, "locators", &ndg_locators);
+	if (ndg_locators.count)
+		seq_printf (m, "locator-base %llu\n", ndg_locator_base);
+
+	mutex_unlock (&ndg_mutex);
+
+	return 0;
+}
+
+static int
+proc_open (struct inode *inode, struct file *fp)
+{
+	return single_open (fp, proc_show, NULL);
+}
+
+static ssize_t
+proc_write(struct file *fp, const char __user *ubuf, size_t size,
+	   loff_t *off)
+{
+	char buf[256];
+
+	if (size >= sizeof (buf))
+		return -EINVAL;
+	if (copy_from_user (buf, ubuf, size))
+		return -EFAULT;
+	buf[size] = '\0';
+	strim (buf);
+
+	if (strncmp (buf, "xmit", 4) == 0) {
+
+		start_netdevgen_xmit_one_thread ();
+
+	} else if (strncmp (buf, "vxlan", 5) == 0) {
+
+		srcip = srcip_vxlan;
+		dstip = dstip_vxlan;
+		ndg_proto = NDG_PROTO_VXLAN;
+#ifdef OVBENCH
+		ovtype = OVTYPE_VXLAN;
+#endif
+		if (!measure_pps)
+			start_netdevgen_xmit_one_thread ();
+		else
+			start_netdevgen_thread (ndg_parse_duration (buf));
+		
+	} else if (strncmp (buf, "gretap", 6) == 0) {
+
+		srcip = srcip_gretap;
+		dstip = dstip_gretap;
+		ndg_proto = NDG_PROTO_GRETAP;
+#ifdef OVBENCH
+		ovtype = OVTYPE_GRETAP;
 #endif
 		if (!measure_pps)
 			start_netdevgen_xmit_one_thread ();
 		else
-			start_netdevgen_thread ();
+			start_netdevgen_thread (ndg_parse_duration (buf));
+		
+	} else if (strncmp (buf, "gre", 3) == 0) {
+
+		srcip = srcip_gre;
+		dstip = dstip_gre;
+		ndg_proto = NDG_PROTO_GRE;
+#ifdef OVBENCH
+		ovtype = OVTYPE_GRE;
+#endif
+		if (!measure_pps)
+			start_netdevgen_xmit_one_thread ();
+		else
+			start_netdevgen_thread (ndg_parse_duration (buf));
 		
 	} else if (strncmp (buf, "ipip", 4) == 0) {
 
 		srcip = srcip_ipip;
 		dstip = dstip_ipip;
+		ndg_proto = NDG_PROTO_IPIP;
 #ifdef OVBENCH
 		ovtype = OVTYPE_IPIP;
 #endif
 		if (!measure_pps)
 			start_netdevgen_xmit_one_thread ();
 		else
-			start_netdevgen_thread ();
+			start_netdevgen_thread (ndg_parse_duration (buf));
 		
 	} else if (strncmp (buf, "nsh", 3) == 0) {
 
 		srcip = srcip_nsh;
 		dstip = dstip_nsh;
+		ndg_proto = NDG_PROTO_NSH;
 #ifdef OVBENCH
 		ovtype = OVTYPE_NSH;
 #endif
 		if (!measure_pps)
 			start_netdevgen_xmit_one_thread ();
 		else
-			start_netdevgen_thread ();
+			start_netdevgen_thread (ndg_parse_duration (buf));
 
 	} else if (strncmp (buf, "noencap", 7) == 0) {
 
 		srcip = srcip_noencap;
 		dstip = dstip_noencap;
+		ndg_proto = NDG_PROTO_NOENCAP;
 #ifdef OVBENCH
 		ovtype = OVTYPE_NOENCAP;
 #endif
 		if (!measure_pps)
 			start_netdevgen_xmit_one_thread ();
 		else
-			start_netdevgen_thread ();
+			start_netdevgen_thread (ndg_parse_duration (buf));
 		
 	} else if (strncmp (buf, "start", 5) == 0) {
 
-		start_netdevgen_thread ();
+		start_netdevgen_thread (ndg_parse_duration (buf));
 
 	} else if (strncmp (buf, "stop", 4) == 0) {
 
 		stop_netdevgen_thread ();
 
+	} else if (strncmp (buf, "cpus ", 5) == 0) {
+
+		set_netdevgen_cpus (buf + 5);
+
+	} else if (strncmp (buf, "sizes ", 6) == 0) {
+
+		if (set_netdevgen_sizes (buf + 6) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "skbmode ", 8) == 0) {
+
+		if (set_netdevgen_skbmode (buf + 8) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "gso ", 4) == 0) {
+
+		if (set_netdevgen_gso (buf + 4) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "burst ", 6) == 0) {
+
+		if (set_netdevgen_burst (buf + 6) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "rx ", 3) == 0) {
+
+		if (set_netdevgen_rx (buf + 3) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "stamp ", 6) == 0) {
+
+		if (set_netdevgen_stamp (buf + 6) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "flows ", 6) == 0) {
+
+		if (set_netdevgen_profile (&ndg_flows, buf + 6, NULL) < 0)
+			return -EINVAL;
+
+	} else if (strncmp (buf, "locators ", 9) == 0) {
+
+		if (set_netdevgen_profile (&ndg_locators, buf + 9,
+					   &ndg_locator_base) < 0)
+			return -EINVAL;
+
 	} else {
 		pr_info ("invalid command\n");
 	}
@@ -388,9 +2318,235 @@ proc_write(struct file *fp, const char *buf, size_t size, loff_t *off)
         return size;
 }
 
+static void
+ndg_pcap_free (struct ndg_pcap *pcap)
+{
+	if (!pcap)
+		return;
+
+	vfree (pcap->recs);
+	vfree (pcap->data);
+	kfree (pcap);
+}
+
+static struct ndg_pcap *
+ndg_pcap_parse (u8 *data, size_t len)
+{
+	/* index records of a pcap file. data is owned by the returned
+	 * ndg_pcap. */
+	int pass;
+	bool swapped;
+	size_t off;
+	u32 magic, incl_len, n;
+	struct ndg_pcap *pcap;
+	struct ndg_pcap_file_hdr *fh = (struct ndg_pcap_file_hdr *) data;
+	struct ndg_pcap_rec_hdr *rh;
+
+	if (len < sizeof (*fh))
+		return ERR_PTR (-EINVAL);
+
+	magic = fh->magic;
+	swapped = (magic == swab32 (NDG_PCAP_MAGIC) ||
+		   magic == swab32 (NDG_PCAP_MAGIC_NSEC));
+	if (swapped)
+		magic = swab32 (magic);
+	if (magic != NDG_PCAP_MAGIC && magic != NDG_PCAP_MAGIC_NSEC) {
+		pr_err ("invalid pcap magic %08x\n", fh->magic);
+		return ERR_PTR (-EINVAL);
+	}
+
+	pcap = kzalloc (sizeof (*pcap), GFP_KERNEL);
+	if (!pcap)
+		return ERR_PTR (-ENOMEM);
+
+	pcap->linktype = swapped ? swab32 (fh->linktype) : fh->linktype;
+	switch (pcap->linktype) {
+	case NDG_LINKTYPE_ETHERNET :
+	case NDG_LINKTYPE_RAW :
+	case NDG_LINKTYPE_IPV4 :
+		break;
+	default :
+		pr_err ("unsupported pcap linktype %u\n", pcap->linktype);
+		kfree (pcap);
+		return ERR_PTR (-EINVAL);
+	}
+
+	/* count records, then index them */
+	for (pass = 0; pass < 2; pass++) {
+		n = 0;
+		for (off = sizeof (*fh); off + sizeof (*rh) <= len;
+		     off += sizeof (*rh) + incl_len) {
+			rh = (struct ndg_pcap_rec_hdr *) (data + off);
+			incl_len = swapped ? swab32 (rh->incl_len) :
+				rh->incl_len;
+			if (incl_len > len - off - sizeof (*rh))
+				break;	/* truncated file */
+
+			if (pcap->recs) {
+				pcap->recs[n].off = off + sizeof (*rh);
+				pcap->recs[n].len = incl_len;
+			}
+			n++;
+		}
+
+		if (pass == 0) {
+			if (!n) {
+				kfree (pcap);
+				return ERR_PTR (-EINVAL);
+			}
+			pcap->recs = vmalloc (sizeof (*pcap->recs) * n);
+			if (!pcap->recs) {
+				kfree (pcap);
+				return ERR_PTR (-ENOMEM);
+			}
+		}
+	}
+
+	pcap->nrecs = n;
+	pcap->data = data;
+	pcap->len = len;
+
+	return pcap;
+}
+
+/* a pcap file being written to PCAP_PROC_NAME */
+struct ndg_pcap_buf {
+	u8	*data;
+	size_t	len;
+	size_t	size;
+};
+
+static int
+pcap_proc_show (struct seq_file *m, void *v)
+{
+	mutex_lock (&ndg_mutex);
+	if (ndg_pcap)
+		seq_printf (m, "records %u bytes %zu linktype %u\n",
+			    ndg_pcap->nrecs, ndg_pcap->len,
+			    ndg_pcap->linktype);
+	else
+		seq_printf (m, "records 0\n");
+	mutex_unlock (&ndg_mutex);
+
+	return 0;
+}
+
+static int
+pcap_proc_open (struct inode *inode, struct file *fp)
+{
+	struct ndg_pcap_buf *b;
+
+	if (!(fp->f_mode & FMODE_WRITE))
+		return single_open (fp, pcap_proc_show, NULL);
+
+	if (fp->f_mode & FMODE_READ)
+		return -EINVAL;
+
+	b = kzalloc (sizeof (*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+	fp->private_data = b;
+
+	/* written from the start to the end, as cat does */
+	return nonseekable_open (inode, fp);
+}
+
+static loff_t
+pcap_proc_lseek (struct file *fp, loff_t off, int whence)
+{
+	/* private_data is a seq_file only when opened for read */
+	if (fp->f_mode & FMODE_WRITE)
+		return no_llseek (fp, off, whence);
+
+	return seq_lseek (fp, off, whence);
+}
+
+static ssize_t
+pcap_proc_write (struct file *fp, const char __user *ubuf, size_t size,
+		 loff_t *off)
+{
+	size_t nsize;
+	u8 *ndata;
+	struct ndg_pcap_buf *b = fp->private_data;
+
+	if (*off + size > NDG_PCAP_MAX)
+		return -EFBIG;
+
+	if (*off + size > b->size) {
+		nsize = max_t (size_t, b->size * 2, *off + size);
+		nsize = min_t (size_t, max_t (size_t, nsize, 1 << 16),
+			       NDG_PCAP_MAX);
+		ndata = vmalloc (nsize);
+		if (!ndata)
+			return -ENOMEM;
+		memcpy (ndata, b->data, b->len);
+		vfree (b->data);
+		b->data = ndata;
+		b->size = nsize;
+	}
+
+	if (copy_from_user (b->data + *off, ubuf, size))
+		return -EFAULT;
+
+	*off += size;
+	b->len = max_t (size_t, b->len, *off);
+
+	return size;
+}
+
+static int
+pcap_proc_release (struct inode *inode, struct file *fp)
+{
+	/* a written file replaces the pcap, and an empty one clears
+	 * it. */
+	struct ndg_pcap *pcap = NULL;
+	struct ndg_pcap_buf *b = fp->private_data;
+
+	if (!(fp->f_mode & FMODE_WRITE))
+		return single_release (inode, fp);
+
+	if (b->len) {
+		pcap = ndg_pcap_parse (b->data, b->len);
+		if (IS_ERR (pcap)) {
+			pr_err ("failed to load pcap\n");
+			vfree (b->data);
+			kfree (b);
+			return 0;
+		}
+	} else
+		vfree (b->data);
+	kfree (b);
+
+	mutex_lock (&ndg_mutex);
+	if (ndg_nthreads) {
+		pr_info ("netdevgen: stop threads before loading pcap\n");
+		ndg_pcap_free (pcap);
+	} else {
+		ndg_pcap_free (ndg_pcap);
+		ndg_pcap = pcap;
+		pr_info ("netdevgen: pcap %u records\n",
+			 pcap ? pcap->nrecs : 0);
+	}
+	mutex_unlock (&ndg_mutex);
+
+	return 0;
+}
+
+static const struct file_operations pcap_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = pcap_proc_open,
+	.read = seq_read,
+	.llseek = pcap_proc_lseek,
+	.release = pcap_proc_release,
+	.write = pcap_proc_write,
+};
+
 static const struct file_operations proc_file_fops = {
 	.owner = THIS_MODULE,
-	.read = proc_read,
+	.open = proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
 	.write = proc_write,
 };
 
@@ -399,36 +2555,84 @@ netdevgen_init (void)
 {
 	struct proc_dir_entry * ent;
 
+	ndg_threads = kcalloc (nr_cpu_ids, sizeof (struct ndg_thread),
+			       GFP_KERNEL);
+	if (!ndg_threads)
+		return -ENOMEM;
+
+	ndg_cpu_mix = kcalloc (nr_cpu_ids, sizeof (struct ndg_mix *),
+			       GFP_KERNEL);
+	if (!ndg_cpu_mix)
+		goto mix_failed;
+
+	if (!zalloc_cpumask_var (&ndg_cpumask, GFP_KERNEL))
+		goto cpumask_failed;
+
+	set_netdevgen_cpus (cpus);
+	burst = clamp (burst, 0, NDG_BURST_MAX);
+	if (stamp < 0)
+		stamp = 0;
+	if (skbmode < NDG_SKB_CLONE || skbmode > NDG_SKB_POOL)
+		skbmode = NDG_SKB_CLONE;
+	if (pool_size < 1)
+		pool_size = 1;
+	if (gso < NDG_GSO_OFF || gso > NDG_GSO_UDP)
+		gso = NDG_GSO_OFF;
+
+	/* default mix is pktlen only */
+	ndg_mix.nsizes = 1;
+	ndg_mix.len[0] = pktlen;
+	ndg_mix.weight[0] = 1;
+	ndg_mix.step = 10;
+	ndg_mix.nsched = 1;
+
         ent = proc_create(PROC_NAME, S_IRUGO | S_IWUGO | S_IXUGO,
 			  NULL, &proc_file_fops);
         if (ent == NULL)
-                return -ENOMEM;
-
-
-	atomic_set (&start, 0);
+		goto proc_failed;
 
-	if (IS_ERR (ndg_tsk)) {
-		pr_err ("failed to run netdevgen thread\n");
-		return -1;
-	}
+	ent = proc_create (PCAP_PROC_NAME, S_IRUGO | S_IWUSR, NULL,
+			   &pcap_proc_fops);
+	if (ent == NULL)
+		goto pcap_proc_failed;
 
 	pr_info ("netdevgen loaded\n");
 	if (measure_pps)
 		pr_info ("measurement pps mode, pktlen is %d\n", pktlen);
 		
 	return 0;
+
+pcap_proc_failed:
+	remove_proc_entry (PROC_NAME, NULL);
+proc_failed:
+	free_cpumask_var (ndg_cpumask);
+cpumask_failed:
+	kfree (ndg_cpu_mix);
+mix_failed:
+	kfree (ndg_threads);
+	return -ENOMEM;
 }
 
 static void __exit
 netdevgen_exit (void)
 {
+	int cpu;
+
+	remove_proc_entry (PCAP_PROC_NAME, NULL);
 	remove_proc_entry (PROC_NAME, NULL);
 
-	if (ndg_tsk && ndg_thread_running)
-		kthread_stop (ndg_tsk);
-	else {
-		pr_info ("thread is already done\n");
-	}
+	stop_netdevgen_thread ();
+	if (ndg_rxdev)
+		dev_put (ndg_rxdev);
+	free_percpu (ndg_sink_stats);
+	ndg_pcap_free (ndg_pcap);
+	vfree (ndg_flows.table);
+	vfree (ndg_locators.table);
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		kfree (ndg_cpu_mix[cpu]);
+	kfree (ndg_cpu_mix);
+	free_cpumask_var (ndg_cpumask);
+	kfree (ndg_threads);
 
 	pr_info ("netdevgen unloaded\n");
 
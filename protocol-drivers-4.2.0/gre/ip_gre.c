@@ -56,6 +56,7 @@
 
 /* madcapable version.  */
 #include <madcap.h>
+#include <madcap_trace.h>
 
 #ifdef OVBENCH
 #include <linux/ovbench.h>
@@ -65,6 +66,11 @@ static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
 MODULE_PARM_DESC (madcap_enable, "if 1, madcap offload is enabled.");
 
+static int madcap_id __read_mostly = 0;
+module_param_named (madcap_id, madcap_id, int, 0444);
+MODULE_PARM_DESC (madcap_id, "if 1, GRE key is passed to madcap device as "
+		  "locator id.");
+
 /*
    Problems & solutions
    --------------------
@@ -218,6 +224,8 @@ static int ipgre_rcv(struct sk_buff *skb, const struct tnl_ptk_info *tpi)
 	const struct iphdr *iph;
 	struct ip_tunnel *tunnel;
 
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_RECV);
+
 	if (tpi->proto == htons(ETH_P_TEB))
 		itn = net_generic(net, gre_tap_net_id);
 	else
@@ -235,19 +243,37 @@ static int ipgre_rcv(struct sk_buff *skb, const struct tnl_ptk_info *tpi)
 	return PACKET_REJECT;
 }
 
-static void __gre_xmit(struct sk_buff *skb, struct net_device *dev,
-		       const struct iphdr *tnl_params,
-		       __be16 proto)
+static struct net_device *ipgre_mcdev(struct net_device *dev)
+{
+	/* madcap device of the tunnel link, or NULL */
+	struct ip_tunnel *tunnel = netdev_priv(dev);
+	struct net_device *mcdev;
+
+	if (!madcap_enable)
+		return NULL;
+
+	mcdev = __dev_get_by_index (dev_net (dev), tunnel->parms.link);
+	if (mcdev && get_madcap_ops (mcdev))
+		return mcdev;
+
+	return NULL;
+}
+
+/* returns the return value of madcap_queue_xmit when mcdev is given,
+ * otherwise NET_XMIT_SUCCESS. ip_tunnel_xmit counts its own errors. */
+static int __gre_xmit(struct sk_buff *skb, struct net_device *dev,
+		      const struct iphdr *tnl_params,
+		      __be16 proto, struct net_device *mcdev)
 {
 	struct ip_tunnel *tunnel = netdev_priv(dev);
 	struct tnl_ptk_info tpi;
-	struct net_device *mcdev;	/* madcap device */
 
 #ifdef OVBENCH
 	if (SKB_OVBENCH (skb)) {
 		skb->gre_xmit_in = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_START);
 
 	tpi.flags = tunnel->parms.o_flags;
 	tpi.proto = proto;
@@ -264,18 +290,20 @@ static void __gre_xmit(struct sk_buff *skb, struct net_device *dev,
 		skb->gre_encap_end = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_END);
 
-	if (madcap_enable) {
-		mcdev = __dev_get_by_index (dev_net (dev), tunnel->parms.link);
-		if (mcdev && get_madcap_ops (mcdev)) {
-			madcap_queue_xmit (skb, mcdev);
-			return;
-		}
+	if (mcdev) {
+		if (madcap_id)
+			return madcap_queue_xmit_id (skb, mcdev,
+						     ntohl (tpi.key), 0);
+		return madcap_queue_xmit (skb, mcdev);
 	}
 
 	skb_set_inner_protocol(skb, tpi.proto);
 
+	trace_madcap_stage (skb, MADCAP_STAGE_TUNNEL_XMIT);
 	ip_tunnel_xmit(skb, dev, tnl_params, tnl_params->protocol);
+	return NET_XMIT_SUCCESS;
 }
 
 static netdev_tx_t ipgre_xmit(struct sk_buff *skb,
@@ -283,12 +311,27 @@ static netdev_tx_t ipgre_xmit(struct sk_buff *skb,
 {
 	struct ip_tunnel *tunnel = netdev_priv(dev);
 	const struct iphdr *tnl_params;
+	struct net_device *mcdev = ipgre_mcdev(dev);
+
+	/* do not build headers for packets the madcap device can not
+	 * take now */
+	if (mcdev) {
+		switch (madcap_tx_busy (mcdev, dev, skb)) {
+		case MADCAP_TX_BUSY :
+			return NETDEV_TX_BUSY;
+		case MADCAP_TX_DROP :
+			trace_madcap_drop (skb, MADCAP_STAGE_PROTO_XMIT);
+			kfree_skb (skb);
+			return madcap_xmit_ret (dev, NET_XMIT_DROP);
+		}
+	}
 
 #ifdef OVBENCH
 	if (SKB_OVBENCH (skb)) {
 		skb->ipgre_xmit_in = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_XMIT);
 
 	if (dev->header_ops) {
 		/* Need space for new headers */
@@ -314,9 +357,8 @@ static netdev_tx_t ipgre_xmit(struct sk_buff *skb,
 	if (IS_ERR(skb))
 		goto out;
 
-	__gre_xmit(skb, dev, tnl_params, skb->protocol);
-
-	return NETDEV_TX_OK;
+	return madcap_xmit_ret (dev, __gre_xmit (skb, dev, tnl_params,
+						 skb->protocol, mcdev));
 
 free_skb:
 	kfree_skb(skb);
@@ -329,12 +371,25 @@ static netdev_tx_t gre_tap_xmit(struct sk_buff *skb,
 				struct net_device *dev)
 {
 	struct ip_tunnel *tunnel = netdev_priv(dev);
+	struct net_device *mcdev = ipgre_mcdev(dev);
+
+	if (mcdev) {
+		switch (madcap_tx_busy (mcdev, dev, skb)) {
+		case MADCAP_TX_BUSY :
+			return NETDEV_TX_BUSY;
+		case MADCAP_TX_DROP :
+			trace_madcap_drop (skb, MADCAP_STAGE_PROTO_XMIT);
+			kfree_skb (skb);
+			return madcap_xmit_ret (dev, NET_XMIT_DROP);
+		}
+	}
 
 #ifdef OVBENCH
 	if (SKB_OVBENCH (skb)) {
 		skb->gre_tap_xmit_in = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_XMIT);
 
 	skb = gre_handle_offloads(skb, !!(tunnel->parms.o_flags&TUNNEL_CSUM));
 	if (IS_ERR(skb))
@@ -343,9 +398,8 @@ static netdev_tx_t gre_tap_xmit(struct sk_buff *skb,
 	if (skb_cow_head(skb, dev->needed_headroom))
 		goto free_skb;
 
-	__gre_xmit(skb, dev, &tunnel->parms.iph, htons(ETH_P_TEB));
-
-	return NETDEV_TX_OK;
+	return madcap_xmit_ret (dev, __gre_xmit (skb, dev, &tunnel->parms.iph,
+						 htons(ETH_P_TEB), mcdev));
 
 free_skb:
 	kfree_skb(skb);
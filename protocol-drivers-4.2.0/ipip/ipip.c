@@ -120,6 +120,7 @@
 
 /* madcapable version. */
 #include <madcap.h>
+#include <madcap_trace.h>
 
 static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
@@ -202,6 +203,8 @@ static int ipip_rcv(struct sk_buff *skb)
 	struct ip_tunnel *tunnel;
 	const struct iphdr *iph;
 
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_RECV);
+
 	iph = ip_hdr(skb);
 	tunnel = ip_tunnel_lookup(itn, skb->dev->ifindex, TUNNEL_NO_KEY,
 			iph->saddr, iph->daddr, 0);
@@ -228,13 +231,33 @@ static netdev_tx_t ipip_tunnel_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ip_tunnel *tunnel = netdev_priv(dev);
 	const struct iphdr  *tiph = &tunnel->parms.iph;
-	struct net_device *mcdev;	/* madcap device */
+	struct net_device *mcdev = NULL;	/* madcap device */
+
+	if (madcap_enable) {
+		mcdev = __dev_get_by_index (dev_net (dev), tunnel->parms.link);
+		if (mcdev && !get_madcap_ops (mcdev))
+			mcdev = NULL;
+	}
+
+	/* do not build headers for packets the madcap device can not
+	 * take now */
+	if (mcdev) {
+		switch (madcap_tx_busy (mcdev, dev, skb)) {
+		case MADCAP_TX_BUSY :
+			return NETDEV_TX_BUSY;
+		case MADCAP_TX_DROP :
+			trace_madcap_drop (skb, MADCAP_STAGE_PROTO_XMIT);
+			kfree_skb (skb);
+			return madcap_xmit_ret (dev, NET_XMIT_DROP);
+		}
+	}
 
 #ifdef OVBENCH
 	if (SKB_OVBENCH (skb)) {
 		skb->ipip_tunnel_xmit_in = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_XMIT);
 
 	if (unlikely(skb->protocol != htons(ETH_P_IP)))
 		goto tx_error;
@@ -243,16 +266,12 @@ static netdev_tx_t ipip_tunnel_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (IS_ERR(skb))
 		goto out;
 
-	if (madcap_enable) {
-		mcdev = __dev_get_by_index (dev_net (dev), tunnel->parms.link);
-		if (mcdev && get_madcap_ops (mcdev)) {
-			madcap_queue_xmit (skb, mcdev);
-			return NETDEV_TX_OK;
-		}
-	}
+	if (mcdev)
+		return madcap_xmit_ret (dev, madcap_queue_xmit (skb, mcdev));
 
 	skb_set_inner_ipproto(skb, IPPROTO_IPIP);
 
+	trace_madcap_stage (skb, MADCAP_STAGE_TUNNEL_XMIT);
 	ip_tunnel_xmit(skb, dev, tiph, tiph->protocol);
 	return NETDEV_TX_OK;
 
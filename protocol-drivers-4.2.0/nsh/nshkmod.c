@@ -25,6 +25,7 @@
 
 /* madcapable version */
 #include <madcap.h>
+#include <madcap_trace.h>
 
 #ifdef OVBENCH
 #include <linux/ovbench.h>
@@ -34,6 +35,11 @@ static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
 MODULE_PARM_DESC (madcap_enable, "if 1, madcap offload is enabled.");
 
+static int madcap_id __read_mostly = 0;
+module_param_named (madcap_id, madcap_id, int, 0444);
+MODULE_PARM_DESC (madcap_id, "if 1, SPI/SI is passed to madcap device as "
+		  "locator id.");
+
 /*
  *
  * Network Service Header format.
@@ -274,6 +280,8 @@ static int nsh_recv(struct net *net, struct sk_buff *skb)
 	struct nsh_net *nnet = net_generic(net, nsh_net_id);
 	struct pcpu_sw_netstats *stats;
 
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_RECV);
+
 	nbh = (struct nsh_base_hdr *)skb->data;
 	nph = (struct nsh_path_hdr *)(nbh + 1);
 
@@ -410,6 +418,7 @@ static int nsh_xmit_vxlan_skb(struct socket *sock, struct net * net,
 	vxh->vx_flags = htonl(VXLAN_GPE_FLAGS | VXLAN_GPE_PROTO_NSH);
 	vxh->vx_vni = htonl(vni << 8);
 
+	trace_madcap_stage (skb, MADCAP_STAGE_TUNNEL_XMIT);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION (4, 2, 0)
 	return udp_tunnel_xmit_skb(rt, sock->sk, skb, src, dst, 0,
 				   NSH_VXLAN_TTL, 0, src_port, dst_port,
@@ -420,8 +429,20 @@ static int nsh_xmit_vxlan_skb(struct socket *sock, struct net * net,
 #endif
 }
 
+static void nsh_madcap_headroom (struct net_device *dev,
+				 struct net_device *lowerdev)
+{
+	/* one nsh device mixes native and madcap paths, so the native
+	 * headroom is kept, and raised for the madcap device. */
+	int hlen = madcap_vdev_headroom (lowerdev, NSH_MDTYPE1_HLEN +
+					 sizeof (struct vxlanhdr));
+
+	if (dev->needed_headroom < hlen)
+		dev->needed_headroom = hlen;
+}
+
 static int nsh_xmit_vxlan_madcap (struct sk_buff *skb, struct net_device *dev,
-				  __be32 vni)
+				  __be32 vni, __be32 spisi)
 {
 	int err;
 	struct vxlanhdr *vxh;
@@ -430,8 +451,11 @@ static int nsh_xmit_vxlan_madcap (struct sk_buff *skb, struct net_device *dev,
 	if (SKB_OVBENCH (skb))
 		skb->nsh_xmit_vxlan_in = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_START);
 
-	err = skb_cow_head(skb, VXLAN_HEADROOM);
+	/* the madcap device pushes outer ethernet, ip and udp */
+	err = madcap_skb_cow_head (skb, dev,
+				   madcap_vdev_headroom (dev, sizeof (*vxh)));
 	if (unlikely(err)) {
 		kfree_skb(skb);
 		return -ENOMEM;
@@ -441,6 +465,9 @@ static int nsh_xmit_vxlan_madcap (struct sk_buff *skb, struct net_device *dev,
 	vxh->vx_flags = htonl(VXLAN_GPE_FLAGS | VXLAN_GPE_PROTO_NSH);
 	vxh->vx_vni = htonl(vni << 8);
 
+	if (madcap_id)
+		return madcap_queue_xmit_id (skb, dev, ntohl (spisi), 0);
+
 	return madcap_queue_xmit (skb, dev);
 }
 
@@ -457,6 +484,8 @@ static int nsh_xmit_vxlan(struct sk_buff *skb, struct nsh_net *nnet,
 		skb->ip_routing_start = skb->nsh_xmit_vxlan_in;
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_START);
+	trace_madcap_stage (skb, MADCAP_STAGE_ROUTE_START);
 
 	memset(&fl4, 0, sizeof(fl4));
 	fl4.daddr = nt->rdst->remote_ip;
@@ -484,6 +513,7 @@ static int nsh_xmit_vxlan(struct sk_buff *skb, struct nsh_net *nnet,
 		skb->ip_routing_end = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_ROUTE_END);
 
 	return nsh_xmit_vxlan_skb(nnet->sock, nnet->net, rt,
 				  skb, fl4.saddr, nt->rdst->remote_ip,
@@ -539,6 +569,7 @@ static netdev_tx_t nsh_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (SKB_OVBENCH (skb))
 		skb->nsh_xmit_in = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_XMIT);
 
 	nt = nsh_find_table(nnet, ndev->key);
 	if (!nt) {
@@ -547,9 +578,22 @@ static netdev_tx_t nsh_xmit(struct sk_buff *skb, struct net_device *dev)
 		goto tx_err;
 	}
 
-	madcap_on = (madcap_enable && nt->rdst->lowerdev &&
+	madcap_on = (madcap_enable && nt->rdst && nt->rdst->lowerdev &&
 		     get_madcap_ops (nt->rdst->lowerdev));
 
+	if (madcap_on && nt->encap_type == NSH_ENCAP_TYPE_VXLAN) {
+		/* do not build headers for packets the madcap device
+		 * can not take now */
+		switch (madcap_tx_busy (nt->rdst->lowerdev, dev, skb)) {
+		case MADCAP_TX_BUSY :
+			return NETDEV_TX_BUSY;
+		case MADCAP_TX_DROP :
+			trace_madcap_drop (skb, MADCAP_STAGE_PROTO_XMIT);
+			kfree_skb (skb);
+			return madcap_xmit_ret (dev, NET_XMIT_DROP);
+		}
+	}
+
 	len = skb->len;
 
 	switch (nt->mdtype) {
@@ -575,6 +619,7 @@ static netdev_tx_t nsh_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (SKB_OVBENCH (skb))
 		skb->nsh_xmit_lookup_end = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_LOOKUP);
 	rc = skb_cow_head(skb, nhlen);
 	if (unlikely(rc)) {
 		netdev_dbg(dev, "failed to skb_cow_head\n");
@@ -612,7 +657,10 @@ static netdev_tx_t nsh_xmit(struct sk_buff *skb, struct net_device *dev)
 			if (madcap_on) {
 				rc = nsh_xmit_vxlan_madcap (skb,
 							    nt->rdst->lowerdev,
-							    nt->rdst->vni);
+							    nt->rdst->vni,
+							    ndev->key);
+				if (net_xmit_eval (rc))
+					return madcap_xmit_ret (dev, rc);
 			} else
 				rc = nsh_xmit_vxlan(skb, nnet, ndev,
 						    nt, src_port);
@@ -1041,6 +1089,7 @@ static int nsh_nl_cmd_path_dst_set(struct sk_buff *skb,
 			dst->lowerdev = lowerdev;
 			list_for_each_entry_rcu (ndev, &nnet->dev_list, list) {
 				madcap_acquire_dev (lowerdev, ndev->dev);
+				nsh_madcap_headroom (ndev->dev, lowerdev);
 			}
 		}
 
@@ -52,6 +52,7 @@
 
 /* madcapable version */
 #include <madcap.h>
+#include <madcap_trace.h>
 
 #ifdef OVBENCH
 #include <linux/ovbench.h>
@@ -61,6 +62,11 @@ static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
 MODULE_PARM_DESC (madcap_enable, "if 1, madcap offload is enabled.");
 
+static int madcap_id __read_mostly = 0;
+module_param_named (madcap_id, madcap_id, int, 0444);
+MODULE_PARM_DESC (madcap_id, "if 1, VNI is passed to madcap device as "
+		  "locator id.");
+
 #define VXLAN_VERSION	"0.1"
 
 #define PORT_HASH_BITS	8
@@ -1182,6 +1188,8 @@ static int vxlan_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
 	u32 flags, vni;
 	struct vxlan_metadata md = {0};
 
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_RECV);
+
 	/* Need Vxlan and inner Ethernet header to be present */
 	if (!pskb_may_pull(skb, VXLAN_HLEN))
 		goto error;
@@ -1768,7 +1776,8 @@ err:
 }
 #endif
 
-static int vxlan_xmit_madcap (struct sk_buff *skb, struct net_device *dev)
+static netdev_tx_t vxlan_xmit_madcap (struct sk_buff *skb,
+				      struct net_device *dev)
 {
 	/* Transmit local packets over Vxlan via madcap capable
          * device. Table lookup and outer IP/UDP headers
@@ -1779,21 +1788,35 @@ static int vxlan_xmit_madcap (struct sk_buff *skb, struct net_device *dev)
 	struct vxlanhdr *vxh;
 	struct vxlan_dev *vxlan = netdev_priv (dev);
 
+	/* do not build headers for packets the madcap device can not
+	 * take now */
+	switch (madcap_tx_busy (vxlan->mcdev, dev, skb)) {
+	case MADCAP_TX_BUSY :
+		return NETDEV_TX_BUSY;
+	case MADCAP_TX_DROP :
+		trace_madcap_drop (skb, MADCAP_STAGE_PROTO_XMIT);
+		kfree_skb (skb);
+		return madcap_xmit_ret (dev, NET_XMIT_DROP);
+	}
+
 #ifdef OVBENCH
 	if (SKB_OVBENCH (skb))
 		skb->vxlan_xmit_skb_in = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_START);
 
-	err = skb_cow_head (skb, VXLAN_HEADROOM + ETH_HLEN);
+	err = madcap_skb_cow_head (skb, vxlan->mcdev,
+				   madcap_vdev_headroom (vxlan->mcdev,
+							 sizeof (*vxh)));
 	if (unlikely (err)) {
 		kfree_skb (skb);
-		return err;
+		return madcap_xmit_ret (dev, err);
 	}
 
 
 	skb = vlan_hwaccel_push_inside (skb);   /* XXX: needed? */
 	if (WARN_ON (!skb))
-		return -ENOMEM;
+		return madcap_xmit_ret (dev, -ENOMEM);
 
 
 	vxh = (struct vxlanhdr *) __skb_push (skb, sizeof (*vxh));
@@ -1803,7 +1826,13 @@ static int vxlan_xmit_madcap (struct sk_buff *skb, struct net_device *dev)
 	skb_set_inner_protocol (skb, htons (ETH_P_TEB));
 
 
-	return madcap_queue_xmit (skb, vxlan->mcdev);
+	if (madcap_id)
+		err = madcap_queue_xmit_id (skb, vxlan->mcdev,
+					    vxlan->default_dst.remote_vni, 0);
+	else
+		err = madcap_queue_xmit (skb, vxlan->mcdev);
+
+	return madcap_xmit_ret (dev, err);
 }
 
 
@@ -1823,6 +1852,7 @@ int vxlan_xmit_skb(struct rtable *rt, struct sock *sk, struct sk_buff *skb,
 	if (SKB_OVBENCH (skb))
 		skb->vxlan_xmit_skb_in = rdtsc ();
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_BUILD_START);
 
 	if ((vxflags & VXLAN_F_REMCSUM_TX) &&
 	    skb->ip_summed == CHECKSUM_PARTIAL) {
@@ -1881,6 +1911,7 @@ int vxlan_xmit_skb(struct rtable *rt, struct sock *sk, struct sk_buff *skb,
 
 	skb_set_inner_protocol(skb, htons(ETH_P_TEB));
 
+	trace_madcap_stage (skb, MADCAP_STAGE_TUNNEL_XMIT);
 	return udp_tunnel_xmit_skb(rt, sk, skb, src, dst, tos,
 				   ttl, df, src_port, dst_port, xnet,
 				   !(vxflags & VXLAN_F_UDP_CSUM));
@@ -1985,6 +2016,7 @@ static void vxlan_xmit_one(struct sk_buff *skb, struct net_device *dev,
 		if (SKB_OVBENCH (skb))
 			skb->ip_routing_start = rdtsc ();
 #endif
+		trace_madcap_stage (skb, MADCAP_STAGE_ROUTE_START);
 
 
 		memset(&fl4, 0, sizeof(fl4));
@@ -2014,6 +2046,7 @@ static void vxlan_xmit_one(struct sk_buff *skb, struct net_device *dev,
 		if (SKB_OVBENCH (skb))
 			skb->ip_routing_end = rdtsc ();
 #endif
+		trace_madcap_stage (skb, MADCAP_STAGE_ROUTE_END);
 
 		/* Bypass encapsulation if the destination is local */
 		if (rt->rt_flags & RTCF_LOCAL &&
@@ -2139,6 +2172,7 @@ static netdev_tx_t vxlan_xmit(struct sk_buff *skb, struct net_device *dev)
 		skb->vxlan_xmit_in = rdtsc ();
 	}
 #endif
+	trace_madcap_stage (skb, MADCAP_STAGE_PROTO_XMIT);
 
 	if ((vxlan->flags & VXLAN_F_PROXY)) {
 		if (ntohs(eth->h_proto) == ETH_P_ARP)
@@ -2721,12 +2755,6 @@ static int vxlan_newlink(struct net *src_net, struct net_device *dev,
 			return -ENODEV;
 		}
 
-		/* check is lower dev madcap capable? */
-		if (get_madcap_ops (lowerdev)) {
-			vxlan->mcdev = lowerdev;
-			madcap_acquire_dev (lowerdev, dev);
-		}
-
 #if IS_ENABLED(CONFIG_IPV6)
 		if (use_ipv6) {
 			struct inet6_dev *idev = __in6_dev_get(lowerdev);
@@ -2743,6 +2771,16 @@ static int vxlan_newlink(struct net *src_net, struct net_device *dev,
 
 		dev->needed_headroom = lowerdev->hard_header_len +
 				       (use_ipv6 ? VXLAN6_HEADROOM : VXLAN_HEADROOM);
+
+		/* check is lower dev madcap capable? the madcap device
+		 * puts the outer headers under the vxlan header. */
+		if (get_madcap_ops (lowerdev)) {
+			vxlan->mcdev = lowerdev;
+			madcap_acquire_dev (lowerdev, dev);
+			if (madcap_enable)
+				dev->needed_headroom = madcap_vdev_headroom
+					(lowerdev, sizeof (struct vxlanhdr));
+		}
 	} else if (use_ipv6)
 		vxlan->flags |= VXLAN_F_IPV6;
 
@@ -8,12 +8,28 @@
 #include <linux/hash.h>
 #include <linux/rwlock.h>
 #include <linux/etherdevice.h>
+#include <linux/if_arp.h>
+#include <linux/seqlock.h>
+#include <linux/udp.h>
+#include <linux/ethtool.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include <net/net_namespace.h>
 #include <net/rtnetlink.h>
 #include <net/ip_tunnels.h>
+#include <net/route.h>
+#include <net/arp.h>
+#include <net/neighbour.h>
+#include <net/netevent.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/perf_event.h>
+#include <linux/timex.h>
+#include <asm/msr.h>
 
 #include <madcap.h>
+#include <madcap_trace.h>
 #include <raven.h>
 
 #ifndef DEBUG
@@ -40,16 +56,46 @@ MODULE_ALIAS_RTNL_LINK ("raven");
 
 static int drop_mode __read_mostly = 0;
 module_param_named (drop_mode, drop_mode, int, 0444);
-MODULE_PARM_DESC (drop_mode, "if 1, tx packet is dropped immediately.");
+MODULE_PARM_DESC (drop_mode, "if 1, tx packet is dropped immediately. "
+		  "default sink mode of new devices.");
+
+static int pmu_sample __read_mostly = 0;
+module_param_named (pmu_sample, pmu_sample, int, 0444);
+MODULE_PARM_DESC (pmu_sample, "read PMU counters at each madcap_stage "
+		  "tracepoint for 1 of pmu_sample packets. 0 disables.");
+
+static int capture_slots __read_mostly = 1024;
+module_param_named (capture_slots, capture_slots, int, 0444);
+MODULE_PARM_DESC (capture_slots, "number of slots of capture ring. "
+		  "0 disables sink mode capture.");
 
 static int madcap_enable __read_mostly = 0;
 module_param_named (madcap_enable, madcap_enable, int, 0444);
 MODULE_PARM_DESC (madcap_enable, "if 1, raven_proc_read returns TX path clock "
 		  "on madcap/raven offloaded version.");
 
+static int numqueues __read_mostly = 1;
+module_param_named (numqueues, numqueues, int, 0444);
+MODULE_PARM_DESC (numqueues, "default number of tx/rx queues. "
+		  "overridden by numtxqueues/numrxqueues of ip link.");
+
+static int legacy_txq __read_mostly = 0;
+module_param_named (legacy_txq, legacy_txq, int, 0444);
+MODULE_PARM_DESC (legacy_txq, "if 1, tx_queue_len 0 and LLTX as before. "
+		  "__dev_queue_xmit takes no qdisc and no tx lock shortcut.");
+
+static int stamp_latency __read_mostly = 0;
+module_param_named (stamp_latency, stamp_latency, int, 0444);
+MODULE_PARM_DESC (stamp_latency, "if 1, latency, loss and reordering are "
+		  "measured from netdevgen stamps. see raven-latency proc.");
+
 static u32 raven_salt __read_mostly;
 
 
+/* outer ethernet, ip and udp header */
+#define RAVEN_OUTER_HLEN_MAX	(ETH_HLEN + sizeof (struct iphdr) + \
+				 sizeof (struct udphdr))
+
 struct raven_table {
 	struct hlist_node	hlist;	/* raven_dev->raven_table[] */
 	struct rcu_head		rcu;
@@ -57,6 +103,21 @@ struct raven_table {
 	unsigned long		updated;	/* jiffies */
 
 	struct madcap_obj_entry	oe;
+
+	/* cached route, neighbour and outer headers to oe.dst.
+	 * filled by the slow path (raven_table_resolve), updated by
+	 * neighbour events, and invalidated by rt_genid change. */
+	spinlock_t		cache_lock;	/* cache writers */
+	seqcount_t		seq;		/* cache readers */
+	bool			valid;		/* mac is resolved */
+	int			genid;		/* rt_genid_ipv4 */
+	struct net_device	*odev;		/* output device */
+	__be32			saddr;		/* outer src address */
+	__be32			gateway;	/* next hop address */
+	u8			ttl;
+	u8			mac[ETH_ALEN];	/* next hop mac address */
+	unsigned int		hlen;
+	u8			hdr[RAVEN_OUTER_HLEN_MAX]; /* outer template */
 };
 
 struct raven_dev {
@@ -64,8 +125,6 @@ struct raven_dev {
 	struct rcu_head		rcu;
 	struct net_device	*dev;
 
-	struct net_device	*vdev;	/* overlay virtual device acquiring 
-					 * this raven device */
 	struct net_device	*pdev;	/* physicl device to xmit encapsulated
 					 * packet */
 
@@ -76,8 +135,146 @@ struct raven_dev {
 
 	struct madcap_obj_udp	 ou;	/* enable udp encap */
 	struct madcap_obj_config oc;	/* offset and length */
+
+	struct raven_queue_stats *txq_stats;	/* per tx queue */
+
+	u32			sink_mode;	/* enum raven_sink_mode */
+};
+
+/* per tx queue counters. updated under the tx queue lock, so they
+ * are exact unless legacy_txq (LLTX) is on. */
+struct raven_queue_stats {
+	u64			packets;
+	u64			bytes;
+	u64			drops;
+	struct u64_stats_sync	syncp;
+} ____cacheline_aligned_in_smp;
+
+
+/* per-cpu log2 histogram with linear sub buckets (HDR-lite). Each
+ * power of 2 is split into RAVEN_HIST_SUB buckets, so a reported
+ * value is within 1/RAVEN_HIST_SUB of the real one. */
+
+#define RAVEN_HIST_SUB_BITS	3
+#define RAVEN_HIST_SUB		(1 << RAVEN_HIST_SUB_BITS)
+#define RAVEN_HIST_MAX_BITS	32	/* larger values are clamped */
+#define RAVEN_HIST_BUCKETS	((RAVEN_HIST_MAX_BITS - RAVEN_HIST_SUB_BITS \
+				  + 1) * RAVEN_HIST_SUB)
+
+struct raven_hist_cpu {
+	u64	count[RAVEN_HIST_BUCKETS];
+	u64	sum;
+};
+
+struct raven_hist {
+	struct raven_hist_cpu __percpu	*cpu;
+};
+
+static inline unsigned int
+raven_hist_index (u64 v)
+{
+	unsigned int e;
+
+	if (v >= (1ULL << RAVEN_HIST_MAX_BITS))
+		v = (1ULL << RAVEN_HIST_MAX_BITS) - 1;
+
+	if (v < RAVEN_HIST_SUB)
+		return v;
+
+	e = fls64 (v) - 1;
+	return ((e - RAVEN_HIST_SUB_BITS + 1) << RAVEN_HIST_SUB_BITS) |
+		((v >> (e - RAVEN_HIST_SUB_BITS)) & (RAVEN_HIST_SUB - 1));
+}
+
+static inline u64
+raven_hist_value (unsigned int idx)
+{
+	/* upper bound of the bucket */
+	unsigned int e;
+
+	if (idx < RAVEN_HIST_SUB)
+		return idx;
+
+	e = (idx >> RAVEN_HIST_SUB_BITS) + RAVEN_HIST_SUB_BITS - 1;
+	return ((1ULL << e) |
+		((u64)(idx & (RAVEN_HIST_SUB - 1)) << (e - RAVEN_HIST_SUB_BITS)))
+		+ (1ULL << (e - RAVEN_HIST_SUB_BITS)) - 1;
+}
+
+static int
+raven_hist_alloc (struct raven_hist *hist)
+{
+	hist->cpu = alloc_percpu (struct raven_hist_cpu);
+	if (!hist->cpu)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void
+raven_hist_free (struct raven_hist *hist)
+{
+	free_percpu (hist->cpu);
+	hist->cpu = NULL;
+}
+
+static inline void
+raven_hist_add (struct raven_hist *hist, u64 v)
+{
+	this_cpu_inc (hist->cpu->count[raven_hist_index (v)]);
+	this_cpu_add (hist->cpu->sum, v);
+}
+
+static void
+raven_hist_reset (struct raven_hist *hist)
+{
+	/* racy against raven_hist_add on other cpus. a few samples
+	 * may survive, which does not matter for percentiles. */
+	int cpu;
+
+	for_each_possible_cpu (cpu)
+		memset (per_cpu_ptr (hist->cpu, cpu), 0,
+			sizeof (struct raven_hist_cpu));
+}
+
+struct raven_hist_summary {
+	u64	count, mean, p50, p99, p999;
 };
 
+static void
+raven_hist_summarize (struct raven_hist *hist, struct raven_hist_summary *hs)
+{
+	int cpu;
+	unsigned int n, q;
+	u64 sum = 0, acc = 0, rank[3];
+	u64 *pv[3] = { &hs->p50, &hs->p99, &hs->p999 };
+	static const unsigned int permil[3] = { 500, 990, 999 };
+	struct raven_hist_cpu *hc;
+
+	memset (hs, 0, sizeof (*hs));
+
+	for_each_possible_cpu (cpu) {
+		hc = per_cpu_ptr (hist->cpu, cpu);
+		for (n = 0; n < RAVEN_HIST_BUCKETS; n++)
+			hs->count += hc->count[n];
+		sum += hc->sum;
+	}
+
+	if (!hs->count)
+		return;
+
+	hs->mean = div64_u64 (sum, hs->count);
+	for (q = 0; q < 3; q++)
+		rank[q] = div64_u64 (hs->count * permil[q] + 999, 1000);
+
+	for (n = 0, q = 0; n < RAVEN_HIST_BUCKETS && q < 3; n++) {
+		for_each_possible_cpu (cpu)
+			acc += per_cpu_ptr (hist->cpu, cpu)->count[n];
+		while (q < 3 && acc >= rank[q])
+			*pv[q++] = raven_hist_value (n);
+	}
+}
+
 
 #ifdef OVBENCH
 #include <linux/ovbench.h>
@@ -392,6 +589,266 @@ static const struct file_operations raven_file_fops = {
 	.owner	= THIS_MODULE,
 	.read	= raven_proc_read,
 };
+
+
+/* per-stage latency histograms under sustained load. Each stage is
+ * a pair of ovbench timestamps in sk_buff, same as printed by
+ * raven_proc_read_madcap_{enabled|disabled}. */
+
+#define RAVEN_OVTYPE_NUM	7	/* OVTYPE_NOENCAP .. OVTYPE_NSH */
+#define RAVEN_STAGE_MAX		9
+
+struct raven_stage {
+	const char	*name;
+	size_t		start, end;	/* offset in struct sk_buff */
+};
+
+#define STAGE(n, s, e)	{ n, offsetof (struct sk_buff, s),	\
+			  offsetof (struct sk_buff, e) }
+
+struct raven_stage_type {
+	const char		*name;
+	struct raven_stage	stage[RAVEN_STAGE_MAX];
+};
+
+static const struct raven_stage_type raven_stages_disabled[RAVEN_OVTYPE_NUM] = {
+	[OVTYPE_NOENCAP] = { "noencap", {
+		STAGE ("inner-tx", ip_local_out_sk_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_IPIP] = { "ipip", {
+		STAGE ("inner-tx", ip_local_out_sk_in, ipip_tunnel_xmit_in),
+		STAGE ("protocol-path", ipip_tunnel_xmit_in, iptunnel_xmit_in),
+		STAGE ("routing-lookup", ip_routing_start, ip_routing_end),
+		STAGE ("build-outer-ip", iptunnel_xmit_in,
+		       ip_local_out_sk_in_encaped),
+		STAGE ("outer-tx", ip_local_out_sk_in_encaped, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_GRE] = { "gre", {
+		STAGE ("inner-tx", ip_local_out_sk_in, ipgre_xmit_in),
+		STAGE ("protocol-path", ipgre_xmit_in, iptunnel_xmit_in),
+		STAGE ("build-gre", gre_xmit_in, gre_encap_end),
+		STAGE ("routing-lookup", ip_routing_start, ip_routing_end),
+		STAGE ("build-outer-ip", iptunnel_xmit_in,
+		       ip_local_out_sk_in_encaped),
+		STAGE ("outer-tx", ip_local_out_sk_in_encaped, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_GRETAP] = { "gretap", {
+		STAGE ("inner-tx", ip_local_out_sk_in, gre_tap_xmit_in),
+		STAGE ("protocol-path", gre_tap_xmit_in, iptunnel_xmit_in),
+		STAGE ("build-gre", gre_xmit_in, gre_encap_end),
+		STAGE ("routing-lookup", ip_routing_start, ip_routing_end),
+		STAGE ("build-outer-ip", iptunnel_xmit_in,
+		       ip_local_out_sk_in_encaped),
+		STAGE ("outer-tx", ip_local_out_sk_in_encaped, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_VXLAN] = { "vxlan", {
+		STAGE ("inner-tx", ip_local_out_sk_in, vxlan_xmit_in),
+		STAGE ("protocol-path", vxlan_xmit_in, iptunnel_xmit_in),
+		STAGE ("routing-lookup", ip_routing_start, ip_routing_end),
+		STAGE ("build-vxlan", vxlan_xmit_skb_in,
+		       udp_tunnel_xmit_skb_in),
+		STAGE ("build-udp", udp_tunnel_xmit_skb_in, iptunnel_xmit_in),
+		STAGE ("build-outer-ip", iptunnel_xmit_in,
+		       ip_local_out_sk_in_encaped),
+		STAGE ("outer-tx", ip_local_out_sk_in_encaped, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_NSH] = { "nsh", {
+		STAGE ("inner-tx", ip_local_out_sk_in, nsh_xmit_in),
+		STAGE ("protocol-path", nsh_xmit_in, iptunnel_xmit_in),
+		STAGE ("build-nsh", nsh_xmit_lookup_end, nsh_xmit_vxlan_in),
+		STAGE ("routing-lookup", ip_routing_start, ip_routing_end),
+		STAGE ("build-vxlan", nsh_xmit_vxlan_skb_in,
+		       udp_tunnel_xmit_skb_in),
+		STAGE ("build-udp", udp_tunnel_xmit_skb_in, iptunnel_xmit_in),
+		STAGE ("build-outer-ip", iptunnel_xmit_in,
+		       ip_local_out_sk_in_encaped),
+		STAGE ("outer-tx", ip_local_out_sk_in_encaped, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+};
+
+static const struct raven_stage_type raven_stages_enabled[RAVEN_OVTYPE_NUM] = {
+	[OVTYPE_NOENCAP] = { "noencap", {
+		STAGE ("inner-tx", ip_local_out_sk_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_IPIP] = { "ipip", {
+		STAGE ("inner-tx", ip_local_out_sk_in, ipip_tunnel_xmit_in),
+		STAGE ("protocol-path", ipip_tunnel_xmit_in,
+		       dev_queue_xmit_in),
+		STAGE ("outer-tx", dev_queue_xmit_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_GRE] = { "gre", {
+		STAGE ("inner-tx", ip_local_out_sk_in, ipgre_xmit_in),
+		STAGE ("protocol-path", ipgre_xmit_in, dev_queue_xmit_in),
+		STAGE ("build-gre", gre_xmit_in, gre_encap_end),
+		STAGE ("outer-tx", dev_queue_xmit_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_GRETAP] = { "gretap", {
+		STAGE ("inner-tx", ip_local_out_sk_in, gre_tap_xmit_in),
+		STAGE ("protocol-path", gre_tap_xmit_in, dev_queue_xmit_in),
+		STAGE ("build-gre", gre_xmit_in, gre_encap_end),
+		STAGE ("outer-tx", dev_queue_xmit_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_VXLAN] = { "vxlan", {
+		STAGE ("inner-tx", ip_local_out_sk_in, vxlan_xmit_in),
+		STAGE ("protocol-path", vxlan_xmit_in, dev_queue_xmit_in),
+		STAGE ("build-vxlan", vxlan_xmit_skb_in, dev_queue_xmit_in),
+		STAGE ("outer-tx", dev_queue_xmit_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+	[OVTYPE_NSH] = { "nsh", {
+		STAGE ("inner-tx", ip_local_out_sk_in, nsh_xmit_in),
+		STAGE ("protocol-path", nsh_xmit_in, dev_queue_xmit_in),
+		STAGE ("build-nsh", nsh_xmit_lookup_end, nsh_xmit_vxlan_in),
+		STAGE ("build-vxlan", nsh_xmit_vxlan_in, dev_queue_xmit_in),
+		STAGE ("outer-tx", dev_queue_xmit_in, raven_xmit_in),
+		STAGE ("total-tx", ip_local_out_sk_in, raven_xmit_in),
+	} },
+};
+
+static const struct raven_stage_type *raven_stages;	/* by madcap_enable */
+static struct raven_hist raven_stage_hist[RAVEN_OVTYPE_NUM][RAVEN_STAGE_MAX];
+
+static inline u64
+raven_skb_ts (struct sk_buff *skb, size_t off)
+{
+	return *(u64 *)((u8 *) skb + off);
+}
+
+static void
+raven_stage_record (struct sk_buff *skb)
+{
+	/* called at the end of tx path, after raven_xmit_in is set.
+	 * Stages whose timestamps are not stamped are not counted,
+	 * instead of recording 0 like ts(). */
+	int n;
+	u64 start, end;
+	const struct raven_stage *st;
+
+	if (!SKB_OVBENCH (skb) || skb->ovbench_type >= RAVEN_OVTYPE_NUM)
+		return;
+
+	for (n = 0; n < RAVEN_STAGE_MAX; n++) {
+		st = &raven_stages[skb->ovbench_type].stage[n];
+		if (!st->name)
+			break;
+
+		start = raven_skb_ts (skb, st->start);
+		end = raven_skb_ts (skb, st->end);
+		if (!start || start > end)
+			continue;
+
+		raven_hist_add (&raven_stage_hist[skb->ovbench_type][n],
+				end - start);
+	}
+}
+
+static int
+raven_stage_hist_show (struct seq_file *m, void *v)
+{
+	int t, n;
+	struct raven_hist_summary hs;
+	const struct raven_stage *st;
+
+	seq_printf (m, "%-8s %-16s %12s %10s %10s %10s %10s\n",
+		    "encap", "stage", "count", "mean", "p50", "p99", "p999");
+
+	for (t = 0; t < RAVEN_OVTYPE_NUM; t++) {
+		for (n = 0; n < RAVEN_STAGE_MAX; n++) {
+			st = &raven_stages[t].stage[n];
+			if (!st->name)
+				break;
+
+			raven_hist_summarize (&raven_stage_hist[t][n], &hs);
+			if (!hs.count)
+				continue;
+
+			seq_printf (m, "%-8s %-16s %12llu %10llu %10llu "
+				    "%10llu %10llu\n",
+				    raven_stages[t].name, st->name, hs.count,
+				    hs.mean, hs.p50, hs.p99, hs.p999);
+		}
+	}
+
+	return 0;
+}
+
+static int
+raven_stage_hist_open (struct inode *inode, struct file *fp)
+{
+	return single_open (fp, raven_stage_hist_show, NULL);
+}
+
+static ssize_t
+raven_stage_hist_write (struct file *fp, const char __user *buf,
+			size_t size, loff_t *off)
+{
+	/* any write resets all histograms */
+	int t, n;
+
+	for (t = 0; t < RAVEN_OVTYPE_NUM; t++) {
+		for (n = 0; n < RAVEN_STAGE_MAX; n++) {
+			if (raven_stage_hist[t][n].cpu)
+				raven_hist_reset (&raven_stage_hist[t][n]);
+		}
+	}
+
+	return size;
+}
+
+static const struct file_operations raven_stage_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raven_stage_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= raven_stage_hist_write,
+};
+
+static void
+raven_stage_hist_exit (void)
+{
+	int t, n;
+
+	for (t = 0; t < RAVEN_OVTYPE_NUM; t++) {
+		for (n = 0; n < RAVEN_STAGE_MAX; n++) {
+			if (raven_stage_hist[t][n].cpu)
+				raven_hist_free (&raven_stage_hist[t][n]);
+		}
+	}
+}
+
+static int
+raven_stage_hist_init (void)
+{
+	int t, n;
+
+	raven_stages = madcap_enable ?
+		raven_stages_enabled : raven_stages_disabled;
+
+	/* allocate histograms only for defined stages */
+	for (t = 0; t < RAVEN_OVTYPE_NUM; t++) {
+		for (n = 0; n < RAVEN_STAGE_MAX; n++) {
+			if (!raven_stages[t].stage[n].name)
+				break;
+			if (raven_hist_alloc (&raven_stage_hist[t][n]) < 0) {
+				raven_stage_hist_exit ();
+				return -ENOMEM;
+			}
+		}
+	}
+
+	return 0;
+}
 #endif
 
 
@@ -423,6 +880,8 @@ raven_table_add (struct raven_dev *rdev, struct madcap_obj_entry *oe)
 	rt->dev = rdev->dev;
 	rt->updated = jiffies;
 	rt->oe = *oe;
+	spin_lock_init (&rt->cache_lock);
+	seqcount_init (&rt->seq);
 
 	hlist_add_head_rcu (&rt->hlist, raven_table_head (rdev, oe->id));
 
@@ -474,37 +933,158 @@ raven_table_find (struct raven_dev *rdev, u64 id)
 	return NULL;
 }
 
-static int
-raven_acquire_dev (struct net_device *dev, struct net_device *vdev)
+static void
+raven_table_build (struct raven_dev *rdev, struct raven_table *rt)
 {
-	struct raven_dev *rdev = netdev_priv (dev);
+	/* build outer header template. called in write_seqcount. */
+
+	u8 *p = rt->hdr;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	eth = (struct ethhdr *) p;
+	memcpy (eth->h_dest, rt->mac, ETH_ALEN);
+	memcpy (eth->h_source, rt->odev->dev_addr, ETH_ALEN);
+	eth->h_proto = htons (ETH_P_IP);
+	p += sizeof (*eth);
+
+	iph = (struct iphdr *) p;
+	iph->version	= 4;
+	iph->ihl	= sizeof (*iph) >> 2;
+	iph->tos	= 0;
+	iph->tot_len	= 0;	/* filled by raven_xmit_cached */
+	iph->id		= 0;
+	iph->frag_off	= 0;
+	iph->ttl	= rt->ttl;
+	iph->protocol	= rdev->oc.proto;
+	iph->check	= 0;
+	iph->saddr	= rt->saddr;
+	iph->daddr	= rt->oe.dst;
+	p += sizeof (*iph);
 
-	if (rdev->vdev) {
-		pr_debug ("%s: %s is already acquired by %s", __func__,
-			  dev->name, rdev->vdev->name);
-		return -EINVAL;
+	if (rdev->ou.encap_enable) {
+		uh = (struct udphdr *) p;
+		uh->source	= rdev->ou.src_port;
+		uh->dest	= rdev->ou.dst_port;
+		uh->len		= 0;	/* filled by raven_xmit_cached */
+		uh->check	= 0;	/* XXX: */
+		p += sizeof (*uh);
 	}
 
-	rdev->vdev = vdev;
-	/* XXX: start dev? cleanup dev? */
+	rt->hlen = p - rt->hdr;
+}
 
-	return 0;
+static void
+raven_table_resolve (struct raven_dev *rdev, struct raven_table *rt,
+		     struct rtable *irt, struct flowi4 *fl4)
+{
+	/* slow path. cache the route just looked up and its neighbour.
+	 * called from raven_xmit in rcu_read_lock_bh. */
+
+	struct net_device *odev;
+	struct neighbour *n;
+	__be32 gateway;
+
+	odev = rdev->pdev ? rdev->pdev : irt->dst.dev;
+	if (odev->type != ARPHRD_ETHER)
+		return;
+
+	gateway = rt_nexthop (irt, fl4->daddr);
+	n = __ipv4_neigh_lookup_noref (odev, (__force u32) gateway);
+
+	spin_lock (&rt->cache_lock);
+	write_seqcount_begin (&rt->seq);
+
+	rt->genid	= rt_genid_ipv4 (dev_net (rdev->dev));
+	rt->odev	= odev;
+	rt->saddr	= fl4->saddr;
+	rt->gateway	= gateway;
+	rt->ttl		= ip4_dst_hoplimit (&irt->dst);
+	rt->valid	= false;
+	if (n && (n->nud_state & NUD_VALID)) {
+		/* if not valid yet, neighbour event will fill mac. */
+		neigh_ha_snapshot (rt->mac, n, odev);
+		rt->valid = true;
+	}
+	raven_table_build (rdev, rt);
+
+	write_seqcount_end (&rt->seq);
+	spin_unlock (&rt->cache_lock);
 }
 
-static int
-raven_release_dev (struct net_device *dev, struct net_device *vdev)
+static void
+raven_table_invalidate (struct raven_dev *rdev)
 {
-	struct raven_dev *rdev = netdev_priv (dev);
+	unsigned int n;
+	struct raven_table *rt;
 
-	if (rdev->vdev != vdev)
-		return -EINVAL;
+	rcu_read_lock ();
+	for (n = 0; n < RAVEN_HASH_SIZE; n++) {
+		hlist_for_each_entry_rcu (rt, &rdev->raven_table[n], hlist) {
+			spin_lock_bh (&rt->cache_lock);
+			write_seqcount_begin (&rt->seq);
+			rt->valid = false;
+			rt->odev = NULL;
+			write_seqcount_end (&rt->seq);
+			spin_unlock_bh (&rt->cache_lock);
+		}
+	}
+	rcu_read_unlock ();
+}
 
-	rdev->vdev = NULL;
-	/* stop dev? */
+static void
+raven_neigh_update (struct neighbour *n)
+{
+	/* update cached mac of the table entries using this neighbour */
 
-	return 0;
+	unsigned int i;
+	__be32 gateway = *(__be32 *) n->primary_key;
+	struct raven_net *rnet = net_generic (dev_net (n->dev), raven_net_id);
+	struct raven_dev *rdev;
+	struct raven_table *rt;
+
+	rcu_read_lock ();
+	list_for_each_entry_rcu (rdev, &rnet->dev_list, list) {
+		for (i = 0; i < RAVEN_HASH_SIZE; i++) {
+			hlist_for_each_entry_rcu (rt, &rdev->raven_table[i],
+						  hlist) {
+				if (rt->odev != n->dev ||
+				    rt->gateway != gateway)
+					continue;
+
+				spin_lock_bh (&rt->cache_lock);
+				write_seqcount_begin (&rt->seq);
+				if (rt->odev == n->dev &&
+				    (n->nud_state & NUD_VALID)) {
+					neigh_ha_snapshot (rt->mac, n, n->dev);
+					rt->valid = true;
+					raven_table_build (rdev, rt);
+				} else
+					rt->valid = false;
+				write_seqcount_end (&rt->seq);
+				spin_unlock_bh (&rt->cache_lock);
+			}
+		}
+	}
+	rcu_read_unlock ();
+}
+
+static int
+raven_netevent (struct notifier_block *unused, unsigned long event, void *ptr)
+{
+	struct neighbour *n = ptr;
+
+	if (event == NETEVENT_NEIGH_UPDATE && n->tbl == &arp_tbl)
+		raven_neigh_update (n);
+
+	return NOTIFY_DONE;
 }
 
+static struct notifier_block raven_netevent_nb __read_mostly = {
+	.notifier_call = raven_netevent,
+};
+
 static int
 raven_llt_cfg (struct net_device *dev, struct madcap_obj *obj)
 {
@@ -598,6 +1178,10 @@ raven_udp_cfg (struct net_device *dev, struct madcap_obj *obj)
 	ou = MADCAP_OBJ_UDP (obj);
 
 	rdev->ou = *ou;
+
+	/* outer headers are changed. resolve again. */
+	raven_table_invalidate (rdev);
+
 	return 0;
 }
 
@@ -608,9 +1192,13 @@ raven_udp_config_get (struct net_device *dev)
 	return &rdev->ou.obj;
 }
 
+static int
+raven_get_headroom (struct net_device *dev)
+{
+	return RAVEN_OUTER_HLEN_MAX;
+}
+
 static struct madcap_ops raven_madcap_ops = {
-	.mco_acquire_dev	= raven_acquire_dev,
-	.mco_release_dev	= raven_release_dev,
 	.mco_llt_cfg		= raven_llt_cfg,
 	.mco_llt_config_get	= raven_llt_config_get,
 	.mco_llt_entry_add	= raven_llt_entry_add,
@@ -618,6 +1206,7 @@ static struct madcap_ops raven_madcap_ops = {
 	.mco_llt_entry_dump	= raven_llt_entry_dump,
 	.mco_udp_cfg		= raven_udp_cfg,
 	.mco_udp_config_get	= raven_udp_config_get,
+	.mco_get_headroom	= raven_get_headroom,
 };
 
 
@@ -636,108 +1225,1037 @@ extract_id_from_packet (struct sk_buff *skb, struct madcap_obj_config *oc)
 	return id;
 }
 
-static netdev_tx_t
-raven_xmit (struct sk_buff *skb, struct net_device *dev)
+/* mmap ring shared with userspace. see struct raven_ring_hdr. The
+ * header is writable by userspace, so the kernel keeps its own head,
+ * geometry and drops, and only publishes copies. Only tail is read
+ * from the header. */
+
+struct raven_ring {
+	spinlock_t		lock;	/* producers */
+	struct raven_ring_hdr	*hdr;	/* vmalloc_user */
+	void			*data;	/* first slot */
+	unsigned long		size;	/* size of mmaped area */
+	u32			slot_size;
+	u32			nslots;
+	u64			head;
+	u64			drops;
+};
+
+static unsigned long
+raven_ring_size (u32 slot_size, u32 nslots)
 {
-	/* As a dummy driver for measurement, raven device updates
-	 * counters and drops packet immediately.
-	 * 
-	 * ToDo:
-	 * emulate tonic device behavior in software layer.
-	 * - encapsulate packet in accordance with the locator-lookup-table.
-	 * - transmit encapsulated packet via physical NIC.
-	 * - Should I implement this to existing drivers for normal NIC?
-	 */
+	return PAGE_ALIGN (PAGE_ALIGN (sizeof (struct raven_ring_hdr)) +
+			   (unsigned long) slot_size * nslots);
+}
 
-	int err, headroom;
-	__u64 id;
-	struct raven_table *rt;
-	struct raven_dev *rdev = netdev_priv (dev);
-	struct pcpu_sw_netstats *tx_stats;
-	struct flowi4 fl4;
-	struct rtable *irt;
+static void
+raven_ring_init (struct raven_ring *ring, void *mem, u32 slot_size,
+		 u32 nslots)
+{
+	unsigned long offset = PAGE_ALIGN (sizeof (struct raven_ring_hdr));
+
+	spin_lock_init (&ring->lock);
+	ring->size = raven_ring_size (slot_size, nslots);
+	ring->slot_size = slot_size;
+	ring->nslots = nslots;
+	ring->head = 0;
+	ring->drops = 0;
+	ring->hdr = mem;
+	ring->hdr->slot_size	= slot_size;
+	ring->hdr->nslots	= nslots;
+	ring->hdr->data_offset	= offset;
+	ring->hdr->size		= ring->size;
+	ring->data = mem + offset;
+}
 
-#ifdef OVBENCH
-	skb->raven_xmit_in = rdtsc ();
-#endif
+static int
+raven_ring_alloc (struct raven_ring *ring, u32 slot_size, u32 nslots)
+{
+	void *mem;
 
-	if (drop_mode)
-		goto out;
+	mem = vmalloc_user (raven_ring_size (slot_size, nslots));
+	if (!mem)
+		return -ENOMEM;
 
-	skb_scrub_packet(skb, false);
+	raven_ring_init (ring, mem, slot_size, nslots);
 
-	/* find destination address */
-	id = extract_id_from_packet (skb, &rdev->oc);
-	rt = raven_table_find (rdev, id);
+	return 0;
+}
 
-	if (!rt) {
-		/* find default destination, id 0 */
-		rt = raven_table_find (rdev, 0);
-	}
-	if (!rt) {
-		pr_debug ("no dst entry for id %llu", id);
-		goto tx_err;
-	}
+static void
+raven_ring_free (struct raven_ring *ring)
+{
+	vfree (ring->hdr);
+	ring->hdr = NULL;
+}
 
-	/* rouitng lookup */
-	memset (&fl4, 0, sizeof (fl4));
-	fl4.daddr = rt->oe.dst;
-	fl4.saddr = rdev->oc.src;
-	irt = ip_route_output_key (dev_net (dev), &fl4);
-	if (IS_ERR (irt)) {
-		pr_debug ("%s, no route to %pI4", dev->name, &fl4.daddr);
-		kfree_skb (skb);
-		return -ENOMEM;
-	}
+static void *
+raven_ring_reserve (struct raven_ring *ring)
+{
+	/* returns next slot, or NULL if the ring is full.
+	 * called with ring->lock held. */
+	u64 tail = ACCESS_ONCE (ring->hdr->tail);
 
-	/* build udp header */
+	/* tail is written by userspace. it never passes head. */
+	if (tail > ring->head)
+		tail = ring->head;
 
-	headroom = rdev->ou.encap_enable ? 14 + 20 + 16 : 14 + 20;
-	err = skb_cow_head (skb, headroom);
-	if (unlikely (err)) {
-		kfree_skb (skb);
-		return -ENOMEM;
+	if (ring->head - tail >= ring->nslots) {
+		ring->hdr->drops = ++ring->drops;
+		return NULL;
 	}
 
-	if (rdev->ou.encap_enable) {
-		struct udphdr *uh;
-		uh = (struct udphdr *) __skb_push (skb, sizeof (*uh));
-		skb_reset_transport_header (skb);
+	return ring->data + (ring->head % ring->nslots) * ring->slot_size;
+}
 
-		uh->dest	= rdev->ou.dst_port;
-		uh->source	= rdev->ou.src_port;
-		uh->len		= htons (skb->len);
-		uh->check	= 0;	/* XXX: */
-	}
+static void
+raven_ring_commit (struct raven_ring *ring)
+{
+	/* slot is written before head is advanced */
+	smp_wmb ();
+	ring->hdr->head = ++ring->head;
+}
 
-	err = iptunnel_xmit (skb->sk, irt, skb, fl4.saddr, fl4.daddr,
-			     rdev->oc.proto, 0, 16, 0, false);
-	if (err < 0)
-		goto tx_err;
+static int
+raven_ring_mmap (struct raven_ring *ring, struct vm_area_struct *vma)
+{
+	if (!ring->hdr)
+		return -ENODEV;
 
-out:
-	tx_stats = this_cpu_ptr (dev->tstats);
-	u64_stats_update_begin (&tx_stats->syncp);
-	tx_stats->tx_packets++;
-	tx_stats->tx_bytes += skb->len;
-	u64_stats_update_end (&tx_stats->syncp);
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
 
-	if (drop_mode) {
-#ifdef OVBENCH
-		if (0 < skb->ovbench_type && skb->ovbench_type < 7) {
-			copy_ovbench_params (skb, rdev);
-		}
-#endif
+	return remap_vmalloc_range (vma, ring->hdr, 0);
+}
 
-		kfree_skb (skb);
+/* per-cpu rings in a mmaped area. a ring is written only by its cpu
+ * with BH disabled, so ring->lock is not used. */
+
+struct raven_ring_set {
+	struct raven_ring __percpu	*rings;
+	void				*area;	/* vmalloc_user */
+	unsigned long			size;	/* size of area */
+};
+
+static int
+raven_ring_set_alloc (struct raven_ring_set *rs, u32 slot_size, u32 nslots)
+{
+	int cpu;
+	unsigned long size = raven_ring_size (slot_size, nslots);
+
+	rs->rings = alloc_percpu (struct raven_ring);
+	if (!rs->rings)
+		return -ENOMEM;
+
+	rs->size = size * nr_cpu_ids;
+	rs->area = vmalloc_user (rs->size);
+	if (!rs->area) {
+		free_percpu (rs->rings);
+		rs->rings = NULL;
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu (cpu)
+		raven_ring_init (per_cpu_ptr (rs->rings, cpu),
+				 rs->area + size * cpu, slot_size, nslots);
+
+	return 0;
+}
+
+static void
+raven_ring_set_free (struct raven_ring_set *rs)
+{
+	vfree (rs->area);
+	free_percpu (rs->rings);
+	rs->area = NULL;
+	rs->rings = NULL;
+}
+
+static int
+raven_ring_set_mmap (struct raven_ring_set *rs, struct vm_area_struct *vma)
+{
+	if (!rs->area)
+		return -ENODEV;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > rs->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range (vma, rs->area, 0);
+}
+
+
+/* capture sink */
+
+#define RAVEN_CAPTURE_SLOT_SIZE	2048
+
+static struct raven_ring capture_ring;
+
+static void
+raven_sink_capture (struct raven_dev *rdev, struct sk_buff *skb)
+{
+	unsigned int caplen;
+	struct raven_capture_slot *slot;
+
+	caplen = min_t (unsigned int, skb->len,
+			RAVEN_CAPTURE_SLOT_SIZE - sizeof (*slot));
+
+	spin_lock (&capture_ring.lock);
+	slot = raven_ring_reserve (&capture_ring);
+	if (slot) {
+		slot->caplen	= caplen;
+		slot->len	= skb->len;
+		slot->tstamp	= ktime_get_ns ();
+		slot->ifindex	= rdev->dev->ifindex;
+		skb_copy_bits (skb, 0, slot->data, caplen);
+		raven_ring_commit (&capture_ring);
+	}
+	spin_unlock (&capture_ring.lock);
+
+	consume_skb (skb);
+}
+
+static ssize_t
+raven_capture_proc_read (struct file *fp, char __user *buf, size_t size,
+			 loff_t *off)
+{
+	char line[256];
+	struct raven_ring *ring = &capture_ring;
+
+	snprintf (line, sizeof (line),
+		  "slot-size:  %u\n"
+		  "slots:      %u\n"
+		  "head:       %llu\n"
+		  "tail:       %llu\n"
+		  "drops:      %llu\n",
+		  ring->slot_size, ring->nslots,
+		  ring->head, ACCESS_ONCE (ring->hdr->tail), ring->drops);
+
+	return simple_read_from_buffer (buf, size, off, line, strlen (line));
+}
+
+static int
+raven_capture_proc_mmap (struct file *fp, struct vm_area_struct *vma)
+{
+	return raven_ring_mmap (&capture_ring, vma);
+}
+
+static const struct file_operations raven_capture_fops = {
+	.owner	= THIS_MODULE,
+	.read	= raven_capture_proc_read,
+	.mmap	= raven_capture_proc_mmap,
+};
+
+
+#ifdef OVBENCH
+/* per-packet stage timestamp records */
+
+static int record_slots __read_mostly = 4096;
+module_param_named (record_slots, record_slots, int, 0444);
+MODULE_PARM_DESC (record_slots, "number of slots of per-cpu record ring. "
+		  "0 disables records.");
+
+static struct raven_ring_set record_rings;
+
+static void
+raven_record (struct sk_buff *skb)
+{
+	struct raven_ring *ring;
+	struct raven_record *rec;
+
+	if (!record_rings.area || !SKB_OVBENCH (skb))
+		return;
+
+	ring = this_cpu_ptr (record_rings.rings);
+	rec = raven_ring_reserve (ring);
+	if (!rec)
+		return;
+
+	rec->type	= skb->ovbench_type;
+	rec->encaped	= skb->ovbench_encaped;
+	rec->queue	= skb_get_queue_mapping (skb);
+	rec->cpu	= smp_processor_id ();
+	rec->nstamps	= OVBENCH_TIMESTAMPNUM;
+	memcpy (rec->stamp, skb->ovbench_timestamp,
+		sizeof (rec->stamp[0]) * OVBENCH_TIMESTAMPNUM);
+
+	raven_ring_commit (ring);
+}
+
+static int
+raven_record_proc_show (struct seq_file *m, void *v)
+{
+	int cpu;
+	struct raven_ring *ring;
+
+	seq_printf (m, "%-4s %16s %16s %16s\n", "cpu", "head", "tail",
+		    "drops");
+
+	for_each_possible_cpu (cpu) {
+		ring = per_cpu_ptr (record_rings.rings, cpu);
+		seq_printf (m, "%-4d %16llu %16llu %16llu\n", cpu,
+			    ring->head, ACCESS_ONCE (ring->hdr->tail),
+			    ring->drops);
+	}
+
+	return 0;
+}
+
+static int
+raven_record_proc_open (struct inode *inode, struct file *fp)
+{
+	return single_open (fp, raven_record_proc_show, NULL);
+}
+
+static int
+raven_record_proc_mmap (struct file *fp, struct vm_area_struct *vma)
+{
+	return raven_ring_set_mmap (&record_rings, vma);
+}
+
+static const struct file_operations raven_record_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raven_record_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.mmap		= raven_record_proc_mmap,
+};
+#endif
+
+
+/* PMU counters per stage. raven probes madcap_stage tracepoint, and
+ * reads per-cpu pinned perf events with rdpmc at each stage of a
+ * sampled packet. The delta from the previous stage is accounted to
+ * the stage, per protocol. */
+
+enum {
+	RAVEN_PMU_CYCLES,
+	RAVEN_PMU_INSTRUCTIONS,
+	RAVEN_PMU_LLC_MISSES,
+	RAVEN_PMU_BRANCH_MISSES,
+	RAVEN_PMU_NUM
+};
+
+#define RAVEN_PMU_MASK		((1ULL << 48) - 1)	/* counter width */
+#define RAVEN_PMU_STAGE_NUM	(MADCAP_STAGE_SFMC_ENCAP + 1)
+
+static const char *raven_pmu_event_name[RAVEN_PMU_NUM] = {
+	[RAVEN_PMU_CYCLES]		= "cycles",
+	[RAVEN_PMU_INSTRUCTIONS]	= "instructions",
+	[RAVEN_PMU_LLC_MISSES]		= "llc-misses",
+	[RAVEN_PMU_BRANCH_MISSES]	= "branch-misses",
+};
+
+static const u64 raven_pmu_event_config[RAVEN_PMU_NUM] = {
+	[RAVEN_PMU_CYCLES]		= PERF_COUNT_HW_CPU_CYCLES,
+	[RAVEN_PMU_INSTRUCTIONS]	= PERF_COUNT_HW_INSTRUCTIONS,
+	[RAVEN_PMU_LLC_MISSES]		= PERF_COUNT_HW_CACHE_MISSES,
+	[RAVEN_PMU_BRANCH_MISSES]	= PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/* same as show_madcap_stage in madcap_trace.h */
+static const char *raven_pmu_stage_name[RAVEN_PMU_STAGE_NUM] = {
+	[MADCAP_STAGE_GEN_XMIT]		= "gen-xmit",
+	[MADCAP_STAGE_PROTO_XMIT]	= "proto-xmit",
+	[MADCAP_STAGE_PROTO_LOOKUP]	= "proto-lookup",
+	[MADCAP_STAGE_ROUTE_START]	= "route-start",
+	[MADCAP_STAGE_ROUTE_END]	= "route-end",
+	[MADCAP_STAGE_BUILD_START]	= "build-start",
+	[MADCAP_STAGE_BUILD_END]	= "build-end",
+	[MADCAP_STAGE_TUNNEL_XMIT]	= "tunnel-xmit",
+	[MADCAP_STAGE_MADCAP_XMIT]	= "madcap-xmit",
+	[MADCAP_STAGE_RAVEN_XMIT]	= "raven-xmit",
+	[MADCAP_STAGE_SFMC_ENCAP]	= "sfmc-encap",
+};
+
+/* protocols are identified by rtnl_link_ops kind of the device at
+ * proto-xmit stage. index 0 is for no encapsulation. */
+static const char *raven_pmu_proto_name[] = {
+	"noencap", "ipip", "gre", "gretap", "vxlan", "nsh",
+};
+#define RAVEN_PMU_PROTO_NUM	ARRAY_SIZE (raven_pmu_proto_name)
+
+struct raven_pmu_stat {
+	u64	samples;
+	u64	val[RAVEN_PMU_NUM];
+};
+
+struct raven_pmu_cpu {
+	struct perf_event	*event[RAVEN_PMU_NUM];
+
+	const struct sk_buff	*skb;	/* sampled packet */
+	unsigned int		proto;
+	unsigned int		count;	/* packets since last sample */
+	u64			last[RAVEN_PMU_NUM];
+
+	struct raven_pmu_stat	stat[RAVEN_PMU_PROTO_NUM][RAVEN_PMU_STAGE_NUM];
+};
+
+static struct raven_pmu_cpu __percpu *raven_pmu;
+
+static inline void
+raven_pmu_read (struct raven_pmu_cpu *pc, u64 *val)
+{
+	int n;
+	struct perf_event *event;
+
+	for (n = 0; n < RAVEN_PMU_NUM; n++) {
+		event = pc->event[n];
+		if (event && event->state == PERF_EVENT_STATE_ACTIVE)
+			rdpmcl (event->hw.event_base_rdpmc, val[n]);
+		else
+			val[n] = 0;
+	}
+}
+
+static unsigned int
+raven_pmu_proto (struct net_device *dev)
+{
+	unsigned int n;
+
+	if (!dev || !dev->rtnl_link_ops)
+		return 0;
+
+	for (n = 1; n < RAVEN_PMU_PROTO_NUM; n++) {
+		if (strcmp (dev->rtnl_link_ops->kind,
+			    raven_pmu_proto_name[n]) == 0)
+			return n;
+	}
+
+	return 0;
+}
+
+static void
+raven_pmu_probe (void *data, struct sk_buff *skb, int stage)
+{
+	/* called with preemption disabled from tracepoint */
+	int n;
+	u64 now[RAVEN_PMU_NUM];
+	struct raven_pmu_stat *ps;
+	struct raven_pmu_cpu *pc = this_cpu_ptr (raven_pmu);
+
+	if (stage == MADCAP_STAGE_GEN_XMIT ||
+	    (stage == MADCAP_STAGE_PROTO_XMIT && pc->skb != skb)) {
+		/* a packet enters tx path. proto-xmit starts a sample
+		 * when packets are not from netdevgen. */
+		pc->skb = NULL;
+		if (++pc->count < pmu_sample)
+			return;
+
+		pc->count = 0;
+		pc->skb = skb;
+		pc->proto = stage == MADCAP_STAGE_PROTO_XMIT ?
+			raven_pmu_proto (skb->dev) : 0;
+		raven_pmu_read (pc, pc->last);
+		return;
+	}
+
+	if (pc->skb != skb || stage >= RAVEN_PMU_STAGE_NUM)
+		return;
+
+	raven_pmu_read (pc, now);
+
+	if (stage == MADCAP_STAGE_PROTO_XMIT)
+		pc->proto = raven_pmu_proto (skb->dev);
+
+	ps = &pc->stat[pc->proto][stage];
+	ps->samples++;
+	for (n = 0; n < RAVEN_PMU_NUM; n++) {
+		ps->val[n] += (now[n] - pc->last[n]) & RAVEN_PMU_MASK;
+		pc->last[n] = now[n];
+	}
+
+	/* end of tx path */
+	if (stage == MADCAP_STAGE_RAVEN_XMIT ||
+	    stage == MADCAP_STAGE_SFMC_ENCAP)
+		pc->skb = NULL;
+}
+
+static int
+raven_pmu_proc_show (struct seq_file *m, void *v)
+{
+	int cpu, n;
+	unsigned int p, s;
+	u64 avg;
+	struct raven_pmu_stat sum, *ps;
+
+	seq_printf (m, "%-8s %-14s %10s", "encap", "stage", "samples");
+	for (n = 0; n < RAVEN_PMU_NUM; n++)
+		seq_printf (m, " %14s", raven_pmu_event_name[n]);
+	seq_printf (m, "\n");
+
+	for (p = 0; p < RAVEN_PMU_PROTO_NUM; p++) {
+		for (s = 0; s < RAVEN_PMU_STAGE_NUM; s++) {
+			memset (&sum, 0, sizeof (sum));
+			for_each_possible_cpu (cpu) {
+				ps = &per_cpu_ptr (raven_pmu, cpu)->stat[p][s];
+				sum.samples += ps->samples;
+				for (n = 0; n < RAVEN_PMU_NUM; n++)
+					sum.val[n] += ps->val[n];
+			}
+
+			if (!sum.samples)
+				continue;
+
+			/* averages per packet, with 2 decimal places */
+			seq_printf (m, "%-8s %-14s %10llu",
+				    raven_pmu_proto_name[p],
+				    raven_pmu_stage_name[s], sum.samples);
+			for (n = 0; n < RAVEN_PMU_NUM; n++) {
+				avg = div64_u64 (sum.val[n] * 100, sum.samples);
+				seq_printf (m, " %11llu.%02llu",
+					    div64_u64 (avg, 100), avg % 100);
+			}
+			seq_printf (m, "\n");
+		}
+	}
+
+	return 0;
+}
+
+static int
+raven_pmu_proc_open (struct inode *inode, struct file *fp)
+{
+	return single_open (fp, raven_pmu_proc_show, NULL);
+}
+
+static ssize_t
+raven_pmu_proc_write (struct file *fp, const char __user *buf,
+		      size_t size, loff_t *off)
+{
+	/* any write resets counters */
+	int cpu;
+	struct raven_pmu_cpu *pc;
+
+	for_each_possible_cpu (cpu) {
+		pc = per_cpu_ptr (raven_pmu, cpu);
+		memset (pc->stat, 0, sizeof (pc->stat));
+	}
+
+	return size;
+}
+
+static const struct file_operations raven_pmu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raven_pmu_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= raven_pmu_proc_write,
+};
+
+static void
+raven_pmu_release (void)
+{
+	int cpu, n;
+	struct raven_pmu_cpu *pc;
+
+	for_each_possible_cpu (cpu) {
+		pc = per_cpu_ptr (raven_pmu, cpu);
+		for (n = 0; n < RAVEN_PMU_NUM; n++) {
+			if (pc->event[n])
+				perf_event_release_kernel (pc->event[n]);
+		}
+	}
+
+	free_percpu (raven_pmu);
+	raven_pmu = NULL;
+}
+
+static void
+raven_pmu_exit (void)
+{
+	unregister_trace_madcap_stage (raven_pmu_probe, NULL);
+	tracepoint_synchronize_unregister ();
+	raven_pmu_release ();
+}
+
+static int
+raven_pmu_init (void)
+{
+	int cpu, n, rc;
+	struct perf_event *event;
+	struct perf_event_attr attr;
+
+	raven_pmu = alloc_percpu (struct raven_pmu_cpu);
+	if (!raven_pmu)
+		return -ENOMEM;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.type	= PERF_TYPE_HARDWARE;
+	attr.size	= sizeof (attr);
+	attr.pinned	= 1;
+
+	get_online_cpus ();
+	for_each_online_cpu (cpu) {
+		for (n = 0; n < RAVEN_PMU_NUM; n++) {
+			attr.config = raven_pmu_event_config[n];
+			event = perf_event_create_kernel_counter (&attr, cpu,
+								  NULL, NULL,
+								  NULL);
+			if (IS_ERR (event)) {
+				/* the counter is read as 0 */
+				pr_info ("failed to create %s counter on "
+					 "cpu %d", raven_pmu_event_name[n],
+					 cpu);
+				continue;
+			}
+			per_cpu_ptr (raven_pmu, cpu)->event[n] = event;
+		}
+	}
+	put_online_cpus ();
+
+	rc = register_trace_madcap_stage (raven_pmu_probe, NULL);
+	if (rc < 0) {
+		raven_pmu_release ();
+		return rc;
+	}
+
+	return 0;
+}
+
+
+/* latency stamps from netdevgen. the last bytes of a sampled packet
+ * carry struct raven_stamp. one-way latency goes to a histogram, and
+ * the sequence number of each generator thread gives loss and
+ * reordering. get_cycles () of the generator and raven must be the
+ * same clock, i.e., synchronized TSC on a single host. */
+
+#define LATENCY_PROC_NAME	"driver/raven-latency"
+#define RAVEN_STAMP_WINDOW	(1 << 20)	/* larger gap is a new run */
+
+struct raven_latency_thread {
+	spinlock_t	lock;
+	bool		valid;
+	u32		next;		/* expected seq */
+	u64		received;
+	u64		lost;
+	u64		reordered;
+} ____cacheline_aligned_in_smp;
+
+static struct raven_hist raven_latency_hist;
+static struct raven_latency_thread raven_latency_thread[RAVEN_STAMP_THREADS];
+
+static void
+raven_latency_seq (struct raven_latency_thread *lt, u32 seq)
+{
+	s32 gap;
+
+	spin_lock (&lt->lock);
+
+	gap = seq - lt->next;
+	if (!lt->valid || gap >= RAVEN_STAMP_WINDOW ||
+	    gap <= -RAVEN_STAMP_WINDOW) {
+		/* first stamp, or netdevgen restarted */
+		lt->valid = true;
+		lt->received = 0;
+		lt->lost = 0;
+		lt->reordered = 0;
+		gap = 0;
+	}
+
+	lt->received++;
+
+	if (gap >= 0) {
+		/* in order, or skipped seqs are lost so far */
+		lt->lost += gap;
+		lt->next = seq + 1;
+	} else {
+		/* a late one, which was counted as lost */
+		lt->reordered++;
+		if (lt->lost)
+			lt->lost--;
+	}
+
+	spin_unlock (&lt->lock);
+}
+
+static void
+raven_latency_record (struct sk_buff *skb)
+{
+	cycles_t now = get_cycles ();
+	struct raven_stamp *st, _st;
+	u16 thread;
+	u64 tsc;
+
+	if (skb->len < sizeof (_st))
+		return;
+
+	st = skb_header_pointer (skb, skb->len - sizeof (_st),
+				 sizeof (_st), &_st);
+	if (!st || st->magic != htons (RAVEN_STAMP_MAGIC))
+		return;
+
+	thread = st->thread;
+	if (thread >= RAVEN_STAMP_THREADS)
+		return;
+
+	tsc = st->tsc;
+	if ((u64) now > tsc)
+		raven_hist_add (&raven_latency_hist, (u64) now - tsc);
+
+	raven_latency_seq (&raven_latency_thread[thread], st->seq);
+}
+
+static int
+raven_latency_proc_show (struct seq_file *m, void *v)
+{
+	int n;
+	u64 received, lost, reordered;
+	struct raven_hist_summary hs;
+	struct raven_latency_thread *lt;
+
+	raven_hist_summarize (&raven_latency_hist, &hs);
+
+	seq_printf (m, "%12s %10s %10s %10s %10s\n",
+		    "count", "mean", "p50", "p99", "p999");
+	seq_printf (m, "%12llu %10llu %10llu %10llu %10llu\n",
+		    hs.count, hs.mean, hs.p50, hs.p99, hs.p999);
+
+	seq_printf (m, "\n%-6s %12s %12s %12s\n",
+		    "thread", "received", "lost", "reordered");
+
+	for (n = 0; n < RAVEN_STAMP_THREADS; n++) {
+		lt = &raven_latency_thread[n];
+
+		spin_lock_bh (&lt->lock);
+		received = lt->received;
+		lost = lt->lost;
+		reordered = lt->reordered;
+		spin_unlock_bh (&lt->lock);
+
+		if (!received)
+			continue;
+
+		seq_printf (m, "%-6d %12llu %12llu %12llu\n",
+			    n, received, lost, reordered);
+	}
+
+	return 0;
+}
+
+static int
+raven_latency_proc_open (struct inode *inode, struct file *fp)
+{
+	return single_open (fp, raven_latency_proc_show, NULL);
+}
+
+static ssize_t
+raven_latency_proc_write (struct file *fp, const char __user *buf,
+			  size_t size, loff_t *off)
+{
+	/* any write resets the histogram and sequence states */
+	int n;
+	struct raven_latency_thread *lt;
+
+	raven_hist_reset (&raven_latency_hist);
+
+	for (n = 0; n < RAVEN_STAMP_THREADS; n++) {
+		lt = &raven_latency_thread[n];
+		spin_lock_bh (&lt->lock);
+		lt->valid = false;
+		lt->received = 0;
+		lt->lost = 0;
+		lt->reordered = 0;
+		spin_unlock_bh (&lt->lock);
+	}
+
+	return size;
+}
+
+static const struct file_operations raven_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= raven_latency_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= raven_latency_proc_write,
+};
+
+static int
+raven_latency_init (void)
+{
+	int n, rc;
+
+	for (n = 0; n < RAVEN_STAMP_THREADS; n++)
+		spin_lock_init (&raven_latency_thread[n].lock);
+
+	rc = raven_hist_alloc (&raven_latency_hist);
+	if (rc < 0)
+		return rc;
+
+	if (!proc_create (LATENCY_PROC_NAME, S_IRUGO | S_IWUSR, NULL,
+			  &raven_latency_fops)) {
+		raven_hist_free (&raven_latency_hist);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void
+raven_latency_exit (void)
+{
+	remove_proc_entry (LATENCY_PROC_NAME, NULL);
+	raven_hist_free (&raven_latency_hist);
+}
+
+
+/* loopback sink */
+
+static void
+raven_sink_loopback (struct raven_dev *rdev, struct sk_buff *skb)
+{
+	/* reflect the encapsulated frame to the rx path, so that the
+	 * decapsulation path can be measured on a single host. */
+
+	struct net_device *rxdev = rdev->pdev ? rdev->pdev : rdev->dev;
+	struct pcpu_sw_netstats *stats;
+
+	memcpy (eth_hdr (skb)->h_dest, rxdev->dev_addr, ETH_ALEN);
+	skb->protocol = eth_type_trans (skb, rxdev);
+	skb_record_rx_queue (skb, skb_get_queue_mapping (skb) %
+			     rxdev->real_num_rx_queues);
+
+	if (rxdev == rdev->dev) {
+		stats = this_cpu_ptr (rdev->dev->tstats);
+		u64_stats_update_begin (&stats->syncp);
+		stats->rx_packets++;
+		stats->rx_bytes += skb->len;
+		u64_stats_update_end (&stats->syncp);
+	}
+
+	netif_rx (skb);
+}
+
+static int
+raven_encap_cached (struct raven_dev *rdev, struct raven_table *rt,
+		    struct sk_buff *skb, bool forward,
+		    struct net_device **odevp)
+{
+	/* fast path. push cached outer headers, and return the output
+	 * device. The caller transmits the packet to it directly,
+	 * without routing lookup and IP output path, as madcap NIC
+	 * does. Other than forward, neighbour need not be resolved. */
+
+	bool valid;
+	int genid;
+	unsigned int seq, hlen;
+	u8 hdr[RAVEN_OUTER_HLEN_MAX];
+	struct net_device *odev;
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	if (forward && skb_is_gso (skb))
+		return -EAGAIN;	/* GSO needs tunnel offload */
+
+	do {
+		seq = read_seqcount_begin (&rt->seq);
+		valid = rt->valid;
+		genid = rt->genid;
+		odev = rt->odev;
+		hlen = rt->hlen;
+		memcpy (hdr, rt->hdr, hlen);
+	} while (read_seqcount_retry (&rt->seq, seq));
+
+	if (!odev || (forward && !valid) ||
+	    genid != rt_genid_ipv4 (dev_net (rdev->dev)))
+		return -EAGAIN;	/* route or neighbour is changed */
+
+	/* hlen includes the link layer header of odev */
+	if (unlikely (madcap_skb_cow_head (skb, rdev->dev,
+					   hlen + odev->needed_headroom)))
+		return -ENOMEM;
+
+	memcpy (__skb_push (skb, hlen), hdr, hlen);
+	skb_reset_mac_header (skb);
+	skb_set_network_header (skb, ETH_HLEN);
+
+	if (rdev->ou.encap_enable) {
+		skb_set_transport_header (skb, ETH_HLEN + sizeof (*iph));
+		uh = udp_hdr (skb);
+		uh->len = htons (skb->len - ETH_HLEN - sizeof (*iph));
+	}
+
+	iph = ip_hdr (skb);
+	iph->tot_len = htons (skb->len - ETH_HLEN);
+	ip_send_check (iph);
+
+	skb->protocol = htons (ETH_P_IP);
+	*odevp = odev;
+
+	/* encapsulated. the outer packet is not for madcap device */
+	madcap_skb_unmark (skb);
+
+	return 0;
+}
+
+static netdev_tx_t
+raven_xmit (struct sk_buff *skb, struct net_device *dev)
+{
+	/* As a dummy driver for measurement, raven device updates
+	 * counters and drops packet immediately in sink mode drop.
+	 *
+	 * Otherwise, raven emulates tonic device behavior in software
+	 * layer. The packet is encapsulated in accordance with the
+	 * locator-lookup-table, and transmitted via physical NIC.
+	 * Route, neighbour and outer headers are cached on the table
+	 * entry. Packets go through ip_route_output_key and
+	 * iptunnel_xmit only when the cache is not valid.
+	 */
+
+	int err, headroom;
+	unsigned int len;
+	u32 sink;
+	__u64 id;
+	struct raven_table *rt;
+	struct raven_dev *rdev = netdev_priv (dev);
+	struct net_device *odev;
+	struct raven_queue_stats *txq_stats;
+	struct pcpu_sw_netstats *tx_stats;
+	struct flowi4 fl4;
+	struct rtable *irt;
+
+#ifdef OVBENCH
+	skb->raven_xmit_in = rdtsc ();
+	raven_stage_record (skb);
+	raven_record (skb);
+#endif
+	trace_madcap_stage (skb, MADCAP_STAGE_RAVEN_XMIT);
+
+	if (raven_latency_hist.cpu)
+		raven_latency_record (skb);
+
+	len = skb->len;
+	txq_stats = &rdev->txq_stats[skb_get_queue_mapping (skb)];
+	sink = ACCESS_ONCE (rdev->sink_mode);
+
+	if (sink == RAVEN_SINK_DROP)
+		goto out;
+
+	skb_scrub_packet(skb, false);
+
+	/* find destination address. the id is attached by the
+	 * protocol driver, or extracted from the packet. */
+	if (!madcap_skb_get_id (skb, &id))
+		id = extract_id_from_packet (skb, &rdev->oc);
+	rt = raven_table_find (rdev, id);
+
+	if (!rt) {
+		/* find default destination, id 0 */
+		rt = raven_table_find (rdev, 0);
+	}
+	if (!rt)
+		goto tx_drop;
+
+	/* fast path */
+	err = raven_encap_cached (rdev, rt, skb, sink == RAVEN_SINK_FORWARD,
+				  &odev);
+	if (err == -EAGAIN && sink != RAVEN_SINK_FORWARD) {
+		/* loopback and capture need only route, not neighbour */
+		memset (&fl4, 0, sizeof (fl4));
+		fl4.daddr = rt->oe.dst;
+		fl4.saddr = rdev->oc.src;
+		irt = ip_route_output_key (dev_net (dev), &fl4);
+		if (IS_ERR (irt))
+			goto tx_drop;
+		raven_table_resolve (rdev, rt, irt, &fl4);
+		ip_rt_put (irt);
+
+		err = raven_encap_cached (rdev, rt, skb, false, &odev);
+	}
+
+	if (err == 0) {
+		switch (sink) {
+		case RAVEN_SINK_LOOPBACK:
+			raven_sink_loopback (rdev, skb);
+			break;
+		case RAVEN_SINK_CAPTURE:
+			raven_sink_capture (rdev, skb);
+			break;
+		default:
+			skb->dev = odev;
+			dev_queue_xmit (skb);
+			break;
+		}
+		goto out;
+	}
+	if (err != -EAGAIN || sink != RAVEN_SINK_FORWARD)
+		goto tx_drop;
+
+	/* slow path. rouitng lookup */
+	memset (&fl4, 0, sizeof (fl4));
+	fl4.daddr = rt->oe.dst;
+	fl4.saddr = rdev->oc.src;
+	irt = ip_route_output_key (dev_net (dev), &fl4);
+	if (IS_ERR (irt))
+		goto tx_drop;
+
+	raven_table_resolve (rdev, rt, irt, &fl4);
+
+	/* build udp header */
+
+	headroom = rdev->ou.encap_enable ? 14 + 20 + 16 : 14 + 20;
+	err = madcap_skb_cow_head (skb, dev, headroom);
+	if (unlikely (err)) {
+		ip_rt_put (irt);
+		goto tx_drop;
+	}
+
+	if (rdev->ou.encap_enable) {
+		struct udphdr *uh;
+		uh = (struct udphdr *) __skb_push (skb, sizeof (*uh));
+		skb_reset_transport_header (skb);
+
+		uh->dest	= rdev->ou.dst_port;
+		uh->source	= rdev->ou.src_port;
+		uh->len		= htons (skb->len);
+		uh->check	= 0;	/* XXX: */
+	}
+
+	madcap_skb_unmark (skb);
+	err = iptunnel_xmit (skb->sk, irt, skb, fl4.saddr, fl4.daddr,
+			     rdev->oc.proto, 0, 16, 0, false);
+	if (err < 0)
+		goto tx_err;
+
+out:
+	tx_stats = this_cpu_ptr (dev->tstats);
+	u64_stats_update_begin (&tx_stats->syncp);
+	tx_stats->tx_packets++;
+	tx_stats->tx_bytes += len;
+	u64_stats_update_end (&tx_stats->syncp);
+
+	u64_stats_update_begin (&txq_stats->syncp);
+	txq_stats->packets++;
+	txq_stats->bytes += len;
+	u64_stats_update_end (&txq_stats->syncp);
+
+	if (sink == RAVEN_SINK_DROP) {
+#ifdef OVBENCH
+		if (0 < skb->ovbench_type && skb->ovbench_type < 7) {
+			copy_ovbench_params (skb, rdev);
+		}
+#endif
+
+		kfree_skb (skb);
 		return NETDEV_TX_OK;
 	}
 
 	return NETDEV_TX_OK;
 
+tx_drop:
+	trace_madcap_drop (skb, MADCAP_STAGE_RAVEN_XMIT);
+	kfree_skb (skb);
 tx_err:
 	dev->stats.tx_errors++;
 
+	u64_stats_update_begin (&txq_stats->syncp);
+	txq_stats->drops++;
+	u64_stats_update_end (&txq_stats->syncp);
+
 	return NETDEV_TX_OK;
 }
 
@@ -757,16 +2275,33 @@ raven_change_mtu (struct net_device *dev, int new_mtu)
 static int
 raven_init (struct net_device *dev)
 {
+	unsigned int n;
+	struct raven_dev *rdev = netdev_priv (dev);
+
 	dev->tstats = netdev_alloc_pcpu_stats (struct pcpu_sw_netstats);
 	if (!dev->tstats)
 		return -ENOMEM;
 
+	rdev->txq_stats = kcalloc (dev->num_tx_queues,
+				   sizeof (struct raven_queue_stats),
+				   GFP_KERNEL);
+	if (!rdev->txq_stats) {
+		free_percpu (dev->tstats);
+		return -ENOMEM;
+	}
+
+	for (n = 0; n < dev->num_tx_queues; n++)
+		u64_stats_init (&rdev->txq_stats[n].syncp);
+
 	return 0;
 }
 
 static void
 raven_uninit (struct net_device *dev)
 {
+	struct raven_dev *rdev = netdev_priv (dev);
+
+	kfree (rdev->txq_stats);
 	free_percpu (dev->tstats);
 }
 
@@ -780,6 +2315,113 @@ static const struct net_device_ops raven_netdev_ops = {
 	.ndo_set_mac_address	= eth_mac_addr,
 };
 
+/* ethtool -S shows per tx queue counters */
+
+static const char raven_txq_stat_names[][ETH_GSTRING_LEN] = {
+	"packets", "bytes", "drops",
+};
+#define RAVEN_TXQ_STATS_NUM	ARRAY_SIZE (raven_txq_stat_names)
+
+static void
+raven_get_drvinfo (struct net_device *dev, struct ethtool_drvinfo *info)
+{
+	strlcpy (info->driver, "raven", sizeof (info->driver));
+	strlcpy (info->version, RAVEN_VERSION, sizeof (info->version));
+}
+
+static int
+raven_get_sset_count (struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return dev->real_num_tx_queues * RAVEN_TXQ_STATS_NUM;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void
+raven_get_strings (struct net_device *dev, u32 sset, u8 *data)
+{
+	unsigned int q, n;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (q = 0; q < dev->real_num_tx_queues; q++) {
+		for (n = 0; n < RAVEN_TXQ_STATS_NUM; n++) {
+			snprintf (data, ETH_GSTRING_LEN, "tx_queue_%u_%s",
+				  q, raven_txq_stat_names[n]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+}
+
+static void
+raven_get_ethtool_stats (struct net_device *dev,
+			 struct ethtool_stats *stats, u64 *data)
+{
+	unsigned int q, start;
+	struct raven_dev *rdev = netdev_priv (dev);
+	struct raven_queue_stats *qs;
+
+	for (q = 0; q < dev->real_num_tx_queues; q++) {
+		qs = &rdev->txq_stats[q];
+		do {
+			start = u64_stats_fetch_begin_irq (&qs->syncp);
+			data[0] = qs->packets;
+			data[1] = qs->bytes;
+			data[2] = qs->drops;
+		} while (u64_stats_fetch_retry_irq (&qs->syncp, start));
+		data += RAVEN_TXQ_STATS_NUM;
+	}
+}
+
+static const struct ethtool_ops raven_ethtool_ops = {
+	.get_drvinfo		= raven_get_drvinfo,
+	.get_link		= ethtool_op_get_link,
+	.get_sset_count		= raven_get_sset_count,
+	.get_strings		= raven_get_strings,
+	.get_ethtool_stats	= raven_get_ethtool_stats,
+};
+
+static struct nla_policy raven_policy[IFLA_RAVEN_MAX + 1] = {
+	[IFLA_RAVEN_PHYSICAL_DEV]	= { .type = NLA_U32 },
+	[IFLA_RAVEN_SINK_MODE]		= { .type = NLA_U32 },
+};
+
+static int
+raven_validate (struct nlattr *tb[], struct nlattr *data[])
+{
+	u32 sink;
+
+	if (!data || !data[IFLA_RAVEN_SINK_MODE])
+		return 0;
+
+	sink = nla_get_u32 (data[IFLA_RAVEN_SINK_MODE]);
+	if (sink > RAVEN_SINK_MAX)
+		return -EINVAL;
+
+	if (sink == RAVEN_SINK_CAPTURE && !capture_ring.hdr) {
+		pr_debug ("capture ring is disabled");
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static int
+raven_changelink (struct net_device *dev, struct nlattr *tb[],
+		  struct nlattr *data[])
+{
+	struct raven_dev *rdev = netdev_priv (dev);
+
+	if (data && data[IFLA_RAVEN_SINK_MODE])
+		rdev->sink_mode = nla_get_u32 (data[IFLA_RAVEN_SINK_MODE]);
+
+	return 0;
+}
+
 static int
 raven_newlink (struct net *net, struct net_device *dev,
 	       struct nlattr *tb[], struct nlattr *data[])
@@ -800,6 +2442,10 @@ raven_newlink (struct net *net, struct net_device *dev,
 		rdev->pdev = pdev;
 	}
 
+	rdev->sink_mode = drop_mode ? RAVEN_SINK_DROP : RAVEN_SINK_FORWARD;
+	if (data && data[IFLA_RAVEN_SINK_MODE])
+		rdev->sink_mode = nla_get_u32 (data[IFLA_RAVEN_SINK_MODE]);
+
 	err = register_netdevice (dev);
 	if (err) {
 		netdev_err (dev, "failed to register netdevice.\n");
@@ -840,13 +2486,17 @@ raven_setup (struct net_device *dev)
 	eth_hw_addr_random (dev);
 	ether_setup (dev);
 	dev->netdev_ops = &raven_netdev_ops;
+	dev->ethtool_ops = &raven_ethtool_ops;
 	dev->destructor = free_netdev;
 
-	/* XXX: qlene 0 causes special data path shortcut on __dev_queue_xmit. 
-	 * More considerlation is needed for the research view.
+	/* qlen 0 and LLTX cause special data path shortcut on
+	 * __dev_queue_xmit. By default, raven behaves as a multiqueue
+	 * NIC: qdisc, queue selection and tx queue lock are used.
 	 */
-	dev->tx_queue_len = 0;	
-	dev->features	|= NETIF_F_LLTX;
+	if (legacy_txq) {
+		dev->tx_queue_len = 0;
+		dev->features	|= NETIF_F_LLTX;
+	}
 	dev->features	|= NETIF_F_NETNS_LOCAL;
 	dev->priv_flags	|= IFF_LIVE_ADDR_CHANGE;	/* XXX: phydev? */
 	netif_keep_dst (dev);
@@ -854,7 +2504,6 @@ raven_setup (struct net_device *dev)
 	INIT_LIST_HEAD (&rdev->list);
 	rwlock_init (&rdev->lock);
 	rdev->dev = dev;
-	rdev->vdev = NULL;	/* alloced by mco_acquire_dev */
 
 	rdev->ou.obj.id = MADCAP_OBJ_ID_UDP;
 	rdev->oc.obj.id = MADCAP_OBJ_ID_LLT_CONFIG;
@@ -867,7 +2516,9 @@ static size_t
 raven_get_size (const struct net_device *dev)
 {
 	/* IFLA_RAVEN_PHYSICAL_DEV */
-	return nla_total_size (sizeof (__u32)) + 0;
+	return nla_total_size (sizeof (__u32)) +
+		/* IFLA_RAVEN_SINK_MODE */
+		nla_total_size (sizeof (__u32)) + 0;
 }
 
 static int
@@ -882,15 +2533,29 @@ raven_fill_info (struct sk_buff *skb, const struct net_device *dev)
 	if (nla_put_u32 (skb, IFLA_RAVEN_PHYSICAL_DEV, ifindex))
 		return -EMSGSIZE;
 
+	if (nla_put_u32 (skb, IFLA_RAVEN_SINK_MODE, rdev->sink_mode))
+		return -EMSGSIZE;
+
 	return 0;
 }
 
+static unsigned int
+raven_get_num_queues (void)
+{
+	return numqueues > 0 ? numqueues : 1;
+}
+
 static struct rtnl_link_ops raven_link_ops __read_mostly = {
 	.kind		= "raven",
 	.maxtype	= IFLA_RAVEN_MAX,
+	.policy		= raven_policy,
 	.priv_size	= sizeof (struct raven_dev),
+	.get_num_tx_queues	= raven_get_num_queues,
+	.get_num_rx_queues	= raven_get_num_queues,
 	.setup		= raven_setup,
+	.validate	= raven_validate,
 	.newlink	= raven_newlink,
+	.changelink	= raven_changelink,
 	.dellink	= raven_dellink,
 	.get_size	= raven_get_size,
 	.fill_info	= raven_fill_info,
@@ -929,13 +2594,74 @@ static struct pernet_operations raven_net_ops = {
 };
 
 
+#ifdef OVBENCH
+#define PROC_NAME		"driver/raven"
+#define HIST_PROC_NAME		"driver/raven-hist"
+#define RECORD_PROC_NAME	"driver/raven-record"
+
+static int
+raven_ovbench_init (void)
+{
+	int rc;
+
+	if (!proc_create (PROC_NAME, S_IRUGO | S_IWUGO | S_IXUGO,
+			  NULL, &raven_file_fops))
+		return -ENOMEM;
+
+	rc = raven_stage_hist_init ();
+	if (rc < 0)
+		goto hist_failed;
+
+	if (!proc_create (HIST_PROC_NAME, S_IRUGO | S_IWUSR,
+			  NULL, &raven_stage_hist_fops)) {
+		rc = -ENOMEM;
+		goto hist_proc_failed;
+	}
+
+	if (record_slots > 0) {
+		rc = raven_ring_set_alloc (&record_rings,
+					   sizeof (struct raven_record),
+					   record_slots);
+		if (rc < 0)
+			goto record_failed;
+
+		if (!proc_create (RECORD_PROC_NAME, S_IRUGO | S_IWUSR,
+				  NULL, &raven_record_fops)) {
+			raven_ring_set_free (&record_rings);
+			rc = -ENOMEM;
+			goto record_failed;
+		}
+	}
+
+	return 0;
+
+record_failed:
+	remove_proc_entry (HIST_PROC_NAME, NULL);
+hist_proc_failed:
+	raven_stage_hist_exit ();
+hist_failed:
+	remove_proc_entry (PROC_NAME, NULL);
+	return rc;
+}
+
+static void
+raven_ovbench_exit (void)
+{
+	if (record_rings.area) {
+		remove_proc_entry (RECORD_PROC_NAME, NULL);
+		raven_ring_set_free (&record_rings);
+	}
+
+	remove_proc_entry (HIST_PROC_NAME, NULL);
+	remove_proc_entry (PROC_NAME, NULL);
+	raven_stage_hist_exit ();
+}
+#endif
+
 static __init int
 raven_init_module (void)
 {
 	int rc;
-#ifdef OVBENCH
-	struct proc_dir_entry *ent;
-#endif
 
 	get_random_bytes (&raven_salt, sizeof (raven_salt));
 
@@ -947,26 +2673,85 @@ raven_init_module (void)
 	if (rc < 0)
 		goto rtnl_failed;
 
-#ifdef OVBENCH
-#define PROC_NAME	"driver/raven"
-        ent = proc_create(PROC_NAME, S_IRUGO | S_IWUGO | S_IXUGO,
-			  NULL, &raven_file_fops);
-	if (ent == NULL) {
-		rtnl_link_unregister (&raven_link_ops);
-		unregister_pernet_subsys (&raven_net_ops);
-		return -ENOMEM;
+	rc = register_netevent_notifier (&raven_netevent_nb);
+	if (rc < 0)
+		goto netevent_failed;
+
+	if (capture_slots > 0) {
+#define CAPTURE_PROC_NAME	"driver/raven-capture"
+		rc = raven_ring_alloc (&capture_ring, RAVEN_CAPTURE_SLOT_SIZE,
+				       capture_slots);
+		if (rc < 0)
+			goto capture_failed;
+
+		if (!proc_create (CAPTURE_PROC_NAME, S_IRUGO | S_IWUSR,
+				  NULL, &raven_capture_fops)) {
+			raven_ring_free (&capture_ring);
+			rc = -ENOMEM;
+			goto capture_failed;
+		}
+	}
+
+	if (pmu_sample > 0) {
+#define PMU_PROC_NAME	"driver/raven-pmu"
+		rc = raven_pmu_init ();
+		if (rc < 0)
+			goto pmu_failed;
+
+		if (!proc_create (PMU_PROC_NAME, S_IRUGO | S_IWUSR,
+				  NULL, &raven_pmu_fops)) {
+			raven_pmu_exit ();
+			rc = -ENOMEM;
+			goto pmu_failed;
+		}
+	}
+
+	if (stamp_latency) {
+		rc = raven_latency_init ();
+		if (rc < 0)
+			goto latency_failed;
 	}
+
+#ifdef OVBENCH
+	rc = raven_ovbench_init ();
+	if (rc < 0)
+		goto ovbench_failed;
 #endif
 
 	pr_info ("raven (%s) is loaded.", RAVEN_VERSION);
 
 	if (drop_mode)
 		pr_info ("drop mode on");
+	if (capture_ring.hdr)
+		pr_info ("capture ring %d slots", capture_slots);
+	if (raven_pmu)
+		pr_info ("pmu sampling 1/%d packets", pmu_sample);
 	if (madcap_enable)
 		pr_info ("madcap mode on");
+	if (raven_latency_hist.cpu)
+		pr_info ("latency stamps on");
 
 	return 0;
 
+#ifdef OVBENCH
+ovbench_failed:
+	if (raven_latency_hist.cpu)
+		raven_latency_exit ();
+#endif
+latency_failed:
+	if (raven_pmu) {
+		remove_proc_entry (PMU_PROC_NAME, NULL);
+		raven_pmu_exit ();
+	}
+pmu_failed:
+	if (capture_ring.hdr) {
+		remove_proc_entry (CAPTURE_PROC_NAME, NULL);
+		raven_ring_free (&capture_ring);
+	}
+capture_failed:
+	unregister_netevent_notifier (&raven_netevent_nb);
+netevent_failed:
+	rtnl_link_unregister (&raven_link_ops);
 rtnl_failed:
 	unregister_pernet_subsys (&raven_net_ops);
 netns_failed:
@@ -977,11 +2762,25 @@ module_init (raven_init_module)
 static void __exit
 raven_exit_module (void)
 {
+	unregister_netevent_notifier (&raven_netevent_nb);
 	rtnl_link_unregister (&raven_link_ops);
 	unregister_pernet_subsys (&raven_net_ops);
 
+	if (capture_ring.hdr) {
+		remove_proc_entry (CAPTURE_PROC_NAME, NULL);
+		raven_ring_free (&capture_ring);
+	}
+
+	if (raven_pmu) {
+		remove_proc_entry (PMU_PROC_NAME, NULL);
+		raven_pmu_exit ();
+	}
+
+	if (raven_latency_hist.cpu)
+		raven_latency_exit ();
+
 #ifdef OVBENCH
-	remove_proc_entry (PROC_NAME, NULL);
+	raven_ovbench_exit ();
 #endif
 	pr_info ("raven (%s) is unloaded.", RAVEN_VERSION);
 }